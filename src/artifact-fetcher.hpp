@@ -3,13 +3,27 @@
 #include <vector>
 #include <string>
 #include <regex>
+#include <fstream>
+#include <limits>
+#include <algorithm>
+#include <list>
+#include <memory>
+#include <optional>
+#include <cstdint>
 
 #include "curlpp/cURLpp.hpp"
 #include "curlpp/Easy.hpp"
 #include "curlpp/Options.hpp"
+#include "curlpp/Infos.hpp"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "logging.hpp"
 #include "encoding.hpp"
+#include "cancellation.hpp"
+#include "cache.hpp"
 
 namespace artifact {
 
@@ -18,17 +32,149 @@ class data_consumer {
 public:
   virtual void size_hint(size_t) = 0;
   virtual void on_data(const char_t* data, size_t count) = 0;
+  /// the data starts after the given number of lines, told only for parts of a resource
+  virtual void skipped(size_t) {}
+};
+
+/**
+ * \brief The part of a resource to fetch, given as the fragment of its url:
+ *   url#bytes=<first>-<last>  from the byte first to the byte last, both included
+ *   url#bytes=<first>-        from the byte first to the end
+ *   url#bytes=-<count>        the last count bytes
+ *   url#lines=-<count>        the last count lines
+ * Sizes can be followed by K, M or G (powers of 1024). A part starting in the middle of a line
+ * starts with the next line instead, one ending in the middle of a line keeps what it has of it.
+*/
+struct range_t {
+
+  enum kind_t {
+    whole,
+    span,
+    last_bytes,
+    last_lines
+  };
+
+  kind_t kind = whole;
+  uint64_t first = 0; // span only
+  uint64_t last = std::numeric_limits<uint64_t>::max(); // span only, included
+  uint64_t count = 0; // last_bytes and last_lines only
+
+  bool partial() const {
+    return whole != kind;
+  }
+
+  /**
+   * parses the part of the resource from its url
+   * \throw std::runtime_error if the fragment of the url is not a valid part
+  */
+  static range_t of(const std::string& url) {
+
+    range_t range;
+
+    const auto hash = url.find('#');
+    if (std::string::npos == hash) {
+      return range;
+    }
+
+    static const std::regex part_rx(R"(^(bytes|lines)=(\d+[KMG]?)?-(\d+[KMG]?)?$)");
+    const auto fragment = url.substr(hash + 1);
+    std::smatch match;
+    if (not std::regex_match(fragment, match, part_rx) or not (match[2].matched or match[3].matched)) {
+      throw std::runtime_error("invalid part '" + fragment + "' of " + url);
+    }
+
+    if ("lines" == match[1]) {
+      if (match[2].matched or not match[3].matched) {
+        throw std::runtime_error("only the last lines of " + url + " can be fetched");
+      }
+      range.kind = last_lines;
+      range.count = size_of(match[3]);
+    } else if (not match[2].matched) {
+      range.kind = last_bytes;
+      range.count = size_of(match[3]);
+    } else {
+      range.kind = span;
+      range.first = size_of(match[2]);
+      if (match[3].matched) {
+        range.last = size_of(match[3]);
+      }
+      if (range.last < range.first) {
+        throw std::runtime_error("invalid part '" + fragment + "' of " + url);
+      }
+    }
+
+    return range;
+  }
+
+private:
+
+  static uint64_t size_of(const std::string& str) {
+    const auto shift = std::string("KMG").find(str.back());
+    return std::stoull(str) << (std::string::npos == shift ? 0 : 10 * (shift + 1));
+  }
 };
 
+/// the url without its fragment, if any
+static inline std::string without_fragment(const std::string& url) {
+  return url.substr(0, url.find('#'));
+}
+
+template <typename char_t>
+static constexpr bool is_endline(char_t c) {
+  return '\n' == c or '\r' == c;
+}
+
 template <typename char_t>
 class downloader {
 public:
-  downloader(const std::string& url, data_consumer<char_t>& observer)
-    : observer(observer), decode(nullptr) {
+  /**
+   * c'tor
+   * \param url the url of the resource, without fragment
+   * \param observer the consumer of the data
+   * \param token aborts the transfer once cancelled
+   * \param range the part of the resource to fetch, the last lines excluded
+   * \param store the cache of the resources, only whole resources are cached
+  */
+  downloader(const std::string& url,
+             data_consumer<char_t>& observer,
+             const cancellation& token = cancellation::none(),
+             const range_t& range = range_t(),
+             cache* store = nullptr)
+    : url(url), observer(observer), decode(nullptr), token(token), range(range), status(0),
+      length(0), start(0), started(false), skip(0), left(std::numeric_limits<uint64_t>::max()),
+      cut(false), cut_end(false), done(false), store(range.partial() ? nullptr : store) {
     request.setOpt(curlpp::options::Url(url));
+
+    // the server tells if the cached copy is still valid, sending nothing more if so
+    if (this->store and (cached = this->store->lookup(url))) {
+      std::list<std::string> conditions;
+      if (not cached->etag.empty()) {
+        conditions.push_back("If-None-Match: " + cached->etag);
+      }
+      if (not cached->modified.empty()) {
+        conditions.push_back("If-Modified-Since: " + cached->modified);
+      }
+      request.setOpt(curlpp::options::HttpHeader(conditions));
+    }
+
+    // one byte more than asked for, which tells if the part starts with a line of its own
+    if (range_t::span == range.kind) {
+      request.setOpt(curlpp::options::Range(std::to_string(range.first ? range.first - 1 : 0) + "-" +
+        (range.last == std::numeric_limits<uint64_t>::max() ? "" : std::to_string(range.last))));
+    } else if (range_t::last_bytes == range.kind) {
+      request.setOpt(curlpp::options::Range("-" + std::to_string(range.count + 1)));
+    }
+
     request.setOpt(curlpp::options::Header(false));
     request.setOpt(curlpp::options::NoSignal(true));
-    request.setOpt(curlpp::options::NoProgress(true));
+
+    // invoked periodically even when no data flows, a non zero result aborts the transfer
+    request.setOpt(curlpp::options::NoProgress(false));
+    request.setOpt(curlpp::options::ProgressFunction(
+      [this](double, double, double, double) -> int {
+        return this->token.cancelled() ? 1 : 0;
+      })
+    );
 
     request.setOpt(curlpp::options::HeaderFunction(
     [this](char* data, size_t size, size_t count) -> size_t {
@@ -43,21 +189,163 @@ public:
   }
 
   void perform() {
-    request.perform();
+
+    transfer();
+
+    if (304 == status and cached) {
+      if (replay()) {
+        return;
+      }
+      log_warning << "the cached copy of " << url << " is gone, downloading it again";
+      cached.reset();
+      request.setOpt(curlpp::options::HttpHeader(std::list<std::string>()));
+      transfer();
+    }
+
+    if (writer) {
+      try {
+        writer->commit();
+      } catch (const std::exception& ex) {
+        log_warning << "cannot cache " << url << ": " << ex.what();
+      }
+    }
+  }
+
+  /// tells if the data fetched starts at the beginning of the resource
+  bool from_start() const {
+    return 0 == start;
   }
 
 private:
 
   using encoding_t = encoding::basic_encoder<char_t>;
 
-  size_t on_data(char* ptr, size_t size) {
+  void transfer() {
+    try {
+      request.perform();
+    } catch (...) {
+      if (not done) {
+        throw;
+      }
+      // the transfer was aborted once the part was complete
+    }
+  }
+
+  /**
+   * feeds the consumer with the cached copy of the resource, the server told it is still valid
+   * \return false if the copy is gone or corrupted, the consumer got nothing then
+  */
+  bool replay() {
+    log_info << url << " not modified, using the cached copy";
+    if (not cached->type.empty()) {
+      parse_content_type(cached->type);
+    }
+    observer.size_hint(cached->size);
+    return store->read(url, [this](const char* data, size_t size){
+      token.check();
+      on_data(data, size);
+    });
+  }
+
+  /**
+   * starts caching the resource, if the server sent a way to revalidate it later
+  */
+  void keep() {
+    if (200 != status or (etag.empty() and modified.empty())) {
+      log_debug << "not caching " << url << ", status " << status;
+      return;
+    }
+    try {
+      writer = store->store(url, {etag, modified, type, 0});
+    } catch (const std::exception& ex) {
+      log_warning << "cannot cache " << url << ": " << ex.what();
+    }
+  }
+
+  /**
+   * locates the data received in the resource, once the headers are known: a server that
+   * ignores the range sends the whole resource, the bytes outside of the part are skipped then
+  */
+  void locate() {
+
+    started = true;
+
+    if (store) {
+      keep();
+    }
+
+    if (not range.partial()) {
+      return;
+    }
+
+    if (206 == status) {
+      // the start is given by the Content-Range header
+    } else if (range_t::span == range.kind) {
+      start = range.first ? range.first - 1 : 0;
+      skip = start;
+      if (range.last != std::numeric_limits<uint64_t>::max()) {
+        left = range.last - start + 1;
+      }
+    } else if (length) {
+      start = length > range.count + 1 ? length - range.count - 1 : 0;
+      skip = start;
+    } else {
+      log_warning << "the server ignored the range and the size is unknown, using it all";
+      start = 0;
+    }
+
+    cut = start > 0; // the first line may not be complete
+    if (cut) {
+      log_info << "the lines of a part are numbered from around byte " << start;
+    }
+  }
+
+  size_t on_data(const char* ptr, size_t size) {
+
+    if (token.cancelled()) {
+      return 0; // aborts the transfer
+    }
 
     if (not decode) {
       log_warning << "unknown encoding, defaulting to UTF8";
       decode = encoding::UTF8;
     }
 
+    if (not started) {
+      locate();
+    }
+
+    if (writer) {
+      try {
+        writer->write(ptr, size);
+      } catch (const std::exception& ex) {
+        log_warning << "cannot cache " << url << ": " << ex.what();
+        writer.reset();
+      }
+    }
+
     for (size_t s = 0; s < size; ++s) {
+      if (skip) {
+        --skip;
+        continue;
+      }
+      if (0 == left) {
+        done = true;
+        return 0; // aborts the transfer, the rest is not needed
+      }
+      --left;
+      if (cut) {
+        // the line cut by the beginning of the part is dropped up to the next line: no byte of
+        // a multibyte character can be taken for a line end
+        if (is_endline(ptr[s])) {
+          cut_end = true;
+          continue;
+        }
+        if (not cut_end) {
+          continue;
+        }
+        cut = false;
+      }
       feeder.push(ptr[s]);
       char_t c;
       switch(decode(feeder, c)) {
@@ -88,7 +376,8 @@ private:
     } else {
       std::copy(clength.begin(), clength.end(), temp);
       temp[clength.size()] = 0;
-      observer.size_hint(atoll(temp));
+      length = atoll(temp);
+      observer.size_hint(length);
     }
   }
 
@@ -128,11 +417,39 @@ private:
   size_t on_header(char* ptr, size_t size) {
     static const std::regex ctype_rx(R"(^[Cc]ontent-[Tt]ype: (.+))", std::regex::optimize);
     static const std::regex cleng_rx(R"(Content-Length: (\d+))", std::regex::optimize);
+    static const std::regex status_rx(R"(^HTTP/[\d.]+ (\d{3}))", std::regex::optimize);
+    static const std::regex crange_rx(R"(^[Cc]ontent-[Rr]ange: bytes (\d+)-)", std::regex::optimize);
+    static const std::regex etag_rx(R"(^[Ee][Tt]ag: *([^\r\n]+))", std::regex::optimize);
+    static const std::regex lmod_rx(R"(^[Ll]ast-[Mm]odified: *([^\r\n]+))", std::regex::optimize);
 
     std::cmatch match;
     std::string_view header(ptr, size);
 
+    // a new response starts, after a redirection for instance
+    if (std::regex_search(header.begin(), header.end(), match, status_rx) and 2 == match.size()) {
+      status = std::stol(match[1].str());
+      length = 0;
+      start = 0;
+      started = false;
+      etag.clear();
+      modified.clear();
+      type.clear();
+    }
+
+    if (std::regex_search(header.begin(), header.end(), match, etag_rx) and 2 == match.size()) {
+      etag = match[1].str();
+    }
+
+    if (std::regex_search(header.begin(), header.end(), match, lmod_rx) and 2 == match.size()) {
+      modified = match[1].str();
+    }
+
+    if (std::regex_search(header.begin(), header.end(), match, crange_rx) and 2 == match.size()) {
+      start = std::stoull(match[1].str());
+    }
+
     if (std::regex_search(header.begin(), header.end(), match, ctype_rx) and 2 == match.size()) {
+      type = match[1].str();
       parse_content_type(std::string_view(match[1].first, match[1].length()));
     }
 
@@ -150,22 +467,44 @@ private:
   };
 
   curlpp::Easy request;
+  const std::string url;
   data_consumer<char_t>& observer;
   encoding::buffered_feeder feeder;
   encoding_t decode;
+  const cancellation& token;
+  const range_t range;
+  long status;
+  uint64_t length; // as told by the Content-Length header
+  uint64_t start; // of the data received, in the resource
+  bool started; // receiving the body
+  uint64_t skip; // the bytes to skip before the part
+  uint64_t left; // the bytes left in the part
+  bool cut; // dropping the line cut by the beginning of the part
+  bool cut_end; // and the line ends after it
+  bool done; // the part is complete
+  cache* store;
+  std::optional<cache::entry> cached; // the copy to revalidate, if any
+  std::unique_ptr<cache::writer> writer; // the copy being stored, if any
+  std::string etag, modified, type; // as told by the headers
 };
 
 template <typename char_t>
 class loader {
 public:
-  loader(std::istream& stream, data_consumer<char_t>& observer) : feeder(stream), stream(stream), observer(observer), decode(encoding::UTF8) {}
+  loader(std::istream& stream,
+         data_consumer<char_t>& observer,
+         const cancellation& token = cancellation::none())
+    : feeder(stream), stream(stream), observer(observer), decode(encoding::UTF8), token(token) {}
   void perform() {
     stream.seekg(0, std::ios_base::seekdir::_S_end);
     const auto size = stream.tellg();
     stream.seekg(0);
     observer.size_hint(size_t(size));
     bool stop = false;
-    while (not stop) {
+    for (size_t count = 0; not stop; ++count) {
+      if (0 == count % check_interval) {
+        token.check();
+      }
       char_t c;
       switch(decode(feeder, c)) {
         case encoding::ok:
@@ -184,10 +523,405 @@ public:
   }
 private:
   using encoding_t = encoding::basic_encoder<char_t>;
+  // the number of characters decoded between two checks of the token
+  static constexpr size_t check_interval = 64 * 1024;
   encoding::istream_feeder feeder;
   std::istream& stream;
   data_consumer<char_t>& observer;
   encoding_t decode;
+  const cancellation& token;
+};
+
+/**
+ * \brief Reads a local file by blocks, at any offset
+*/
+class block_reader final {
+public:
+
+  explicit block_reader(const std::string& path)
+    : fd(open(path.c_str(), O_RDONLY | O_CLOEXEC)), buffer(block_size) {
+    if (fd < 0) {
+      throw std::runtime_error("file not found: " + path);
+    }
+  }
+
+  ~block_reader() {
+    close(fd);
+  }
+
+  uint64_t size() const {
+    struct stat info;
+    return (0 == fstat(fd, &info)) ? uint64_t(info.st_size) : 0;
+  }
+
+  /**
+   * reads the bytes in [from, to) block by block
+   * \param backwards if true the blocks are read from the last one
+   * \param lambda bool lambda(const char* data, size_t size, uint64_t offset), returns false to
+   * stop reading
+  */
+  template <typename Lambda>
+  void scan(uint64_t from, uint64_t to, bool backwards, const cancellation& token, const Lambda& lambda) {
+    while (from < to) {
+      token.check();
+      const size_t size = std::min<uint64_t>(block_size, to - from);
+      const uint64_t offset = backwards ? to - size : from;
+      read(offset, size);
+      if (not lambda(buffer.data(), size, offset)) {
+        return;
+      }
+      if (backwards) {
+        to -= size;
+      } else {
+        from += size;
+      }
+    }
+  }
+
+private:
+
+  block_reader(const block_reader&) = delete;
+  block_reader& operator = (const block_reader&) = delete;
+
+  void read(uint64_t offset, size_t size) {
+    for (size_t done = 0; done < size; ) {
+      const ssize_t got = pread(fd, buffer.data() + done, size - done, offset + done);
+      if (got < 0 and EINTR == errno) {
+        continue;
+      }
+      if (got <= 0) {
+        throw std::runtime_error(std::string("cannot read: ") + (got ? strerror(errno) : "truncated"));
+      }
+      done += got;
+    }
+  }
+
+  static constexpr size_t block_size = 64 * 1024;
+
+  const int fd;
+  std::vector<char> buffer;
+};
+
+/**
+ * Feeds a consumer with the decoded content of a part of a local file: the bytes of the part
+ * are read and decoded, those before it are only scanned to count the lines they hold, so that
+ * the lines of the part keep their numbers.
+ * \param path the path of the file
+ * \param range the part of the file
+ * \param observer the consumer of the data
+ * \param token aborts the reading once cancelled, its reason is thrown
+ */
+template <typename char_t>
+void read_part(const std::string& path,
+               const range_t& range,
+               data_consumer<char_t>& observer,
+               const cancellation& token = cancellation::none()) {
+
+  block_reader file(path);
+  const uint64_t size = file.size();
+  uint64_t begin = 0, end = size;
+
+  switch (range.kind) {
+    case range_t::span:
+      begin = std::min(range.first, size);
+      end = range.last < size ? range.last + 1 : size;
+      break;
+    case range_t::last_bytes:
+      begin = size - std::min(range.count, size);
+      break;
+    case range_t::last_lines: {
+      // walks back from the end until enough lines started
+      uint64_t lines = 0;
+      bool text = false;
+      begin = range.count ? 0 : size;
+      file.scan(0, range.count ? size : 0, true, token, [&](const char* data, size_t n, uint64_t offset){
+        for (size_t i = n; i-- > 0; ) {
+          if (not is_endline(data[i])) {
+            text = true;
+          } else if (text) {
+            text = false;
+            if (++lines == range.count) {
+              begin = offset + i + 1;
+              return false;
+            }
+          }
+        }
+        return true;
+      });
+      break;
+    }
+    default:
+      break;
+  }
+
+  // the line cut by the beginning of the part belongs to the part before, the part starts with
+  // the first line after it
+  if (begin > 0 and begin < end) {
+    bool cut = true;
+    file.scan(begin - 1, end, false, token, [&](const char* data, size_t n, uint64_t offset){
+      for (size_t i = 0; i < n; ++i) {
+        if (is_endline(data[i])) {
+          cut = false;
+        } else if (not cut) {
+          begin = offset + i;
+          return false;
+        }
+      }
+      begin = end;
+      return true;
+    });
+  }
+
+  // as in basic_file, a file starting with a line end starts with an empty line
+  uint64_t lines = 0;
+  bool text = false;
+  file.scan(0, begin, false, token, [&](const char* data, size_t n, uint64_t offset){
+    for (size_t i = 0; i < n; ++i) {
+      const bool endline = is_endline(data[i]);
+      lines += (not endline and not text) or (endline and 0 == offset + i);
+      text = not endline;
+    }
+    return true;
+  });
+  observer.skipped(lines);
+
+  observer.size_hint(end - begin);
+
+  encoding::chunk_decoder<char_t> decoder(encoding::UTF8<char_t>);
+  std::vector<char_t> decoded;
+  file.scan(begin, end, false, token, [&](const char* data, size_t n, uint64_t){
+    decoded.clear();
+    decoder.feed(data, n, decoded);
+    observer.on_data(decoded.data(), decoded.size());
+    return true;
+  });
+}
+
+/**
+ * \brief Keeps all the data in memory
+*/
+template <typename char_t>
+class collector final : public data_consumer<char_t> {
+public:
+  virtual void size_hint(size_t size) override {
+    data.reserve(size);
+  }
+  virtual void on_data(const char_t* ptr, size_t count) override {
+    data.insert(data.end(), ptr, ptr + count);
+  }
+  std::vector<char_t> data;
 };
 
+/**
+ * Feeds a consumer with the last lines of a remote resource: the resource is fetched by parts
+ * from its end, each part four times larger than the previous one, until one holds enough lines
+ * \param url the url of the resource, without fragment
+ * \param count the number of lines
+ * \param observer the consumer of the data
+ * \param token aborts the transfer once cancelled
+ */
+template <typename char_t>
+void download_last_lines(const std::string& url,
+                         uint64_t count,
+                         data_consumer<char_t>& observer,
+                         const cancellation& token = cancellation::none()) {
+
+  if (0 == count) {
+    return;
+  }
+
+  range_t range;
+  range.kind = range_t::last_bytes;
+
+  for (range.count = std::max<uint64_t>(64 * 1024, count * 128); ; range.count *= 4) {
+
+    collector<char_t> part;
+    downloader<char_t> fetcher(url, part, token, range);
+    fetcher.perform();
+
+    // the part starts with a line of its own already
+    uint64_t lines = 0;
+    bool text = false;
+    for (size_t i = part.data.size(); i-- > 0; ) {
+      if (not is_endline(part.data[i])) {
+        text = true;
+      } else if (text) {
+        text = false;
+        if (++lines == count) {
+          observer.on_data(part.data.data() + i + 1, part.data.size() - i - 1);
+          return;
+        }
+      }
+    }
+
+    if (fetcher.from_start()) {
+      observer.on_data(part.data.data(), part.data.size());
+      return;
+    }
+
+    log_debug << "not enough lines in the last " << range.count << " bytes of " << url;
+  }
+}
+
+enum source_t {unknown, local, http};
+
+static inline source_t source_of(const std::string& uri) {
+
+  static const std::pair<std::regex, source_t> protocols[] = {
+    std::make_pair(std::regex(R"(^https?:\/{2}([\w\-\.\/\_\~]+))"), http),
+    std::make_pair(std::regex(R"(^file:\/{2}([\w\-\.\/\_\~]+))"), local)
+  };
+
+  for (const auto& pair : protocols) {
+    if (std::regex_search(uri, pair.first)) {
+      return pair.second;
+    }
+  }
+
+  log_warning << "unknown protocol for '" << uri << "'";
+  return unknown;
+}
+
+static inline std::string remove_protocol(const std::string& uri) {
+
+  static const std::regex proto(R"(^(?:file|https?|):\/\/([\w\-\.\/\_\~]+))");
+
+  std::smatch match;
+  if (std::regex_search(uri, match, proto) and match.size() == 2) {
+    return match[1].str();
+  }
+
+  log_warning << "no known protocol in '" << uri << "'";
+  return uri;
+}
+
+/**
+ * Feeds a consumer with the decoded content of a local or remote resource
+ * \param source where the resource is
+ * \param resource the url of the resource, or its path if local
+ * \param observer the consumer of the data
+ * \param token aborts the transfer once cancelled, its reason is thrown
+ * \param range the part of the resource to fetch
+ * \param store the cache of the remote resources, if any
+ */
+template <typename char_t>
+void fetch(source_t source,
+           const std::string& resource,
+           data_consumer<char_t>& observer,
+           const cancellation& token = cancellation::none(),
+           const range_t& range = range_t(),
+           cache* store = nullptr) {
+  token.check();
+  switch (source) {
+    case local: {
+      if (range.partial()) {
+        read_part(resource, range, observer, token);
+        break;
+      }
+      std::ifstream stream(resource, std::ios_base::in | std::ios_base::binary);
+      if (not stream.is_open()) {
+        throw std::runtime_error("file not found: " + resource);
+      }
+      loader<char_t>(stream, observer, token).perform();
+      break;
+    }
+    case http: {
+      try {
+        if (range_t::last_lines == range.kind) {
+          download_last_lines(resource, range.count, observer, token);
+        } else {
+          downloader<char_t>(resource, observer, token, range, store).perform();
+        }
+      } catch (...) {
+        token.check(); // an aborted transfer reports why it was aborted
+        throw;
+      }
+      break;
+    }
+    default:
+      throw std::runtime_error("invalid source type");
+      break;
+  }
+}
+
+/**
+ * Feeds a consumer with the decoded content of the resource at the given url, the source is
+ * inferred from the protocol and the part to fetch, if any, from the fragment
+ * \param url the url of the resource
+ * \param observer the consumer of the data
+ * \param token aborts the transfer once cancelled, its reason is thrown
+ * \param store the cache of the remote resources, if any
+ */
+template <typename char_t>
+void fetch(const std::string& url,
+           data_consumer<char_t>& observer,
+           const cancellation& token = cancellation::none(),
+           cache* store = nullptr) {
+  const auto range = range_t::of(url);
+  const auto resource = without_fragment(url);
+  switch (source_of(resource)) {
+    case http:
+      return fetch(http, resource, observer, token, range, store);
+    case local:
+      return fetch(local, remove_protocol(resource), observer, token, range);
+    default:
+      break;
+  }
+  throw std::runtime_error("Unknown protocol");
+}
+
+/**
+ * Tells the size of the resource at the given url, without fetching it
+ * \param url the url of the resource
+ * \param token aborts the request once cancelled
+ * \param store the cache of the remote resources, a cached resource is not asked for its size
+ * \return the size in bytes, or 0 if unknown
+ */
+inline size_t size_of(const std::string& url,
+                      const cancellation& token = cancellation::none(),
+                      const cache* store = nullptr) {
+
+  // the size of a part, if it can be told without the size of the resource
+  const auto range = range_t::of(url);
+  if (range_t::last_bytes == range.kind) {
+    return range.count;
+  }
+  if (range_t::span == range.kind and range.last != std::numeric_limits<uint64_t>::max()) {
+    return range.last - range.first + 1;
+  }
+
+  switch (source_of(url)) {
+    case local: {
+      struct stat info;
+      return (0 == stat(remove_protocol(url).c_str(), &info)) ? size_t(info.st_size) : 0;
+    }
+    case http: {
+      if (const auto cached = store ? store->lookup(without_fragment(url)) : std::nullopt) {
+        return cached->size;
+      }
+      try {
+        curlpp::Easy request;
+        request.setOpt(curlpp::options::Url(without_fragment(url)));
+        request.setOpt(curlpp::options::NoBody(true));
+        request.setOpt(curlpp::options::NoSignal(true));
+        request.setOpt(curlpp::options::NoProgress(false));
+        request.setOpt(curlpp::options::ProgressFunction(
+          [&token](double, double, double, double) -> int {
+            return token.cancelled() ? 1 : 0;
+          })
+        );
+        request.perform();
+        const auto length = curlpp::infos::ContentLengthDownload::get(request);
+        return length > 0 ? size_t(length) : 0;
+      } catch (const std::exception& ex) {
+        log_debug << "cannot get the size of " << url << ": " << ex.what();
+      }
+      return 0;
+    }
+    default:
+      break;
+  }
+  return 0;
+}
+
 }
@@ -7,6 +7,11 @@
 #include <regex>
 #include <fstream>
 #include <variant>
+#include <memory>
+#include <algorithm>
+#include <type_traits>
+#include <cctype>
+#include <cwctype>
 
 #include "curlpp/cURLpp.hpp"
 #include "curlpp/Easy.hpp"
@@ -72,7 +77,7 @@ public:
       ptr_ = std::move(other.ptr_);
       imm_ptr_ = std::move(other.imm_ptr_);
       size_ = std::move(other.size_);
-      imm_size_ = std::move(other.size_);
+      imm_size_ = std::move(other.imm_size_);
       file_ = std::move(other.file_);
       number_ = std::move(other.number_);
       hash_ = std::move(other.hash_);
@@ -125,11 +130,21 @@ public:
 
 private:
 
+  // the <cctype> ones are undefined past a byte, and a wide character easily is
+  static bool is_space(char_t c) {
+    if constexpr (std::is_same_v<char_t, wchar_t>) {
+      return std::iswspace(c);
+    } else {
+      return std::isspace(static_cast<unsigned char>(c));
+    }
+  }
+
   void trim() {
-    while (size_ && std::isspace(*ptr_)) {
+    while (size_ && is_space(*ptr_)) {
       ++ptr_;
+      --size_;
     }
-    while (size_ && std::isspace(ptr_[size_ - 1])) {
+    while (size_ && is_space(ptr_[size_ - 1])) {
       --size_;
     }
   }
@@ -241,6 +256,103 @@ private:
 static_assert(not std::is_copy_constructible<artifact::basic_line<char>>::value, "");
 static_assert(not std::is_copy_assignable<artifact::basic_line<char>>::value, "");
 
+/**
+ * \brief Splits a stream of characters into lines without ever storing the whole artifact.
+ * Each line is copied into a pair of reusable buffers and handed to a lambda, the line is valid
+ * only for the duration of the call; lines are split and numbered exactly like basic_file does.
+ * \note the signature of the lambda is void lambda(basic_line<CharT>& line)
+*/
+template <typename CharT, typename Lambda>
+class basic_line_reader final : public data_consumer<CharT> {
+public:
+
+  using char_t = CharT;
+  using line_t = basic_line<char_t>;
+
+  explicit basic_line_reader(Lambda lambda) : lambda(std::move(lambda)), count(0), start(true) {
+  }
+
+  /**
+   * feeds the reader with the content of the artifact at the given url
+   * \param url the url of the artifact
+   * \param token aborts the reading once cancelled
+   * \param store the cache of the remote artifacts, if any
+  */
+  void read(const std::string& url,
+            const cancellation& token = cancellation::none(),
+            cache* store = nullptr) {
+    artifact::fetch(url, *this, token, store);
+    flush();
+  }
+
+  /**
+   * emits the last line even if not terminated
+  */
+  void flush() {
+    if (not mut.empty()) {
+      imm = mut;
+      line_t line(nullptr, ++count, mut.data(), imm.data(), mut.size());
+      lambda(line);
+      mut.clear();
+    }
+  }
+
+  /// the number of lines emitted so far
+  size_t lines() const {
+    return count;
+  }
+
+  // data_consumer
+  virtual void size_hint(size_t) override {
+  }
+
+  // data_consumer
+  virtual void on_data(const char_t* ptr, size_t size) override {
+    for (size_t i = 0; i < size; ++i) {
+      if (ptr[i] == '\n' or ptr[i] == '\r') {
+        if (start) {
+          // an empty line of its own, as in basic_file, the other empty lines are skipped
+          line_t line(nullptr, ++count, mut.data(), imm.data(), 0);
+          lambda(line);
+        }
+        flush();
+      } else {
+        mut.push_back(ptr[i]);
+      }
+      start = false;
+    }
+  }
+
+  // data_consumer
+  virtual void skipped(size_t lines) override {
+    count = lines;
+  }
+
+private:
+  Lambda lambda;
+  std::vector<char_t> mut, imm;
+  size_t count;
+  bool start; // nothing read yet
+};
+
+/**
+ * Streams the artifact at the given url through a basic_line_reader
+ * \param url the url of the artifact
+ * \param lambda the lambda that will be invoked for each line
+ * \param token aborts the reading once cancelled
+ * \param store the cache of the remote artifacts, if any
+ * \return the number of lines read
+*/
+template <typename CharT, typename Lambda>
+size_t read_lines(const std::string& url,
+                  const Lambda& lambda,
+                  const cancellation& token = cancellation::none(),
+                  cache* store = nullptr) {
+  basic_line_reader<CharT, Lambda> reader(lambda);
+  reader.read(url, token, store);
+  return reader.lines();
+}
+
 template <typename CharT>
 class basic_file final : data_consumer<CharT> {
 public:
@@ -260,6 +372,7 @@ public:
   basic_file<char_t>& operator = (basic_file<char_t>&& other) {
     if (this != &other) {
       url = std::move(other.url);
+      skip = other.skip;
       data = std::move(other.data);
       table = std::move(other.table);
       for (line_t& line : table) {
@@ -303,61 +416,111 @@ public:
     return not table.empty();
   }
 
-private:
-
-  enum source_t {unknown, local, http};
-
-public:
+  static basic_file<char_t> download(const std::string& url,
+                                     const cancellation& token = cancellation::none()) {
+    return basic_file<char_t>(http, url, token);
+  }
 
-  static basic_file<char_t> download(const std::string& url) {
-    return basic_file<char_t>(http, url);
+  static basic_file<char_t> load(const std::string& url,
+                                 const cancellation& token = cancellation::none()) {
+    return basic_file<char_t>(local, url, token);
   }
 
-  static basic_file<char_t> load(const std::string& url) {
-    return basic_file<char_t>(local, url);
+  /**
+   * fetches the resource, or the part of it given by the fragment of the url (see range_t)
+   * \param url the url of the resource
+   * \param token aborts the transfer once cancelled
+  */
+  static basic_file<char_t> fetch(const std::string& url,
+                                  const cancellation& token = cancellation::none()) {
+    return basic_file<char_t>(url, token);
   }
 
-  static basic_file<char_t> fetch(const std::string& url) {
-    switch (from(url)) {
-      case http:
-        return download(url);
-      case local:
-        return load(remove_protocol(url));
-      default:
-        break;
-    }
-    throw std::runtime_error("Unknown protocol");
+  /**
+   * builds a file out of characters already decoded, numbering its lines from 1
+   * \param text the content of the file
+  */
+  static basic_file<char_t> parse(const string_view& text) {
+    basic_file<char_t> file;
+    file.size_hint(text.size());
+    file.on_data(text.data(), text.size());
+    file.build_table();
+    return file;
   }
 
   const std::string& name() const {
     return url;
   }
 
+  /**
+   * moves the content of the file into new buffers, each line copied by the thread that first
+   * touches its part of the buffers: on NUMA systems that is where the memory gets allocated,
+   * so the lines end up local to the threads that copied them
+   * \param for_each invoked as for_each(lines, lambda), it must apply lambda to each line once
+   * \note the bytes that do not belong to any line are left uninitialized
+  */
+  template <typename ForEach>
+  void place(const ForEach& for_each) {
+    data_t<char_t> fresh;
+    fresh.resize(data.size());
+    const char_t* const mut = data.mut.get();
+    const char_t* const imm = data.imm.get();
+    for_each(table, [&fresh, mut, imm](line_t& line){
+      const size_t first = line.imm_ptr_ - imm;
+      const size_t offset = line.ptr_ - mut;
+      const size_t last = std::max(first + line.imm_size_, offset + line.size_);
+      std::copy(mut + first, mut + last, fresh.mut.get() + first);
+      std::copy(imm + first, imm + first + line.imm_size_, fresh.imm.get() + first);
+      line.ptr_ = fresh.mut.get() + offset;
+      line.imm_ptr_ = fresh.imm.get() + first;
+    });
+    data = std::move(fresh);
+  }
+
 private:
 
+  /**
+   * the content of the file, the buffers are left uninitialized when allocated so that their
+   * pages are only touched when written
+  */
   template <typename char_t>
   struct data_t {
-    std::vector<char_t> mut, imm;
+    std::unique_ptr<char_t[]> mut, imm;
+    size_t length = 0;
+    size_t room = 0;
     inline size_t size() const {
-      return mut.size();
+      return length;
     }
     inline size_t capacity() const {
-      return mut.capacity();
+      return room;
     }
     inline void reserve(size_t sz) {
-      mut.reserve(sz);
-      imm.reserve(sz);
+      if (sz > room) {
+        std::unique_ptr<char_t[]> m(new char_t[sz]), i(new char_t[sz]);
+        std::copy(mut.get(), mut.get() + length, m.get());
+        std::copy(imm.get(), imm.get() + length, i.get());
+        mut = std::move(m);
+        imm = std::move(i);
+        room = sz;
+      }
+    }
+    inline void resize(size_t sz) {
+      reserve(sz);
+      length = sz;
     }
     inline void push_back(char_t c) {
-      mut.push_back(c);
-      imm.push_back(c);
+      if (length == room) {
+        reserve(std::max<size_t>(4096, room * 2));
+      }
+      mut[length] = c;
+      imm[length] = c;
+      ++length;
     }
     inline void clear() {
-      mut.clear();
-      imm.clear();
+      length = 0;
     }
     inline const char_t* to_imm(const char_t* mptr) const {
-      return imm.data() + std::distance(mut.data(), mptr);
+      return imm.get() + std::distance<const char_t*>(mut.get(), mptr);
     }
   };
 
@@ -375,61 +538,26 @@ private:
     }
   }
 
+  // data_consumer
+  virtual void skipped(size_t lines) override {
+    skip = lines;
+  }
+
   inline explicit basic_file(std::istream& stream){
     read_stream(stream);
     build_table();
   }
 
-  inline basic_file(source_t source, const std::string& resource) : url(resource) {
-    switch (source) {
-      case local: {
-        std::ifstream stream(resource, std::ios_base::in | std::ios_base::binary);
-        if (not stream.is_open()) {
-          throw std::runtime_error("file not found: " + resource);
-        }
-        read_stream(stream);
-        build_table();
-        break;
-      }
-      case http: {
-        curl(resource);
-        build_table();
-        break;
-      }
-      default:
-        throw std::runtime_error("invalid source type");
-        break;
-    }
-  }
-
-  static source_t from(const std::string& uri) {
-
-    static const std::pair<std::regex, source_t> protocols[] = {
-      std::make_pair(std::regex(R"(^https?:\/{2}([\w\-\.\/\_\~]+))"), http),
-      std::make_pair(std::regex(R"(^file:\/{2}([\w\-\.\/\_\~]+))"), local)
-    };
-
-    for (const auto& pair : protocols) {
-      if (std::regex_search(uri, pair.first)) {
-        return pair.second;
-      }
-    }
-
-    log_warning << "unknown protocol for '" << uri << "'";
-    return unknown;
+  inline basic_file(source_t source, const std::string& resource, const cancellation& token)
+    : url(resource) {
+    artifact::fetch(source, resource, *this, token);
+    build_table();
   }
 
-  static std::string remove_protocol(const std::string& uri) {
-
-    static const std::regex proto(R"(^(?:file|https?|):\/\/([\w\-\.\/\_\~]+))");
-
-    std::smatch match;
-    if (std::regex_search(uri, match, proto) and match.size() == 2) {
-      return match[1].str();
-    }
-
-    log_warning << "no known protocol in '" << uri << "'";
-    return uri;
+  inline basic_file(const std::string& resource, const cancellation& token)
+    : url(resource) {
+    artifact::fetch(resource, *this, token);
+    build_table();
   }
 
   basic_file(const basic_file<char_t>&) = delete;
@@ -439,23 +567,19 @@ private:
     return (c == '\n' or c =='\r');
   }
 
-  inline void curl(const std::string& url) {
-    downloader<char_t>(url, *this).perform();
-  }
-
   inline void read_stream(std::istream& stream) {
     loader<char_t>(stream, *this).perform();
   }
 
   inline void build_table() {
-    char_t* current = data.mut.data();
+    char_t* current = data.mut.get();
     char_t* const last = current + data.size();
 
     for (char_t* ptr = current; ptr < last; ++ptr) {
       if (current and is_endline(*ptr)) {
         table.emplace_back(
           this,
-          table.size() + 1,
+          skip + table.size() + 1,
           current,
           data.to_imm(current),
           ptr - current
@@ -472,7 +596,7 @@ private:
     if (current) {
       table.emplace_back(
         this,
-        table.size() + 1,
+        skip + table.size() + 1,
         current,
         data.to_imm(current),
         last - current
@@ -481,6 +605,7 @@ private:
   }
 
   std::string url;
+  size_t skip = 0; // the lines before the part fetched, if known
   data_t<char_t> data;
   std::deque<line_t> table;
 };
@@ -0,0 +1,109 @@
+#include "bench.hpp"
+#include "artifact.hpp"
+
+#include <regex>
+
+// the width of the lines, there are always about 256K characters of them
+static void widths(benchmark::internal::Benchmark* b) {
+  b->RangeMultiplier(8)->Range(16, 1024);
+}
+
+template <typename CharT>
+static std::basic_string<CharT> text_of(const char* str) {
+  return std::basic_string<CharT>(str, str + strlen(str));
+}
+
+/**
+ * invokes the kernel on each line, as the lines of an artifact are normalized
+ * \param in_place if true the kernel modifies the lines, the copy of the original ones is
+ * part of the measure then
+*/
+template <typename CharT, typename Kernel>
+static void on_lines(benchmark::State& state, bool in_place, const Kernel& kernel) {
+  const size_t width = state.range(0);
+  const size_t count = (256 << 10) / (width + 1);
+  const auto text = bench::widen<CharT>(bench::log_lines(count, width));
+  auto mut = text;
+  for (auto _ : state) {
+    if (in_place) {
+      std::copy(text.begin(), text.end(), mut.begin());
+    }
+    for (size_t i = 0; i < count; ++i) {
+      const auto first = i * (width + 1);
+      artifact::basic_line<CharT> line(nullptr, i + 1,
+                                       mut.data() + first, text.data() + first, width);
+      kernel(line);
+      benchmark::DoNotOptimize(line.size());
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * count);
+  state.SetBytesProcessed(state.iterations() * text.size() * sizeof(CharT));
+}
+
+// splits decoded text into lines, as each artifact is once fetched
+template <typename CharT>
+static void BM_File_Parse(benchmark::State& state) {
+  const auto text = bench::widen<CharT>(bench::log_lines(state.range(0), 127));
+  for (auto _ : state) {
+    const auto file = artifact::basic_file<CharT>::parse({text.data(), text.size()});
+    benchmark::DoNotOptimize(file.size());
+  }
+  state.SetItemsProcessed(state.iterations() * state.range(0));
+  state.SetBytesProcessed(state.iterations() * text.size() * sizeof(CharT));
+}
+BENCHMARK_TEMPLATE(BM_File_Parse, char)->RangeMultiplier(8)->Range(1 << 10, 1 << 16);
+BENCHMARK_TEMPLATE(BM_File_Parse, wchar_t)->RangeMultiplier(8)->Range(1 << 10, 1 << 16);
+
+template <typename CharT>
+static void BM_Line_Hash(benchmark::State& state) {
+  on_lines<CharT>(state, false, [](const artifact::basic_line<CharT>& line){
+    benchmark::DoNotOptimize(line.hash());
+  });
+}
+BENCHMARK_TEMPLATE(BM_Line_Hash, char)->Apply(widths);
+BENCHMARK_TEMPLATE(BM_Line_Hash, wchar_t)->Apply(widths);
+
+// a filter that hits some of the lines, the longer the lines the more
+template <typename CharT>
+static void BM_Line_SuppressString(benchmark::State& state) {
+  const artifact::basic_pattern<CharT> pattern(text_of<CharT>("warning:"));
+  on_lines<CharT>(state, false, [&pattern](artifact::basic_line<CharT>& line){
+    line.suppress(pattern);
+  });
+}
+BENCHMARK_TEMPLATE(BM_Line_SuppressString, char)->Apply(widths);
+BENCHMARK_TEMPLATE(BM_Line_SuppressString, wchar_t)->Apply(widths);
+
+template <typename CharT>
+static void BM_Line_SuppressRegex(benchmark::State& state) {
+  const std::basic_regex<CharT> regex(text_of<CharT>("warning: \\w+"));
+  const artifact::basic_pattern<CharT> pattern(regex);
+  on_lines<CharT>(state, false, [&pattern](artifact::basic_line<CharT>& line){
+    line.suppress(pattern);
+  });
+}
+BENCHMARK_TEMPLATE(BM_Line_SuppressRegex, char)->Apply(widths);
+BENCHMARK_TEMPLATE(BM_Line_SuppressRegex, wchar_t)->Apply(widths);
+
+// a normalizer that hits every line once
+template <typename CharT>
+static void BM_Line_RemoveString(benchmark::State& state) {
+  const artifact::basic_pattern<CharT> pattern(text_of<CharT>("[INFO ]"));
+  on_lines<CharT>(state, true, [&pattern](artifact::basic_line<CharT>& line){
+    line.remove(pattern);
+  });
+}
+BENCHMARK_TEMPLATE(BM_Line_RemoveString, char)->Apply(widths);
+BENCHMARK_TEMPLATE(BM_Line_RemoveString, wchar_t)->Apply(widths);
+
+// a normalizer that hits every line many times, the most common kind
+template <typename CharT>
+static void BM_Line_RemoveRegex(benchmark::State& state) {
+  const std::basic_regex<CharT> regex(text_of<CharT>("\\d+"));
+  const artifact::basic_pattern<CharT> pattern(regex);
+  on_lines<CharT>(state, true, [&pattern](artifact::basic_line<CharT>& line){
+    line.remove(pattern);
+  });
+}
+BENCHMARK_TEMPLATE(BM_Line_RemoveRegex, char)->Apply(widths);
+BENCHMARK_TEMPLATE(BM_Line_RemoveRegex, wchar_t)->Apply(widths);
@@ -0,0 +1,64 @@
+#include "bench.hpp"
+#include "synthetic.hpp"
+#include "arguments.hpp"
+
+#include <iostream>
+#include <exception>
+
+/*
+ * denoiser-bench --generate <directory> [--size <MB>] [--references <count>]
+ *                [--min-width <chars>] [--max-width <chars>] [--volatile <share>]
+ *                [--signal <share>] [--templates <count>] [--seed <number>]
+ * writes synthetic logs and the configuration to narrow them down, to be fed to the
+ * artifact-denoiser, instead of running the benchmarks
+*/
+static int generate(const arguments& args) {
+  bench::synthetic_options options;
+  if (args.have_flag("--size")) {
+    options.size = args.value<uint64_t>("--size") << 20;
+  }
+  if (args.have_flag("--references")) {
+    options.references = args.value<size_t>("--references");
+  }
+  if (args.have_flag("--min-width")) {
+    options.min_width = args.value<size_t>("--min-width");
+  }
+  if (args.have_flag("--max-width")) {
+    options.max_width = args.value<size_t>("--max-width");
+  }
+  if (args.have_flag("--volatile")) {
+    options.volatile_share = args.value<double>("--volatile");
+  }
+  if (args.have_flag("--signal")) {
+    options.signal_share = args.value<double>("--signal");
+  }
+  if (args.have_flag("--templates")) {
+    options.templates = args.value<size_t>("--templates");
+  }
+  if (args.have_flag("--seed")) {
+    options.seed = args.value<uint64_t>("--seed");
+  }
+  try {
+    const auto logs = bench::synthesize(std::string(args.value("--generate")), options);
+    std::cout << "{\"config\": \"" << logs.config << "\", \"bytes\": " << logs.bytes
+              << ", \"lines\": " << logs.lines << ", \"signal\": " << logs.signal << "}"
+              << std::endl;
+  } catch (const std::exception& ex) {
+    std::cerr << ex.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  const arguments args(argc, argv);
+  if (args.have_flag("--generate")) {
+    return generate(args);
+  }
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
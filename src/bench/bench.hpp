@@ -0,0 +1,119 @@
+#pragma once
+
+#include "benchmark/benchmark.h"
+
+#include <thread>
+#include <fstream>
+#include <initializer_list>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+
+namespace bench {
+
+/**
+ * adds one run per thread count, doubling from 1 up to the number of hw threads
+ * \param b the benchmark to configure
+*/
+static inline void threads(benchmark::internal::Benchmark* b) {
+  const int max = std::max(1u, std::thread::hardware_concurrency());
+  for (int t = 1; t < max; t *= 2) {
+    b->Arg(t);
+  }
+  b->Arg(max);
+}
+
+/**
+ * as above, combining each thread count with each of the given values as a second argument
+ * \param b the benchmark to configure
+ * \param values the values of the second argument
+*/
+static inline void threads(benchmark::internal::Benchmark* b,
+                           std::initializer_list<int64_t> values) {
+  const int max = std::max(1u, std::thread::hardware_concurrency());
+  for (int t = 1; t < max; t *= 2) {
+    for (const auto value : values) {
+      b->Args({t, value});
+    }
+  }
+  for (const auto value : values) {
+    b->Args({max, value});
+  }
+}
+
+/**
+ * generates lines looking like those of a build log, always the same ones
+ * \param lines the number of lines
+ * \param width the number of characters of each line, its end excluded
+ * \param multibyte if true, about one character out of 16 takes 2 bytes in UTF-8
+ * \return the lines, UTF-8 encoded, each one ended by '\n'
+*/
+static inline std::string log_lines(size_t lines, size_t width, bool multibyte = false) {
+  static const char* const words[] = {
+    "compiling", "linking", "module", "warning:", "unused", "variable", "in", "function",
+    "took", "ms", "cache", "hit", "for", "target", "step", "done",
+  };
+  uint64_t seed = 0x9e3779b97f4a7c15;
+  const auto next = [&seed](){
+    seed = seed * 6364136223846793005 + 1442695040888963407;
+    return uint32_t(seed >> 33);
+  };
+  std::string text;
+  text.reserve(lines * (width + width / 16 + 1));
+  for (size_t l = 0; l < lines; ++l) {
+    char head[64];
+    const int size = snprintf(head, sizeof(head), "%02u:%02u:%02u.%03u [INFO ] worker-%02u ",
+                              next() % 24, next() % 60, next() % 60, next() % 1000, next() % 32);
+    std::string line(head, size);
+    while (line.size() < width) {
+      line += words[next() % 16];
+      line += (multibyte and 0 == next() % 8) ? "\xc3\xa9 " : " ";
+      line += std::to_string(next() % 10000);
+      line += ' ';
+    }
+    line.resize(width);
+    // no multibyte character cut in half
+    while (multibyte and not line.empty() and (line.back() & 0x80)) {
+      line.pop_back();
+    }
+    line.resize(width, 'x');
+    text += line;
+    text += '\n';
+  }
+  return text;
+}
+
+/**
+ * widens each byte of the given text to a character, which is enough for ASCII text
+ * \param text the text to widen
+*/
+template <typename CharT>
+static inline std::vector<CharT> widen(const std::string& text) {
+  return std::vector<CharT>(text.begin(), text.end());
+}
+
+/**
+ * resets the peak resident set size of the process to the current one, where the kernel allows
+ * it (Linux 4.0 and later)
+*/
+static inline void reset_peak_rss() {
+  std::ofstream("/proc/self/clear_refs") << "5";
+}
+
+/**
+ * \return the peak resident set size of the process since it started or since the last reset,
+ * in bytes, 0 if unknown
+*/
+static inline uint64_t peak_rss() {
+  std::ifstream status("/proc/self/status");
+  for (std::string line; std::getline(status, line); ) {
+    if (0 == line.compare(0, 6, "VmHWM:")) {
+      return std::strtoull(line.c_str() + 6, nullptr, 10) << 10;
+    }
+  }
+  return 0;
+}
+
+}
@@ -0,0 +1,74 @@
+#include "bench.hpp"
+#include "corpus.hpp"
+
+#include <vector>
+
+// the number of hashes
+static void sizes(benchmark::internal::Benchmark* b) {
+  b->RangeMultiplier(16)->Range(1 << 10, 1 << 20);
+}
+
+static std::vector<corpus::hash_t> hashes(size_t count, uint64_t seed) {
+  std::vector<corpus::hash_t> result(count);
+  for (auto& hash : result) {
+    seed = seed * 6364136223846793005 + 1442695040888963407;
+    hash = corpus::hash_t(seed ^ (seed >> 29));
+  }
+  return result;
+}
+
+// the distinct hashes of a reference going to the bucket
+static void BM_Corpus_Insert(benchmark::State& state) {
+  const auto reference = hashes(state.range(0), 1);
+  for (auto _ : state) {
+    corpus bucket;
+    bucket.insert(reference);
+    benchmark::DoNotOptimize(bucket.size());
+  }
+  state.SetItemsProcessed(state.iterations() * reference.size());
+}
+BENCHMARK(BM_Corpus_Insert)->Apply(sizes);
+
+// the same, into a bucket sized beforehand
+static void BM_Corpus_InsertReserved(benchmark::State& state) {
+  const auto reference = hashes(state.range(0), 1);
+  for (auto _ : state) {
+    corpus bucket;
+    bucket.reserve(reference.size());
+    bucket.insert(reference);
+    benchmark::DoNotOptimize(bucket.size());
+  }
+  state.SetItemsProcessed(state.iterations() * reference.size());
+}
+BENCHMARK(BM_Corpus_InsertReserved)->Apply(sizes);
+
+// the lines of a target probed against a bucket as large, half of them found
+static void BM_Corpus_Probe(benchmark::State& state) {
+  const auto reference = hashes(state.range(0), 1);
+  auto target = hashes(state.range(0) / 2, 2);
+  target.insert(target.end(), reference.begin(), reference.begin() + state.range(0) / 2);
+  corpus bucket;
+  bucket.insert(reference);
+  for (auto _ : state) {
+    size_t found = 0;
+    for (const auto hash : target) {
+      found += bucket.count(hash);
+    }
+    benchmark::DoNotOptimize(found);
+  }
+  state.SetItemsProcessed(state.iterations() * target.size());
+}
+BENCHMARK(BM_Corpus_Probe)->Apply(sizes);
+
+// the duplicates dropped from the hashes of a reference, half of which occur twice
+static void BM_Corpus_Distinct(benchmark::State& state) {
+  auto reference = hashes(state.range(0), 1);
+  reference.insert(reference.end(), reference.begin(), reference.begin() + reference.size() / 2);
+  for (auto _ : state) {
+    auto copy = reference;
+    corpus::distinct(copy);
+    benchmark::DoNotOptimize(copy.data());
+  }
+  state.SetItemsProcessed(state.iterations() * reference.size());
+}
+BENCHMARK(BM_Corpus_Distinct)->Apply(sizes);
@@ -0,0 +1,134 @@
+#include "bench.hpp"
+#include "synthetic.hpp"
+#include "denoiser.hpp"
+#include "config.hpp"
+#include "profile.hpp"
+#include "thread-pool.hpp"
+
+#include <map>
+#include <memory>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace {
+
+// the logs generated so far, shared by the runs with the same options and removed at exit
+class scratch final {
+public:
+  ~scratch() {
+    for (const auto& entry : generated) {
+      for (const auto& file : entry.second.files) {
+        unlink(file.c_str());
+      }
+      rmdir(entry.first.c_str());
+    }
+    rmdir(base.c_str());
+  }
+
+  const bench::synthetic_logs& get(const bench::synthetic_options& options) {
+    const auto directory = base + "/" + std::to_string(options.size >> 20) + "m-" +
+                           std::to_string(options.references) + "r-" +
+                           std::to_string(int(options.volatile_share * 100)) + "v";
+    auto it = generated.find(directory);
+    if (it == generated.end()) {
+      mkdir(base.c_str(), 0755);
+      it = generated.emplace(directory, bench::synthesize(directory, options)).first;
+    }
+    return it->second;
+  }
+
+private:
+  const std::string base = "/tmp/denoiser-bench-" + std::to_string(getpid());
+  std::map<std::string, bench::synthetic_logs> generated;
+};
+
+scratch logs;
+
+// the time spent in each stage, named after the first word of the profiled sections: the spans
+// recorded while alive
+class stages final {
+public:
+  stages() {
+    profiling::clear();
+    profiling::enable();
+  }
+
+  ~stages() {
+    profiling::enable(false);
+    profiling::clear();
+  }
+
+  void report(benchmark::State& state) const {
+    std::map<std::string, int64_t> totals;
+    for (const auto& span : profiling::spans()) {
+      totals[span.name.substr(0, span.name.find(' '))] += span.end - span.begin;
+    }
+    for (const auto& stage : totals) {
+      state.counters["stage_" + stage.first + "_ms"] = stage.second / 1e6 / state.iterations();
+    }
+  }
+};
+
+}
+
+/**
+ * the whole process over synthetic logs, reporting besides the time: the bytes and the lines
+ * read per second, the peak RSS and the time spent in each stage per run, summed across the
+ * threads (so the stages running in parallel can take longer than the whole run)
+ * \param options the shape of the logs
+ * \param threads the size of the thread pool, as --jobs
+*/
+static void denoise(benchmark::State& state,
+                    const bench::synthetic_options& options,
+                    size_t threads) {
+  const auto& generated = logs.get(options);
+  const auto config = configuration<wchar_t>::load(generated.config);
+  thread_pool pool(threads);
+  bench::reset_peak_rss();
+  const stages times;
+  for (auto _ : state) {
+    denoiser<wchar_t> denoiser(config, pool);
+    size_t emitted = 0;
+    denoiser.run([&emitted](const artifact::basic_line<wchar_t>&){
+      ++emitted;
+    });
+    if (emitted != generated.signal) {
+      state.SkipWithError("unexpected number of lines emitted");
+      break;
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * generated.bytes);
+  state.SetItemsProcessed(state.iterations() * generated.lines);
+  state.counters["peak_rss_mb"] = double(bench::peak_rss()) / (1 << 20);
+  times.report(state);
+}
+
+// scaling with the number of threads and the size of the logs, in MB
+static void BM_Denoise(benchmark::State& state) {
+  bench::synthetic_options options;
+  options.size = uint64_t(state.range(1)) << 20;
+  denoise(state, options, state.range(0));
+}
+BENCHMARK(BM_Denoise)->Apply([](benchmark::internal::Benchmark* b){
+  bench::threads(b, {2, 8, 32});
+})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// with more and more references, at the number of hw threads
+static void BM_Denoise_References(benchmark::State& state) {
+  bench::synthetic_options options;
+  options.size = 2 << 20;
+  options.references = state.range(0);
+  denoise(state, options, std::thread::hardware_concurrency());
+}
+BENCHMARK(BM_Denoise_References)->RangeMultiplier(4)->Range(1, 16)
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+// with more and more volatile tokens to normalize, in percent
+static void BM_Denoise_Volatile(benchmark::State& state) {
+  bench::synthetic_options options;
+  options.size = 4 << 20;
+  options.volatile_share = state.range(0) / 100.0;
+  denoise(state, options, std::thread::hardware_concurrency());
+}
+BENCHMARK(BM_Denoise_Volatile)->Arg(0)->Arg(10)->Arg(50)
+    ->Unit(benchmark::kMillisecond)->UseRealTime();
@@ -0,0 +1,77 @@
+#include "bench.hpp"
+#include "encoding.hpp"
+
+#include <sstream>
+
+// the sizes of the text decoded, in bytes
+static void sizes(benchmark::internal::Benchmark* b) {
+  b->RangeMultiplier(16)->Range(4 << 10, 1 << 20);
+}
+
+// one character at a time from a stream, as local artifacts are loaded
+template <typename CharT>
+static void decode(benchmark::State& state,
+                   encoding::basic_encoder<CharT> decoder,
+                   bool multibyte) {
+  const auto text = bench::log_lines(state.range(0) / 128, 127, multibyte);
+  for (auto _ : state) {
+    std::istringstream is(text);
+    encoding::istream_feeder feeder(is);
+    CharT c;
+    size_t count = 0;
+    while (encoding::ok == decoder(feeder, c)) {
+      benchmark::DoNotOptimize(c);
+      ++count;
+    }
+    benchmark::DoNotOptimize(count);
+  }
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+
+template <typename CharT>
+static void BM_Decode_UTF8(benchmark::State& state) {
+  decode<CharT>(state, encoding::UTF8<CharT>, false);
+}
+BENCHMARK_TEMPLATE(BM_Decode_UTF8, char)->Apply(sizes);
+BENCHMARK_TEMPLATE(BM_Decode_UTF8, wchar_t)->Apply(sizes);
+
+// the same, with some accented letters
+template <typename CharT>
+static void BM_Decode_UTF8Multibyte(benchmark::State& state) {
+  decode<CharT>(state, encoding::UTF8<CharT>, true);
+}
+BENCHMARK_TEMPLATE(BM_Decode_UTF8Multibyte, char)->Apply(sizes);
+BENCHMARK_TEMPLATE(BM_Decode_UTF8Multibyte, wchar_t)->Apply(sizes);
+
+template <typename CharT>
+static void BM_Decode_LATIN1(benchmark::State& state) {
+  decode<CharT>(state, encoding::LATIN1<CharT>, false);
+}
+BENCHMARK_TEMPLATE(BM_Decode_LATIN1, char)->Apply(sizes);
+BENCHMARK_TEMPLATE(BM_Decode_LATIN1, wchar_t)->Apply(sizes);
+
+template <typename CharT>
+static void BM_Decode_ASCII(benchmark::State& state) {
+  decode<CharT>(state, encoding::ASCII<CharT>, false);
+}
+BENCHMARK_TEMPLATE(BM_Decode_ASCII, char)->Apply(sizes);
+BENCHMARK_TEMPLATE(BM_Decode_ASCII, wchar_t)->Apply(sizes);
+
+// 64K chunks at a time, as parts of artifacts and followed targets are decoded
+template <typename CharT>
+static void BM_Decode_Chunks(benchmark::State& state) {
+  const auto text = bench::log_lines(state.range(0) / 128, 127, true);
+  std::vector<CharT> out;
+  out.reserve(64 << 10);
+  for (auto _ : state) {
+    encoding::chunk_decoder<CharT> decoder(encoding::UTF8<CharT>);
+    for (size_t offset = 0; offset < text.size(); offset += 64 << 10) {
+      out.clear();
+      decoder.feed(text.data() + offset, std::min<size_t>(64 << 10, text.size() - offset), out);
+      benchmark::DoNotOptimize(out.data());
+    }
+  }
+  state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK_TEMPLATE(BM_Decode_Chunks, char)->Apply(sizes);
+BENCHMARK_TEMPLATE(BM_Decode_Chunks, wchar_t)->Apply(sizes);
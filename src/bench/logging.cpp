@@ -0,0 +1,47 @@
+#include "bench.hpp"
+#include "logging.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+// sends the standard error to /dev/null while alive, once the lines logged are written
+class discard final {
+public:
+  discard() : saved(dup(STDERR_FILENO)) {
+    log::flush();
+    const int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    close(null);
+  }
+  ~discard() {
+    log::flush();
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+  }
+private:
+  const int saved;
+};
+
+// a line at a level which is not enabled, what the debug lines cost in a normal run
+static void BM_Log_Disabled(benchmark::State& state) {
+  log::disable(log::debug);
+  size_t i = 0;
+  for (auto _ : state) {
+    log_debug << "line " << ++i << " of " << state.max_iterations << ": " << 0.5;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Log_Disabled);
+
+// a line queued for the background thread, which formats and writes it meanwhile
+static void BM_Log_Enabled(benchmark::State& state) {
+  const discard sink;
+  log::enable(log::debug);
+  size_t i = 0;
+  for (auto _ : state) {
+    log_debug << "line " << ++i << " of " << state.max_iterations << ": " << 0.5;
+  }
+  log::disable(log::debug);
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Log_Enabled)->UseRealTime();
@@ -0,0 +1,218 @@
+#include "synthetic.hpp"
+
+#include <fstream>
+#include <stdexcept>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <climits>
+#include <sys/stat.h>
+
+namespace {
+
+const char* const words[] = {
+  "compiling", "linking", "module", "warning:", "unused", "variable", "in", "function",
+  "took", "cache", "hit", "for", "target", "step", "done", "downloading",
+  "artifact", "from", "repository", "resolved", "dependency", "running", "test", "suite",
+  "passed", "skipped", "archiving", "workspace", "checkout", "revision", "agent", "node",
+};
+constexpr size_t word_count = sizeof(words) / sizeof(*words);
+
+const char* const levels[] = { "[INFO] ", "[INFO] ", "[INFO] ", "[WARNING] ", "[DEBUG] " };
+constexpr size_t level_count = sizeof(levels) / sizeof(*levels);
+
+// the placeholders of the volatile tokens in the templates, and the width they take once filled
+enum : char { timestamp = 1, uuid, pid };
+constexpr size_t filled_width[] = { 0, 24, 36, 9 };
+
+// normalizes all the volatile tokens above, and only them
+const char* const config_rules =
+  "normalizers:\n"
+  "- r: '\\d{4}-\\d{2}-\\d{2}T\\d{2}:\\d{2}:\\d{2}\\.\\d{3}Z'\n"
+  "- r: '[0-9a-f]{8}-[0-9a-f]{4}-[0-9a-f]{4}-[0-9a-f]{4}-[0-9a-f]{12}'\n"
+  "- r: 'pid=\\d+'\n";
+
+// pseudo random numbers, the same ones for the same seed on any platform
+class sequence {
+public:
+  explicit sequence(uint64_t seed) : state(seed * 0x9e3779b97f4a7c15 + 1) {}
+  uint32_t operator () () {
+    state = state * 6364136223846793005 + 1442695040888963407;
+    return uint32_t(state >> 33);
+  }
+  // in [0, 1)
+  double real() {
+    return (*this)() / 2147483648.0;
+  }
+private:
+  uint64_t state;
+};
+
+std::string make_template(size_t index, const bench::synthetic_options& options) {
+  sequence next(options.seed ^ ((index + 1) * 0x2545f4914f6cdd1d));
+  // skewed towards the short lines, as most log lines are
+  const double u = next.real();
+  const size_t spread = options.max_width - options.min_width;
+  const size_t width = options.min_width + size_t(spread * u * u * u);
+  // the name of the template makes it distinct from the others once normalized
+  std::string line = levels[next() % level_count];
+  line += words[next() % word_count];
+  line += '-';
+  line += std::to_string(index);
+  size_t length = line.size();
+  while (length < width) {
+    line += ' ';
+    if (next.real() < options.volatile_share) {
+      const char kind = char(timestamp + next() % 3);
+      line += kind;
+      length += filled_width[size_t(kind)] + 1;
+    } else {
+      line += words[next() % word_count];
+      length = line.size();
+    }
+  }
+  return line;
+}
+
+void put_timestamp(std::string& out, uint64_t ms) {
+  char str[32];
+  const uint64_t s = ms / 1000;
+  snprintf(str, sizeof(str), "2024-%02u-%02uT%02u:%02u:%02u.%03uZ",
+           unsigned(1 + s / 2592000 % 12), unsigned(1 + s / 86400 % 28),
+           unsigned(s / 3600 % 24), unsigned(s / 60 % 60), unsigned(s % 60), unsigned(ms % 1000));
+  out += str;
+}
+
+void fill(std::string& out, const std::string& tmpl, uint64_t ms, sequence& next) {
+  char str[48];
+  for (const char c : tmpl) {
+    switch (c) {
+    case timestamp:
+      put_timestamp(out, ms + next() % 100000);
+      break;
+    case uuid:
+      snprintf(str, sizeof(str), "%08x-%04x-4%03x-%04x-%04x%08x",
+               next(), next() & 0xffff, next() & 0xfff, 0x8000 | (next() & 0x3fff),
+               next() & 0xffff, next());
+      out += str;
+      break;
+    case pid:
+      snprintf(str, sizeof(str), "pid=%u", 100 + next() % 99900);
+      out += str;
+      break;
+    default:
+      out += c;
+    }
+  }
+}
+
+void make_directory(const std::string& directory) {
+  if (0 != mkdir(directory.c_str(), 0755) and EEXIST != errno) {
+    throw std::runtime_error("cannot create directory " + directory + ": " + strerror(errno));
+  }
+}
+
+}
+
+namespace bench {
+
+synthetic_logs synthesize(const std::string& directory, const synthetic_options& options) {
+
+  if (0 == options.templates or options.min_width > options.max_width) {
+    throw std::runtime_error("invalid synthetic log options");
+  }
+
+  make_directory(directory);
+  char absolute[PATH_MAX];
+  if (nullptr == realpath(directory.c_str(), absolute)) {
+    throw std::runtime_error("cannot resolve directory " + directory + ": " + strerror(errno));
+  }
+  const std::string base = absolute;
+
+  std::vector<std::string> templates;
+  templates.reserve(options.templates);
+  for (size_t t = 0; t < options.templates; ++t) {
+    templates.push_back(make_template(t, options));
+  }
+
+  synthetic_logs logs;
+  logs.config = base + "/config.yaml";
+
+  // how many times the target uses each template, and whether any reference does
+  std::vector<size_t> target_uses(options.templates);
+  std::vector<bool> referenced(options.templates);
+
+  std::string config = config_rules;
+  config += "target: file://" + base + "/target.log\nreference:\n";
+
+  for (size_t log = 0; log <= options.references; ++log) {
+
+    const std::string name = 0 == log ? "target.log" : "reference-" + std::to_string(log) + ".log";
+    if (log) {
+      config += "- file://" + base + "/" + name + "\n";
+    }
+
+    logs.files.push_back(base + "/" + name);
+    std::ofstream out(logs.files.back(), std::ios::binary | std::ios::trunc);
+    if (not out) {
+      throw std::runtime_error("cannot write " + base + "/" + name);
+    }
+
+    sequence next(options.seed * 1000003 + log);
+    uint64_t ms = uint64_t(next()) * 1000;
+    uint64_t written = 0;
+    size_t failures = 0;
+    std::string line;
+
+    while (written < options.size) {
+      line = "[";
+      put_timestamp(line, ms += next() % 50);
+      line += "] ";
+      if (next.real() < options.signal_share) {
+        // a failure no other build has
+        line += "[ERROR] case ";
+        line += std::to_string(log) + "." + std::to_string(++failures);
+        line += " failed: ";
+        fill(line, templates[next() % templates.size()], ms, next);
+        if (0 == log) {
+          ++logs.signal;
+        }
+      } else {
+        const size_t t = next() % templates.size();
+        fill(line, templates[t], ms, next);
+        if (0 == log) {
+          ++target_uses[t];
+        } else {
+          referenced[t] = true;
+        }
+      }
+      line += '\n';
+      out.write(line.data(), line.size());
+      written += line.size();
+      ++logs.lines;
+    }
+
+    if (not out.flush()) {
+      throw std::runtime_error("cannot write " + base + "/" + name);
+    }
+    logs.bytes += written;
+  }
+
+  // the templates of the target no reference happened to draw are signal as well
+  for (size_t t = 0; t < options.templates; ++t) {
+    if (not referenced[t]) {
+      logs.signal += target_uses[t];
+    }
+  }
+
+  logs.files.push_back(logs.config);
+  std::ofstream out(logs.config, std::ios::trunc);
+  if (not (out << config << std::flush)) {
+    throw std::runtime_error("cannot write " + logs.config);
+  }
+
+  return logs;
+}
+
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+namespace bench {
+
+// the shape of a generated set of build logs
+struct synthetic_options {
+  // the size of each log, in bytes
+  uint64_t size = uint64_t(16) << 20;
+  // the number of reference logs, along with the target
+  size_t references = 4;
+  // the width of the lines, timestamp excluded: most are close to the minimum, few to the maximum
+  size_t min_width = 24;
+  size_t max_width = 320;
+  // the share of the tokens of the lines that change at each build: timestamps, UUIDs, PIDs
+  double volatile_share = 0.1;
+  // the share of the lines of each log found in no other log, the ones worth reporting
+  double signal_share = 0.001;
+  // the number of distinct lines, before their volatile tokens are filled in
+  size_t templates = 4096;
+  uint64_t seed = 1;
+};
+
+// what was generated
+struct synthetic_logs {
+  // the configuration file, naming the target, the references and the normalizers
+  std::string config;
+  // all the files written, the configuration included
+  std::vector<std::string> files;
+  // the size of all the logs and the number of their lines
+  uint64_t bytes = 0;
+  size_t lines = 0;
+  // the number of lines of the target the denoiser is expected to emit
+  size_t signal = 0;
+};
+
+/**
+ * writes a target, its references and a configuration to narrow it down to the given directory,
+ * always the same ones for the same options: the logs look like those of a Jenkins job, each
+ * line is prefixed by a timestamp and is one of a set of templates whose volatile tokens differ
+ * from a build to another, a few lines are unique to each log
+ * \param directory where the files are written, created if missing
+ * \param options the shape of the logs
+*/
+synthetic_logs synthesize(const std::string& directory, const synthetic_options& options);
+
+}
@@ -0,0 +1,147 @@
+#include "bench.hpp"
+#include "thread-pool.hpp"
+#include "pipeline.hpp"
+
+#include <vector>
+#include <atomic>
+
+// a cheap for_each over 1M elements, dominated by the scheduling overhead
+static void BM_ThreadPool_ForEach(benchmark::State& state) {
+  thread_pool pool(state.range(0));
+  std::vector<uint64_t> data(1 << 20);
+  for (auto _ : state) {
+    pool.for_each(data, 1000, [](auto& x){ x = x * 2654435761u + 1; });
+  }
+  state.SetItemsProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_ThreadPool_ForEach)->Apply(bench::threads)->UseRealTime();
+
+// same as above with tiny batches, to show the cost of the scheduling itself
+static void BM_ThreadPool_ForEachFine(benchmark::State& state) {
+  thread_pool pool(state.range(0));
+  std::vector<uint64_t> data(1 << 20);
+  for (auto _ : state) {
+    pool.for_each(data, 16, [](auto& x){ x = x * 2654435761u + 1; });
+  }
+  state.SetItemsProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_ThreadPool_ForEachFine)->Apply(bench::threads)->UseRealTime();
+
+// a for_each whose items cost way more than their scheduling
+static void BM_ThreadPool_ForEachHeavy(benchmark::State& state) {
+  thread_pool pool(state.range(0));
+  std::vector<uint64_t> data(1 << 14);
+  for (auto _ : state) {
+    pool.for_each(data, 100, [](auto& x){
+      for (int i = 0; i < 1000; ++i) {
+        x = x * 2654435761u + 1;
+      }
+    });
+  }
+  state.SetItemsProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_ThreadPool_ForEachHeavy)->Apply(bench::threads)->UseRealTime();
+
+// a for_each whose items have very different costs, with a fixed batch size or an adaptive one
+static void BM_ThreadPool_ForEachSkewed(benchmark::State& state) {
+  thread_pool pool(state.range(0));
+  const size_t batch_size = state.range(1);
+  std::vector<uint64_t> data(1 << 14);
+  for (auto _ : state) {
+    pool.for_each(data, batch_size, [&data](auto& x){
+      const auto rounds = (&x - data.data()) < 1024 ? 5000 : 50;
+      for (int i = 0; i < rounds; ++i) {
+        x = x * 2654435761u + 1;
+      }
+    });
+  }
+  state.SetItemsProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_ThreadPool_ForEachSkewed)->Apply([](auto* b){
+  bench::threads(b, {1000, thread_pool::adaptive});
+})->UseRealTime();
+
+// empty jobs submitted from outside the pool
+static void BM_ThreadPool_Submit(benchmark::State& state) {
+  thread_pool pool(state.range(0));
+  std::vector<thread_pool::id_t> jobs;
+  jobs.reserve(10000);
+  std::atomic<size_t> count(0);
+  for (auto _ : state) {
+    for (size_t i = 0; i < 10000; ++i) {
+      jobs.push_back(pool.submit([&count](){ ++count; }));
+    }
+    pool.wait(jobs);
+    jobs.clear();
+  }
+  state.SetItemsProcessed(state.iterations() * 10000);
+}
+BENCHMARK(BM_ThreadPool_Submit)->Apply(bench::threads)->UseRealTime();
+
+// empty jobs submitted as a group, tracked by a latch instead of ids
+static void BM_ThreadPool_SubmitGroup(benchmark::State& state) {
+  thread_pool pool(state.range(0));
+  std::atomic<size_t> count(0);
+  for (auto _ : state) {
+    thread_pool::latch group(10000);
+    for (size_t i = 0; i < 10000; ++i) {
+      pool.submit(group, [&count](){ ++count; });
+    }
+    pool.wait(group);
+  }
+  state.SetItemsProcessed(state.iterations() * 10000);
+}
+BENCHMARK(BM_ThreadPool_SubmitGroup)->Apply(bench::threads)->UseRealTime();
+
+// jobs spawning jobs, which are pushed onto the worker own queue and stolen by the others
+static void BM_ThreadPool_Nested(benchmark::State& state) {
+  thread_pool pool(state.range(0));
+  std::atomic<size_t> count(0);
+  for (auto _ : state) {
+    std::vector<thread_pool::id_t> outer;
+    for (size_t i = 0; i < 100; ++i) {
+      outer.push_back(pool.submit([&pool, &count](){
+        std::vector<thread_pool::id_t> inner;
+        inner.reserve(100);
+        for (size_t j = 0; j < 100; ++j) {
+          inner.push_back(pool.submit([&count](){ ++count; }));
+        }
+        pool.wait(inner);
+      }));
+    }
+    pool.wait(outer);
+  }
+  state.SetItemsProcessed(state.iterations() * 100 * 100);
+}
+BENCHMARK(BM_ThreadPool_Nested)->Apply(bench::threads)->UseRealTime();
+
+// a pipeline with a parallel stage as heavy as the heavy for_each and an ordered serial one
+static void BM_Pipeline(benchmark::State& state) {
+  thread_pool pool(state.range(0));
+  std::vector<uint64_t> data(1 << 14);
+  for (auto _ : state) {
+    uint64_t sum = 0;
+    pipeline<std::pair<size_t, size_t>> p(pool, 2 * pool.size());
+    p.stage(p.parallel, [&data](auto& range){
+      for (auto i = range.first; i < range.second; ++i) {
+        for (int j = 0; j < 1000; ++j) {
+          data[i] = data[i] * 2654435761u + 1;
+        }
+      }
+    });
+    p.stage(p.serial, [&data, &sum](auto& range){
+      for (auto i = range.first; i < range.second; ++i) {
+        sum += data[i];
+      }
+    });
+    for (size_t i = 0; i < data.size(); i += 100) {
+      p.push([&data, i](auto& range){
+        range = {i, std::min(data.size(), i + 100)};
+      });
+    }
+    p.finish();
+    benchmark::DoNotOptimize(sum);
+  }
+  state.SetItemsProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_Pipeline)->Apply(bench::threads)->UseRealTime();
@@ -0,0 +1,309 @@
+#include "cache.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+/*
+ * entry layout (native endianness), the body only is compressed, as a gzip stream:
+ *   magic[8] version:u32 size:u64
+ *   { length:u32 chars[length] } for the url, the etag, the last modified date, the content type
+ *   body...
+*/
+static constexpr char magic[8] = {'D', 'N', 'C', 'A', 'C', 'H', 'E', 'D'};
+static constexpr uint32_t version = 1;
+static constexpr off_t size_offset = sizeof(magic) + sizeof(version);
+static constexpr uint32_t max_field = 64 * 1024;
+static constexpr size_t chunk_size = 64 * 1024;
+// entries still being written are left alone, unless abandoned for this long, in seconds
+static constexpr time_t stale_after = 3600;
+
+namespace {
+
+// closes the file descriptor once out of scope
+struct descriptor {
+  explicit descriptor(int fd) : fd(fd) {}
+  ~descriptor() {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+  const int fd;
+};
+
+bool get(int fd, void* data, size_t size) {
+  for (size_t done = 0; done < size; ) {
+    const ssize_t got = ::read(fd, static_cast<char*>(data) + done, size - done);
+    if (got < 0 and EINTR == errno) {
+      continue;
+    }
+    if (got <= 0) {
+      return false;
+    }
+    done += got;
+  }
+  return true;
+}
+
+bool get(int fd, std::string& str) {
+  uint32_t length;
+  if (not get(fd, &length, sizeof(length)) or length > max_field) {
+    return false;
+  }
+  str.resize(length);
+  return get(fd, str.data(), length);
+}
+
+template <typename T>
+void put(std::string& out, const T& t) {
+  out.append(reinterpret_cast<const char*>(&t), sizeof(T));
+}
+
+void put(std::string& out, const std::string& str) {
+  put(out, uint32_t(std::min<size_t>(str.size(), max_field)));
+  out.append(str, 0, max_field);
+}
+
+// a name no other writer uses, in this process or another
+std::string temporary(const std::string& path) {
+  static std::atomic<unsigned> counter = 0;
+  return path + "." + std::to_string(getpid()) + "-" + std::to_string(counter++) + ".tmp";
+}
+
+bool temporary(const char* name) {
+  const auto length = strlen(name);
+  return length > 4 and 0 == strcmp(name + length - 4, ".tmp");
+}
+
+/**
+ * reads the head of an entry, leaving the file at the beginning of the body
+ * \return false if the file is not an entry of the given url
+*/
+bool read_head(int fd, const std::string& url, artifact::cache::entry& info) {
+  char head[sizeof(magic)];
+  uint32_t ver;
+  std::string name;
+  return get(fd, head, sizeof(head)) and 0 == memcmp(head, magic, sizeof(magic)) and
+         get(fd, &ver, sizeof(ver)) and version == ver and
+         get(fd, &info.size, sizeof(info.size)) and
+         get(fd, name) and url == name and
+         get(fd, info.etag) and get(fd, info.modified) and get(fd, info.type);
+}
+
+
+/**
+ * decompresses a body, starting at the current offset of the file
+ * \param lambda invoked for each chunk, if not null
+ * \return false if the body is not complete, or not of the given size
+*/
+bool inflate(int fd, uint64_t size, const std::function<void(const char*, size_t)>* lambda) {
+
+  const std::unique_ptr<gzFile_s, int (*)(gzFile)> gz(gzdopen(dup(fd), "rb"), gzclose_r);
+  if (not gz) {
+    return false;
+  }
+
+  std::vector<char> buffer(chunk_size);
+  uint64_t total = 0;
+  for (int got; (got = gzread(gz.get(), buffer.data(), unsigned(buffer.size()))) != 0; ) {
+    if (got < 0) {
+      return false;
+    }
+    if (lambda) {
+      (*lambda)(buffer.data(), size_t(got));
+    }
+    total += got;
+  }
+
+  // a stream cut short ends without an error from gzread(), only gzerror() tells
+  int error = Z_OK;
+  gzerror(gz.get(), &error);
+  return Z_OK == error and total == size and gzeof(gz.get());
+}
+}
+
+namespace artifact {
+
+cache::cache(const std::string& directory, uint64_t capacity)
+  : directory(directory), capacity(capacity) {
+  if (0 != mkdir(directory.c_str(), 0755) and EEXIST != errno) {
+    throw std::runtime_error("cannot create cache directory " + directory + ": " + strerror(errno));
+  }
+}
+
+std::string cache::path_of(const std::string& url) const {
+  uint64_t hash = 0xcbf29ce484222325; // FNV-1a, stable across runs and builds
+  for (const char c : url) {
+    hash = (hash ^ uint8_t(c)) * 0x100000001b3;
+  }
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.entry", static_cast<unsigned long long>(hash));
+  return directory + name;
+}
+
+std::optional<cache::entry> cache::lookup(const std::string& url) const {
+  const descriptor file(open(path_of(url).c_str(), O_RDONLY | O_CLOEXEC));
+  entry info;
+  if (file.fd < 0 or not read_head(file.fd, url, info)) {
+    return std::nullopt;
+  }
+  return info;
+}
+
+bool cache::read(const std::string& url,
+                 const std::function<void(const char*, size_t)>& lambda) const {
+
+  const auto path = path_of(url);
+  const descriptor file(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  entry info;
+  if (file.fd < 0 or not read_head(file.fd, url, info)) {
+    return false;
+  }
+
+  // the whole body is checked first, the consumer must not get the beginning of a damaged one
+  const off_t body = lseek(file.fd, 0, SEEK_CUR);
+  if (body < 0 or not inflate(file.fd, info.size, nullptr)) {
+    log_warning << "corrupted cache entry for " << url << ", removed";
+    unlink(path.c_str());
+    return false;
+  }
+
+  // the recently used entries are the recently modified ones
+  futimens(file.fd, nullptr);
+
+  if (body != lseek(file.fd, body, SEEK_SET) or not inflate(file.fd, info.size, &lambda)) {
+    throw std::runtime_error("cannot read cache entry " + path);
+  }
+
+  return true;
+}
+
+std::unique_ptr<cache::writer> cache::store(const std::string& url, const entry& info) {
+  return std::unique_ptr<writer>(new writer(*this, url, info));
+}
+
+void cache::evict() {
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  const std::unique_ptr<DIR, int (*)(DIR*)> dir(opendir(directory.c_str()), closedir);
+  if (not dir) {
+    log_warning << "cannot scan cache directory " << directory << ": " << strerror(errno);
+    return;
+  }
+
+  struct file_t {
+    timespec used;
+    uint64_t size;
+    std::string name;
+  };
+
+  std::vector<file_t> files;
+  uint64_t total = 0;
+
+  const auto now = time(nullptr);
+
+  for (const dirent* ent; (ent = readdir(dir.get())); ) {
+    struct stat info;
+    if (0 == fstatat(dirfd(dir.get()), ent->d_name, &info, AT_SYMLINK_NOFOLLOW) and
+        S_ISREG(info.st_mode) and
+        (not temporary(ent->d_name) or now - info.st_mtim.tv_sec > stale_after)) {
+      files.push_back({info.st_mtim, uint64_t(info.st_size), ent->d_name});
+      total += info.st_size;
+    }
+  }
+
+  if (total <= capacity) {
+    return;
+  }
+
+  std::sort(files.begin(), files.end(), [](const file_t& a, const file_t& b){
+    return a.used.tv_sec != b.used.tv_sec ? a.used.tv_sec < b.used.tv_sec
+                                          : a.used.tv_nsec < b.used.tv_nsec;
+  });
+
+  for (auto it = files.begin(); it != files.end() and total > capacity; ++it) {
+    if (0 == unlinkat(dirfd(dir.get()), it->name.c_str(), 0) or ENOENT == errno) {
+      log_debug << "evicted " << it->name << " from the cache";
+      total -= it->size;
+    }
+  }
+
+  log_info << "cache " << directory << " trimmed down to " << total << " bytes";
+}
+
+cache::writer::writer(cache& owner, const std::string& url, const entry& info)
+  : owner(owner), path(owner.path_of(url)),
+    temp(temporary(path)),
+    fd(open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)), gz(nullptr), size(0),
+    committed(false) {
+
+  if (fd < 0) {
+    throw std::runtime_error("cannot create cache entry " + temp + ": " + strerror(errno));
+  }
+
+  std::string head(magic, sizeof(magic));
+  put(head, version);
+  put(head, size); // known once complete
+  put(head, url);
+  put(head, info.etag);
+  put(head, info.modified);
+  put(head, info.type);
+
+  // logs compress well even at the fastest level, which keeps up with the transfer
+  if (head.size() != size_t(::write(fd, head.data(), head.size())) or
+      nullptr == (gz = gzdopen(dup(fd), "wb1"))) {
+    close(fd);
+    unlink(temp.c_str());
+    throw std::runtime_error("cannot write cache entry " + temp);
+  }
+}
+
+cache::writer::~writer() {
+  if (gz) {
+    gzclose_w(static_cast<gzFile>(gz));
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (not committed) {
+    unlink(temp.c_str());
+  }
+}
+
+void cache::writer::write(const char* data, size_t count) {
+  if (count and 0 == gzwrite(static_cast<gzFile>(gz), data, unsigned(count))) {
+    throw std::runtime_error("cannot write cache entry " + temp);
+  }
+  size += count;
+}
+
+void cache::writer::commit() {
+
+  const int closed = gzclose_w(static_cast<gzFile>(gz));
+  gz = nullptr;
+
+  if (Z_OK != closed or sizeof(size) != size_t(pwrite(fd, &size, sizeof(size), size_offset))) {
+    throw std::runtime_error("cannot write cache entry " + temp);
+  }
+
+  if (0 != rename(temp.c_str(), path.c_str())) {
+    throw std::runtime_error("cannot replace cache entry " + path + ": " + strerror(errno));
+  }
+
+  committed = true;
+  owner.evict();
+}
+
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <functional>
+#include <cstdint>
+
+namespace artifact {
+
+/**
+ * \brief An on-disk cache of remote resources, keyed by url. Each entry holds the body of a
+ * resource, compressed, along with the validators the server sent with it (ETag and
+ * Last-Modified): the next download asks the server whether the resource changed, and uses the
+ * cached body if it did not, transferring nothing. Once the entries take more than the given
+ * capacity the least recently used ones are evicted.
+ * Entries are written to a temporary file then renamed, so any number of processes can share
+ * the same directory.
+*/
+class cache final {
+public:
+
+  /// what is known of a cached resource
+  struct entry {
+    std::string etag; // as sent by the server, quotes included
+    std::string modified; // the Last-Modified date, as sent by the server
+    std::string type; // the Content-Type, which tells the encoding
+    uint64_t size = 0; // of the body, uncompressed
+  };
+
+  /**
+   * \brief Stores a resource while it is downloaded, the entry replaces the previous one only
+   * once committed: a transfer that fails leaves the cache untouched.
+  */
+  class writer final {
+  public:
+
+    ~writer();
+
+    /**
+     * appends a chunk of the body
+     * \throw std::runtime_error if the entry cannot be written
+    */
+    void write(const char* data, size_t size);
+
+    /**
+     * completes the entry and makes it visible, then evicts what no longer fits
+     * \throw std::runtime_error if the entry cannot be written
+    */
+    void commit();
+
+  private:
+
+    friend class cache;
+
+    writer(cache& owner, const std::string& url, const entry& info);
+    writer(const writer&) = delete;
+    writer& operator = (const writer&) = delete;
+
+    cache& owner;
+    const std::string path;
+    const std::string temp;
+    int fd;
+    void* gz; // gzFile, zlib is kept out of the headers
+    uint64_t size;
+    bool committed;
+  };
+
+  /**
+   * c'tor, creates the directory if needed
+   * \param directory where the entries are stored
+   * \param capacity the size of all the entries, compressed, in bytes
+   * \throw std::runtime_error if the directory cannot be created
+  */
+  cache(const std::string& directory, uint64_t capacity);
+
+  /**
+   * looks up a resource
+   * \param url the url of the resource
+   * \return what is known of the resource, if cached
+  */
+  std::optional<entry> lookup(const std::string& url) const;
+
+  /**
+   * reads the body of a cached resource and marks it as recently used, the body is checked
+   * whole before the first chunk is passed on
+   * \param url the url of the resource
+   * \param lambda void lambda(const char* data, size_t size), invoked for each chunk
+   * \return false if the resource is not cached (anymore), or if its entry is corrupted: it is
+   * removed then
+   * \throw std::runtime_error if the entry cannot be read after all
+  */
+  bool read(const std::string& url, const std::function<void(const char*, size_t)>& lambda) const;
+
+  /**
+   * starts storing a resource
+   * \param url the url of the resource
+   * \param info the validators of the resource, its size is ignored
+   * \throw std::runtime_error if the entry cannot be created
+  */
+  std::unique_ptr<writer> store(const std::string& url, const entry& info);
+
+  /**
+   * removes the least recently used entries until the others fit in the capacity
+  */
+  void evict();
+
+private:
+
+  cache(const cache&) = delete;
+  cache& operator = (const cache&) = delete;
+
+  std::string path_of(const std::string& url) const;
+
+  const std::string directory;
+  const uint64_t capacity;
+  std::mutex mutex; // one eviction at a time
+};
+
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <limits>
+
+/**
+ * \brief Thrown when an operation gives up because of a cancellation
+*/
+class cancelled_error : public std::runtime_error {
+public:
+  explicit cancelled_error(const std::string& what) : std::runtime_error(what) {}
+};
+
+/**
+ * \brief A cooperative cancellation token: long operations poll it and give up as soon as it
+ * is cancelled, either explicitly (usually because some other part of the work failed) or
+ * because its deadline expired. The first reason given is the one reported.
+*/
+class cancellation final {
+public:
+
+  using clock = std::chrono::steady_clock;
+
+  cancellation() : flag(false), deadline(never) {}
+
+  /**
+   * cancels the token
+   * \param why the reason, rethrown by check(); a cancelled_error if null
+  */
+  void cancel(std::exception_ptr why = nullptr) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (not flag) {
+      reason = why ? why : std::make_exception_ptr(cancelled_error("operation cancelled"));
+      flag = true;
+    }
+  }
+
+  /**
+   * makes the token expire after the given time from now
+   * \param timeout the time left
+  */
+  void expire_after(clock::duration timeout) {
+    deadline = (clock::now() + timeout).time_since_epoch().count();
+  }
+
+  /// tells if the operations should give up
+  bool cancelled() const {
+    if (flag) {
+      return true;
+    }
+    if (deadline_expired()) {
+      const_cast<cancellation*>(this)->cancel(
+        std::make_exception_ptr(cancelled_error("deadline expired")));
+      return true;
+    }
+    return false;
+  }
+
+  /**
+   * throws the reason of the cancellation, if cancelled
+  */
+  void check() const {
+    if (cancelled()) {
+      std::lock_guard<std::mutex> lock(mutex);
+      std::rethrow_exception(reason);
+    }
+  }
+
+  /// a token nobody ever cancels
+  static const cancellation& none() {
+    static const cancellation token;
+    return token;
+  }
+
+private:
+
+  cancellation(const cancellation&) = delete;
+  cancellation& operator = (const cancellation&) = delete;
+
+  bool deadline_expired() const {
+    const auto when = deadline.load();
+    return never != when and clock::now().time_since_epoch().count() >= when;
+  }
+
+  static constexpr clock::rep never = std::numeric_limits<clock::rep>::max();
+
+  std::atomic<bool> flag;
+  std::atomic<clock::rep> deadline; // in clock ticks, or never
+  std::exception_ptr reason;
+  mutable std::mutex mutex;
+};
@@ -6,6 +6,7 @@
 
 #include <type_traits>
 #include <string>
+#include <cstdint>
 
 template <typename To, typename From>
 typename std::enable_if<sizeof(From) < sizeof(To), std::basic_string<To>>::type
@@ -26,12 +27,30 @@ struct patterns {
   std::vector<artifact::basic_pattern<CharT>> normalizers;
 };
 
+// a target of a batch, along with the file its meaningful lines are written to
+struct target_t {
+  std::string url;
+  std::string output;
+};
+
 template <typename CharT>
 class configuration {
 public:
   std::string target;
+  // the targets of a batch, all narrowed down by the same references, instead of the target
+  std::vector<target_t> targets;
   std::vector<std::string> reference;
   patterns<CharT> rules;
+  // a line is noise only if it occurs in at least this many references
+  size_t min_occurrences = 1;
+  // optional file holding the reference corpus across runs
+  std::string corpus;
+  // optional directory where the remote references are cached across runs
+  std::string cache;
+  // the size of the cache, in bytes
+  uint64_t cache_size = uint64_t(1) << 30;
+  // identifies the rules, hashes computed with different rules cannot be compared
+  uint64_t digest = 0xcbf29ce484222325; // FNV-1a offset basis
 
   static configuration<CharT> load(const std::string& filename) {
     return configuration<CharT>(YAML::LoadFile(filename));
@@ -41,23 +60,71 @@ public:
     return configuration<CharT>(YAML::Load(istream));
   }
 
+  static configuration<CharT> parse(const YAML::Node& node) {
+    return configuration<CharT>(node);
+  }
+
 private:
   explicit configuration(const YAML::Node& node) {
 
-    target = node["target"].as<std::string>();
+    if (node["targets"]) {
+      if (node["target"]) {
+        throw std::runtime_error("target and targets cannot be used together");
+      }
+      for (const auto& entry : node["targets"]) {
+        targets.push_back({entry["url"].as<std::string>(), entry["output"].as<std::string>()});
+      }
+    } else if (node["target"]) {
+      target = node["target"].as<std::string>();
+    } else {
+      throw std::runtime_error("no target");
+    }
 
     for (const auto& ref : node["reference"]) {
       reference.push_back(ref.as<std::string>());
     }
 
+    if (node["min_occurrences"]) {
+      min_occurrences = node["min_occurrences"].as<size_t>();
+      if (0 == min_occurrences) {
+        throw std::runtime_error("min_occurrences must be greater than zero");
+      }
+    }
+
+    if (node["corpus"]) {
+      corpus = node["corpus"].as<std::string>();
+    }
+
+    if (node["cache"]) {
+      cache = node["cache"].as<std::string>();
+    }
+
+    if (node["cache_size"]) {
+      cache_size = node["cache_size"].as<uint64_t>() << 20;
+      if (0 == cache_size) {
+        throw std::runtime_error("cache_size must be greater than zero");
+      }
+    }
+
+    mix(std::to_string(sizeof(CharT)));
     extract_patterns(node, "filters", rules.filters);
     extract_patterns(node, "normalizers", rules.normalizers);
   }
 
+  void mix(const std::string& str) {
+    for (const char c : str) {
+      digest = (digest ^ uint8_t(c)) * 0x100000001b3; // FNV-1a prime
+    }
+  }
+
   void extract_patterns(const YAML::Node& node,
                         const char* name,
                         std::vector<artifact::basic_pattern<CharT>>& list) {
+    mix(name);
     for (const auto& entry : node[name]) {
+      for (const auto& pair : entry) {
+        mix(pair.first.as<std::string>() + ':' + pair.second.as<std::string>() + '\n');
+      }
       if (entry["r"]) {
         list.emplace_back(std::basic_regex<CharT>(convert<CharT>(entry["r"].as<std::string>())));
       } else if (entry["s"]) {
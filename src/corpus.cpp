@@ -0,0 +1,177 @@
+#include "corpus.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+#include <cstdio>
+#include <cstring>
+
+/*
+ * file layout (native endianness):
+ *   magic[8] version:u32 hash_size:u32 digest:u64
+ *   references:u64 { name_size:u64 hashes:u64 name[name_size] hash[hashes] }...
+ *   counts:u64 { hash count:u32 }...
+*/
+static constexpr char magic[8] = {'D', 'N', 'C', 'O', 'R', 'P', 'U', 'S'};
+static constexpr uint32_t version = 1;
+
+template <typename T>
+static inline void put(std::ostream& os, const T& t) {
+  os.write(reinterpret_cast<const char*>(&t), sizeof(T));
+}
+
+template <typename T>
+static inline T get(std::istream& is) {
+  T t;
+  if (not is.read(reinterpret_cast<char*>(&t), sizeof(T))) {
+    throw std::runtime_error("corpus file is truncated");
+  }
+  return t;
+}
+
+corpus::corpus(uint64_t digest) : digest(digest) {
+}
+
+corpus corpus::load(const std::string& filename, uint64_t digest) {
+
+  corpus result(digest);
+
+  std::ifstream is(filename, std::ios_base::in | std::ios_base::binary);
+  if (not is.is_open()) {
+    log_info << "corpus '" << filename << "' not found, starting from scratch";
+    return result;
+  }
+
+  char head[sizeof(magic)];
+  if (not is.read(head, sizeof(head)) or 0 != memcmp(head, magic, sizeof(magic))) {
+    throw std::runtime_error("not a corpus file: " + filename);
+  }
+
+  if (get<uint32_t>(is) != version or get<uint32_t>(is) != sizeof(hash_t)) {
+    log_warning << "corpus '" << filename << "' has an incompatible format, rebuilding it";
+    return result;
+  }
+
+  if (get<uint64_t>(is) != digest) {
+    log_warning << "corpus '" << filename << "' was built with different rules, rebuilding it";
+    return result;
+  }
+
+  const auto refs = get<uint64_t>(is);
+  result.entries.reserve(refs);
+  for (uint64_t r = 0; r < refs; ++r) {
+    std::string name(get<uint64_t>(is), '\0');
+    std::vector<hash_t> hashes(get<uint64_t>(is));
+    if (not is.read(name.data(), name.size()) or
+        not is.read(reinterpret_cast<char*>(hashes.data()), hashes.size() * sizeof(hash_t))) {
+      throw std::runtime_error("corpus file is truncated");
+    }
+    result.entries.emplace_back(std::move(name), std::move(hashes));
+  }
+
+  const auto size = get<uint64_t>(is);
+  result.counts.reserve(size);
+  for (uint64_t i = 0; i < size; ++i) {
+    const auto hash = get<hash_t>(is);
+    result.counts.emplace(hash, get<count_t>(is));
+  }
+
+  log_info << "corpus '" << filename << "' loaded, "
+           << result.entries.size() << " references, " << result.counts.size() << " hashes";
+
+  return result;
+}
+
+void corpus::save(const std::string& filename) const {
+
+  const auto temp = filename + ".tmp";
+
+  {
+    std::ofstream os(temp, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+    if (not os.is_open()) {
+      throw std::runtime_error("cannot write corpus file: " + temp);
+    }
+
+    os.write(magic, sizeof(magic));
+    put(os, version);
+    put(os, uint32_t(sizeof(hash_t)));
+    put(os, digest);
+
+    put(os, uint64_t(entries.size()));
+    for (const auto& entry : entries) {
+      put(os, uint64_t(entry.first.size()));
+      put(os, uint64_t(entry.second.size()));
+      os.write(entry.first.data(), entry.first.size());
+      os.write(reinterpret_cast<const char*>(entry.second.data()),
+               entry.second.size() * sizeof(hash_t));
+    }
+
+    put(os, uint64_t(counts.size()));
+    for (const auto& pair : counts) {
+      put(os, pair.first);
+      put(os, pair.second);
+    }
+
+    if (not os.flush()) {
+      throw std::runtime_error("cannot write corpus file: " + temp);
+    }
+  }
+
+  if (0 != std::rename(temp.c_str(), filename.c_str())) {
+    throw std::runtime_error("cannot replace corpus file " + filename + ": " + strerror(errno));
+  }
+}
+
+void corpus::insert(const std::vector<hash_t>& hashes) {
+  for (const auto hash : hashes) {
+    ++counts[hash];
+  }
+}
+
+void corpus::append(const std::string& name, std::vector<hash_t>&& hashes) {
+  expire(name);
+  insert(hashes);
+  entries.emplace_back(name, std::move(hashes));
+}
+
+bool corpus::expire(const std::string& name) {
+
+  const auto it = std::find_if(entries.begin(), entries.end(), [&name](const auto& entry){
+    return entry.first == name;
+  });
+
+  if (it == entries.end()) {
+    return false;
+  }
+
+  for (const auto hash : it->second) {
+    const auto count = counts.find(hash);
+    if (count != counts.end() and 0 == --count->second) {
+      counts.erase(count);
+    }
+  }
+
+  entries.erase(it);
+  return true;
+}
+
+bool corpus::contains(const std::string& name) const {
+  return entries.end() != std::find_if(entries.begin(), entries.end(), [&name](const auto& entry){
+    return entry.first == name;
+  });
+}
+
+std::vector<std::string> corpus::references() const {
+  std::vector<std::string> names;
+  names.reserve(entries.size());
+  for (const auto& entry : entries) {
+    names.push_back(entry.first);
+  }
+  return names;
+}
+
+void corpus::distinct(std::vector<hash_t>& hashes) {
+  std::sort(hashes.begin(), hashes.end());
+  hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+}
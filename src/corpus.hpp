@@ -0,0 +1,90 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+/**
+ * \brief The reference corpus: the set of hashes of all the reference lines, each one with
+ * the number of references it occurs in.
+ * The corpus may be persisted on disk and updated incrementally, new references are appended
+ * and old ones expired without touching the others.
+*/
+class corpus final {
+public:
+
+  using hash_t = size_t;
+  using count_t = uint32_t;
+
+  /**
+   * c'tor, creates an empty corpus
+   * \param digest identifies the rules used to compute the hashes, see configuration::digest
+  */
+  explicit corpus(uint64_t digest = 0);
+
+  /**
+   * loads a corpus from disk
+   * \param filename the file to load the corpus from
+   * \param digest the digest of the rules in use
+   * \return the stored corpus, or an empty one if the file does not exist or if it was built
+   * using different rules
+  */
+  static corpus load(const std::string& filename, uint64_t digest);
+
+  /**
+   * stores the corpus on disk, the file is replaced atomically
+   * \param filename the destination file
+  */
+  void save(const std::string& filename) const;
+
+  /**
+   * adds the hashes of an anonymous reference, that cannot be expired later
+   * \param hashes the distinct hashes of the reference, see distinct()
+  */
+  void insert(const std::vector<hash_t>& hashes);
+
+  /**
+   * adds the hashes of a named reference
+   * \param name the name of the reference (usually its url)
+   * \param hashes the distinct hashes of the reference, see distinct()
+  */
+  void append(const std::string& name, std::vector<hash_t>&& hashes);
+
+  /**
+   * removes a named reference from the corpus
+   * \param name the name of the reference
+   * \return false if there is no such reference
+  */
+  bool expire(const std::string& name);
+
+  /// tells if the named reference is part of the corpus
+  bool contains(const std::string& name) const;
+
+  /// the names of all the references in the corpus
+  std::vector<std::string> references() const;
+
+  /// the number of references the given hash occurs in
+  inline size_t count(hash_t hash) const {
+    const auto it = counts.find(hash);
+    return it == counts.end() ? 0 : it->second;
+  }
+
+  /// the number of distinct hashes
+  inline size_t size() const {
+    return counts.size();
+  }
+
+  /// prepares the bucket to receive the given number of hashes
+  inline void reserve(size_t size) {
+    counts.reserve(size);
+  }
+
+  /// sorts the given hashes and removes the duplicates
+  static void distinct(std::vector<hash_t>& hashes);
+
+private:
+  uint64_t digest;
+  std::vector<std::pair<std::string, std::vector<hash_t>>> entries;
+  std::unordered_map<hash_t, count_t> counts;
+};
@@ -3,63 +3,398 @@
 #include "artifact.hpp"
 #include "profile.hpp"
 #include "config.hpp"
+#include "corpus.hpp"
+#include "cancellation.hpp"
+#include "follower.hpp"
 
 #include <vector>
+#include <deque>
+#include <unordered_map>
 #include <unordered_set>
+#include <algorithm>
+#include <atomic>
 #include <future>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <chrono>
+#include <limits>
+#include <optional>
 
 #define USE_THREAD_POOL 1
 
 #ifdef WITH_THREAD_POOL
 #include "thread-pool.hpp"
+#include "pipeline.hpp"
 #endif
 
 template <typename CharT>
 class denoiser {
 public:
-  explicit denoiser(const configuration<CharT>& art) : config(art) {}
+  explicit denoiser(const configuration<CharT>& art)
+    : config(art), bucket(art.digest), store(open_cache(art)) {}
+
+#if USE_THREAD_POOL
+  /**
+   * c'tor, the work is done on the given pool instead of a pool of its own
+  */
+  denoiser(const configuration<CharT>& art, thread_pool& workers)
+    : config(art), bucket(art.digest), store(open_cache(art)), own_pool(), pool(workers) {}
+#endif
 
   /**
-   * Executes the whole process of downloading and simplifying files, preparing the bucket
-   * and performing the final filtering.
+   * Executes the whole process of downloading and simplifying files, narrowing down the lines
+   * of the target with each reference as soon as it is ready, and emitting the survivors.
    * \param artifact the descriptor of the artifact to analyze
    * \param lambda the lambda that will be invoked for each line emitted
    * \note the signature of the lambda is void lambda(const artifact::basic_line<CharT>& line)
   */
   template <typename Lambda>
   void run(const Lambda& lambda) {
+    execute([&](const artifact::basic_file<CharT>& file){
+      emit(file, lambda, limit);
+    });
+  }
+
+  /**
+   * Like run(), but each distinct meaningful line is emitted only once, at the end, in the
+   * order of its first occurrence and along with the number of times it occurred.
+   * \param lambda the lambda that will be invoked for each distinct line emitted
+   * \note the signature of the lambda is
+   * void lambda(const artifact::basic_line<CharT>& first, size_t occurrences)
+  */
+  template <typename Lambda>
+  void run_collapsed(const Lambda& lambda) {
+    execute([&](const artifact::basic_file<CharT>& file){
+      collapse(file, lambda);
+    });
+  }
+
+  /**
+   * Runs every target of the batch against the same references: the references are ingested
+   * once, then the targets are prepared and probed in parallel, each one failing on its own.
+   * \param lambda the lambda that will be invoked for each line emitted
+   * \throw std::runtime_error if any target failed, once all the others are done
+   * \note the signature of the lambda is
+   * void lambda(size_t target, const artifact::basic_line<CharT>& line), it is invoked from
+   * multiple threads at once, but never for the same target
+  */
+  template <typename Lambda>
+  void run_batch(const Lambda& lambda) {
+    execute_batch([&](size_t target, const artifact::basic_file<CharT>& file){
+      emit(file, [&lambda, target](const artifact::basic_line<CharT>& line){
+        lambda(target, line);
+      }, limit);
+    });
+  }
 
+  /**
+   * Like run_batch(), but each target is collapsed as in run_collapsed()
+   * \param lambda the lambda that will be invoked for each distinct line emitted
+   * \note the signature of the lambda is
+   * void lambda(size_t target, const artifact::basic_line<CharT>& first, size_t occurrences)
+  */
+  template <typename Lambda>
+  void run_batch_collapsed(const Lambda& lambda) {
+    execute_batch([&](size_t target, const artifact::basic_file<CharT>& file){
+      collapse(file, [&lambda, target](const artifact::basic_line<CharT>& line, size_t count){
+        lambda(target, line, count);
+      });
+    });
+  }
+
+  /**
+   * Only ingests the references, the resulting bucket can be used by any number of runs of
+   * run_against() with the same rules and references, but different targets
+   * \return the hashes of all the references
+  */
+  corpus ingest() {
     profile("all", [&](){
+      if (timeout.count()) {
+        token.expire_after(timeout);
+      }
+      shared = true;
+      ingest_references();
+    });
+    return std::move(bucket);
+  }
 
-      std::vector<std::future<void>> future;
-      future.reserve(config.reference.size());
-      size_t count = 0;
-      for (const auto& url : config.reference) {
-        future.emplace_back(std::async(std::launch::async, [this, &url, &count](){
-          fill_bucket(url, config.rules);
-        }));
+  /**
+   * Like run(), but the target is narrowed down with a bucket ingested already
+   * \param references the bucket returned by ingest()
+   * \param lambda the lambda that will be invoked for each line emitted
+  */
+  template <typename Lambda>
+  void run_against(const corpus& references, const Lambda& lambda) {
+    execute_against(references, [&](const artifact::basic_file<CharT>& file){
+      emit(file, lambda, limit);
+    });
+  }
+
+  /**
+   * Like run_collapsed(), but the target is narrowed down with a bucket ingested already
+   * \param references the bucket returned by ingest()
+   * \param lambda the lambda that will be invoked for each distinct line emitted
+  */
+  template <typename Lambda>
+  void run_against_collapsed(const corpus& references, const Lambda& lambda) {
+    execute_against(references, [&](const artifact::basic_file<CharT>& file){
+      collapse(file, lambda);
+    });
+  }
+
+  /**
+   * Like run(), but the target is still growing: once the references are ingested, the lines
+   * already in the target and then each line appended to it are probed as soon as they are
+   * complete, the work done for each change being proportional to the bytes appended.
+   * Returns once the follower is stopped, the limit is reached or the target is removed.
+   * \param target the follower of the target of the configuration
+   * \param lambda the lambda that will be invoked for each line emitted
+   * \param idle the lambda that will be invoked each time all the complete lines have been
+   * emitted, before waiting for more
+   * \note the signature of the idle lambda is void idle()
+  */
+  template <typename Lambda, typename Idle>
+  void follow(follower& target, const Lambda& lambda, const Idle& idle) {
+    profile("all", [&](){
+      if (timeout.count()) {
+        token.expire_after(timeout);
+      }
+      shared = true;
+      ingest_references();
+      profile("following " + config.target, [&](){
+        tail(target, lambda, idle);
+      });
+    });
+  }
+
+  /**
+   * Limits the lines emitted by each run, or by each target of a batch: once the limit is
+   * reached the rest of the target is not probed anymore
+   * \param lines the maximum number of lines (or of distinct lines, if collapsed) to emit
+  */
+  void set_limit(size_t lines) {
+    limit = lines;
+  }
+
+  /**
+   * Bounds the duration of the runs: once expired, the downloads and the jobs in progress are
+   * abandoned and run() throws a cancelled_error
+   * \param t the time allowed to each run, from its start
+  */
+  void set_timeout(std::chrono::milliseconds t) {
+    timeout = t;
+  }
+
+  /**
+   * Abandons the run in progress, which throws a cancelled_error; can be called from any thread
+  */
+  void cancel() {
+    token.cancel();
+  }
+
+#if USE_THREAD_POOL
+  /**
+   * The statistics of the thread pool, collected only when thread_pool::set_instrumented() was
+   * enabled before the construction
+  */
+  thread_pool::stats_t stats() const {
+    return pool.stats();
+  }
+#endif
+
+private:
+
+  /**
+   * Prepares the target and narrows it down with the references
+   * \param output the final step, invoked with the prepared target
+   */
+  template <typename Output>
+  void execute(const Output& output) {
+
+    profile("all", [&](){
+
+      if (timeout.count()) {
+        token.expire_after(timeout);
       }
 
-      auto file = prepare(config.target, config.rules);
+      // references are fetched and normalized while the target is, but they can only be used
+      // to narrow down the survivors once the target is ready
+      schedule_t schedule(pending_references());
+      start(schedule);
 
-      for (auto& f : future) {
-        f.wait();
+      artifact::basic_file<CharT> file;
+
+      try {
+        file = prepare(config.target, config.rules);
+        profile("collecting survivors", [&](){
+          collect_survivors();
+        });
+      } catch (...) {
+        token.cancel(std::current_exception());
+        join(schedule);
+        throw;
+      }
+
+      join(schedule);
+
+      // a reference failed, or the time is up, unless the survivors ran out
+      bool settled = false;
+      try {
+        token.check();
+      } catch (const settled_error& ex) {
+        log_info << ex.what() << ", the remaining references were skipped";
+        settled = true;
+      }
+
+      log_info << survivors.size() << " distinct lines survived "
+               << config.reference.size() << " references";
+
+      if (persistent()) {
+        profile("saving corpus " + config.corpus, [&](){
+          update_corpus();
+          bucket.save(config.corpus);
+        });
+      }
+
+      if (settled) {
+        return; // nothing to output
       }
 
       profile("output", [&](){
-        for (const auto& line : file) {
-          if (0 == bucket.count(line.hash())) {
-            lambda(line);
-          }
+        output(file);
+      });
+    });
+  }
+
+  /**
+   * Ingests the references into the bucket, then prepares and narrows down each target of the
+   * batch with it
+   * \param output the final step, invoked with the index and the prepared file of each target
+   */
+  template <typename Output>
+  void execute_batch(const Output& output) {
+
+    profile("all", [&](){
+
+      if (timeout.count()) {
+        token.expire_after(timeout);
+      }
+
+      shared = true;
+      ingest_references();
+
+      std::atomic<size_t> failed = 0;
+
+      spread(config.targets.size(), [&](size_t t){
+        const auto& url = config.targets[t].url;
+        if (token.cancelled()) {
+          return;
+        }
+        try {
+          const auto file = prepare(url, config.rules);
+          profile("output " + url, [&](){
+            output(t, file);
+          });
+        } catch (const cancelled_error& ex) {
+          log_debug << "target " << url << " abandoned: " << ex.what();
+        } catch (const std::exception& ex) {
+          log_error << "target " << url << " failed: " << ex.what();
+          ++failed;
         }
       });
+
+      // the time is up
+      token.check();
+
+      if (failed) {
+        throw std::runtime_error(std::to_string(failed.load()) + " of " +
+                                 std::to_string(config.targets.size()) + " targets failed");
+      }
     });
   }
 
-private:
+  /**
+   * Prepares the target and narrows it down with a bucket ingested already
+   * \param references the bucket
+   * \param output the final step, invoked with the prepared target
+   */
+  template <typename Output>
+  void execute_against(const corpus& references, const Output& output) {
+
+    profile("all", [&](){
+
+      if (timeout.count()) {
+        token.expire_after(timeout);
+      }
+
+      shared = true;
+      ingested = &references;
+
+      const auto file = prepare(config.target, config.rules);
+
+      profile("output", [&](){
+        output(file);
+      });
+    });
+  }
 
   /**
-   * Downloads the file and applies filters and normalizers
+   * Fills the bucket with all the references, and stores it if persistent
+   */
+  void ingest_references() {
+
+    {
+      schedule_t schedule(pending_references());
+      start(schedule);
+      join(schedule);
+    }
+
+    // a reference failed, or the time is up
+    token.check();
+
+    update_corpus();
+
+    log_info << bucket.size() << " distinct lines in " << config.reference.size() << " references";
+
+    if (persistent()) {
+      profile("saving corpus " + config.corpus, [&](){
+        bucket.save(config.corpus);
+      });
+    }
+  }
+
+  /**
+   * Loads the corpus, if persistent, expiring the references no longer configured
+   * \return the references not in the corpus yet, by position in the configuration
+   */
+  std::vector<size_t> pending_references() {
+
+    if (persistent()) {
+      profile("loading corpus " + config.corpus, [&](){
+        bucket = corpus::load(config.corpus, config.digest);
+      });
+      for (const auto& name : bucket.references()) {
+        if (config.reference.end() == std::find(config.reference.begin(), config.reference.end(), name)) {
+          log_info << "expiring reference " << name;
+          bucket.expire(name);
+        }
+      }
+    }
+
+    std::vector<size_t> pending;
+    for (size_t r = 0; r < config.reference.size(); ++r) {
+      if (persistent() and bucket.contains(config.reference[r])) {
+        log_debug << "reference " << config.reference[r] << " already in the corpus";
+      } else {
+        pending.push_back(r);
+      }
+    }
+    return pending;
+  }
+
+  /**
+   * Downloads the file, applies filters and normalizers and seeds the survivors with its hashes
    * \param url the remote url to download the file from
    * \param rules there rules to apply to normalize the file
    * \return the file ready for analysis
@@ -70,58 +405,663 @@ private:
     artifact::basic_file<CharT> file;
 
     profile("fetching " + url, [&](){
-      file = artifact::basic_file<CharT>::fetch(url);
+      file = artifact::basic_file<CharT>::fetch(url, token);
+      profiling::count("lines", file.size());
     });
 
-    profile("filtering " + url, [&](){
-      filter(file, rules);
-    });
+    place(file);
 
     profile("normalizing " + url, [&](){
       normalize(file, rules);
     });
 
-    profile("calculating hashes for " + url, [&](){
-      compute_hashes(file);
+    return file;
+  }
+
+  /**
+   * Filters, normalizes and hashes the lines of the file in parallel, each NUMA node taking the
+   * lines placed on it, then seeds the survivors with their hashes.
+   * \param file the freshly fetched file
+   * \param rules the rules to apply
+   */
+  void normalize(artifact::basic_file<CharT>& file, const patterns<CharT>& rules) {
+
+    loop(file, [&rules](artifact::basic_line<CharT>& line){
+      apply(line, rules);
+      line.hash();
     });
 
-    return file;
+    // the targets of a batch are probed against the bucket instead
+    if (not shared) {
+      survivors.reserve(file.size());
+      for (const auto& line : file) {
+        survivors.emplace(line.hash(), survivor{0});
+      }
+    }
+  }
+
+  /**
+   * Applies the filters and the normalizers to a single line
+   */
+  static void apply(artifact::basic_line<CharT>& line, const patterns<CharT>& rules) {
+    for (const auto& pattern : rules.filters) {
+      line.suppress(pattern);
+    }
+    for (const auto& pattern : rules.normalizers) {
+      line.remove(pattern);
+    }
+  }
+
+  /**
+   * Leaves out of the survivors the hashes already proven to be noise by the references stored
+   * in the corpus. Then uses the hashes deferred by the references that were faster than the
+   * target.
+   */
+  void collect_survivors() {
+    const auto distinct = survivors.size();
+    for (auto it = survivors.begin(); it != survivors.end();) {
+      it->second.hits = bucket.count(it->first);
+      it = (it->second.hits < config.min_occurrences) ? std::next(it) : survivors.erase(it);
+    }
+    profiling::count("hits", distinct - survivors.size());
+    profiling::count("survivors", survivors.size());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (const auto& hashes : deferred) {
+      std::unordered_set<corpus::hash_t> counted;
+      eliminate(hashes, counted);
+    }
+    deferred.clear();
+    target_ready = true;
+    settle();
   }
 
   /**
-   * Uses prepare() to download and normalize a log file, and then uses it to fill a bucket with
-   * its hashes.
+   * \brief The reason the references are abandoned once no line of the target can survive
+   */
+  class settled_error : public cancelled_error {
+  public:
+    settled_error() : cancelled_error("no line of the target is left") {}
+  };
+
+  /**
+   * Cancels the references still in progress once the survivors run out, as nothing they could
+   * do would make the output any different. Not if the corpus needs them all.
+   * \note the caller must hold the mutex
+   */
+  void settle() {
+    if (survivors.empty() and not persistent()) {
+      token.cancel(std::make_exception_ptr(settled_error()));
+    }
+  }
+
+  /**
+   * A batch of reference lines on its way through the pipeline, the text of the lines is
+   * stored back to back
+   */
+  struct batch_t {
+    std::vector<CharT> mut, imm;
+    std::vector<size_t> ends; // where each line ends
+    std::vector<corpus::hash_t> hashes;
+
+    void append(std::basic_string_view<CharT> line) {
+      mut.insert(mut.end(), line.begin(), line.end());
+      imm.insert(imm.end(), line.begin(), line.end());
+      ends.push_back(mut.size());
+    }
+
+    size_t size() const {
+      return ends.size();
+    }
+
+    void clear() {
+      mut.clear();
+      imm.clear();
+      ends.clear();
+      hashes.clear();
+    }
+  };
+
+  /**
+   * Streams a reference through the pipeline: lines are read and copied in batches, each batch
+   * is filtered, normalized and hashed in parallel, then its hashes are used to narrow down
+   * the survivors, one batch at a time. The reference itself is never stored, its distinct
+   * hashes are collected only if they go to the bucket, or until the target is ready.
    * \param url the remote url to download the file from
+   * \param index the position of the reference in the configuration, starting from 1
    * \param rules there rules to apply to normalize the file
   */
   void fill_bucket(const std::string& url,
+                   size_t index,
                    const patterns<CharT>& rules) {
 
-    const auto file = prepare(url, rules);
+    std::vector<corpus::hash_t> hashes;
+    size_t distinct = 0;
+
+    // hashes seen before the target was ready
+    std::unordered_set<corpus::hash_t> early;
+
+    // the survivors this reference already counted for, its batches interleave with the ones
+    // of the other references
+    std::unordered_set<corpus::hash_t> counted;
+
+    auto lines = make_pipeline<batch_t>();
+
+    lines.stage(lines.parallel, [&rules](batch_t& batch){
+      batch.hashes.clear();
+      for (size_t i = 0, first = 0; i < batch.size(); first = batch.ends[i++]) {
+        artifact::basic_line<CharT> line(nullptr, 0,
+                                         batch.mut.data() + first,
+                                         batch.imm.data() + first,
+                                         batch.ends[i] - first);
+        apply(line, rules);
+        batch.hashes.push_back(line.hash());
+      }
+    });
+
+    lines.stage(lines.serial, [&](batch_t& batch){
+      if (shared) {
+        // nothing to narrow down yet
+      } else if (target_ready) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (not early.empty()) {
+          eliminate(std::vector<corpus::hash_t>(early.begin(), early.end()), counted);
+          early.clear();
+        }
+        eliminate(batch.hashes, counted);
+      } else {
+        early.insert(batch.hashes.begin(), batch.hashes.end());
+      }
+      if (bucketed()) {
+        hashes.insert(hashes.end(), batch.hashes.begin(), batch.hashes.end());
+        if (hashes.size() > 2 * distinct + batch_size) { // keeps the duplicates at bay
+          corpus::distinct(hashes);
+          distinct = hashes.size();
+        }
+      }
+    });
+
+    profile("ingesting " + url, [&](){
+      batch_t batch;
+      const auto push = [&lines, &batch](){
+        lines.push([&batch](batch_t& next){
+          std::swap(next, batch); // recycles the buffers of an old batch
+        });
+        batch.clear();
+      };
+      const auto count = artifact::read_lines<CharT>(url, [&](auto& line){
+        batch.append(line.str());
+        if (batch.size() == batch_size) {
+          push();
+        }
+      }, token, store.get());
+      if (batch.size()) {
+        push();
+      }
+      lines.finish();
+      profiling::count("lines", count);
+      log_debug << url << ": " << count << " lines";
+    });
 
-    // access to the bucket must be synchronized
     std::lock_guard<std::mutex> lock(mutex);
 
-    const auto bucket_size = (file.size() * 3) / 2;
+    if (not early.empty()) {
+      std::vector<corpus::hash_t> rest(early.begin(), early.end());
+      if (target_ready) {
+        eliminate(rest, counted);
+      } else {
+        // the target will take care of them
+        deferred.push_back(std::move(rest));
+      }
+    }
 
-    if(bucket.size() < bucket_size) {
-      bucket.reserve(bucket_size);
+    if (bucketed()) {
+      corpus::distinct(hashes);
+      // the corpus must not change until the survivors are seeded
+      fresh.emplace_back(index, std::move(hashes));
     }
+  }
+
+  /**
+   * Stores the newly ingested references in the corpus, in configuration order
+   */
+  void update_corpus() {
+    std::sort(fresh.begin(), fresh.end(), [](const auto& a, const auto& b){
+      return a.first < b.first;
+    });
+    for (auto& pair : fresh) {
+      const auto bucket_size = (pair.second.size() * 3) / 2;
 
-    for (auto& line : file) {
-      bucket.insert(line.hash());
+      if(bucket.size() < bucket_size) {
+        bucket.reserve(bucket_size);
+      }
+
+      bucket.append(config.reference[pair.first - 1], std::move(pair.second));
+    }
+    fresh.clear();
+  }
+
+  /**
+   * Like fill_bucket(), but a failure cancels the whole run instead of throwing
+   */
+  void try_fill_bucket(size_t r) noexcept {
+    if (token.cancelled()) {
+      return;
+    }
+    try {
+      fill_bucket(config.reference[r], r + 1, config.rules);
+    } catch (const cancelled_error& ex) {
+      log_debug << "reference " << config.reference[r] << " abandoned: " << ex.what();
+    } catch (const std::exception& ex) {
+      log_error << "reference " << config.reference[r] << " failed: " << ex.what();
+      token.cancel(std::current_exception());
+    }
+  }
+
+  /**
+   * A batch of lines appended to a followed target, on its way through the pipeline
+   */
+  struct appended_t {
+    batch_t text;
+    size_t number = 0; // of the first line
+    std::vector<artifact::basic_line<CharT>> novel; // the meaningful lines, ready to emit
+  };
+
+  /**
+   * Reads the target as it grows: the bytes appended are decoded and split into lines, a
+   * character or a line split between two writes being completed by the following ones. The
+   * lines are filtered, normalized, hashed and probed in parallel batches, then emitted in order.
+   * \param target the follower of the target
+   * \param lambda the lambda that will be invoked for each line emitted
+   * \param idle the lambda that will be invoked once all the complete lines are emitted
+   */
+  template <typename Lambda, typename Idle>
+  void tail(follower& target, const Lambda& lambda, const Idle& idle) {
+
+    std::atomic<bool> enough = false;
+    size_t emitted = 0;
+
+    auto lines = make_pipeline<appended_t>();
+
+    lines.stage(lines.parallel, [this](appended_t& batch){
+      auto& text = batch.text;
+      batch.novel.clear();
+      for (size_t i = 0, first = 0; i < text.size(); first = text.ends[i++]) {
+        artifact::basic_line<CharT> line(nullptr, batch.number + i,
+                                         text.mut.data() + first,
+                                         text.imm.data() + first,
+                                         text.ends[i] - first);
+        apply(line, config.rules);
+        if (novel(line.hash())) {
+          batch.novel.push_back(std::move(line));
+        }
+      }
+    });
+
+    lines.stage(lines.serial, [this, &lambda, &enough, &emitted](appended_t& batch){
+      // not a line more than needed, the target might not grow anymore
+      for (const auto& line : batch.novel) {
+        if (enough) {
+          return;
+        }
+        lambda(line);
+        enough = (++emitted == limit);
+      }
+    });
+
+    appended_t batch;
+    const auto push = [&lines, &batch](){
+      lines.push([&batch](appended_t& next){
+        std::swap(next, batch); // recycles the buffers of an old batch
+      });
+      batch.text.clear();
+    };
+
+    const auto split = [&](artifact::basic_line<CharT>& line){
+      if (0 == batch.text.size()) {
+        batch.number = line.number();
+      }
+      batch.text.append(line.str());
+      if (batch.text.size() == batch_size) {
+        push();
+      }
+    };
+
+    // the partial line, and the partial character, read last are kept until completed
+    std::optional<artifact::basic_line_reader<CharT, decltype(split)>> reader(std::in_place, split);
+    encoding::chunk_decoder<CharT> decoder(encoding::UTF8<CharT>);
+
+    std::vector<char> buffer(64 * 1024);
+    std::vector<CharT> decoded;
+
+    const auto drain = [&](){
+      if (batch.text.size()) {
+        push();
+      }
+      lines.finish();
+      idle();
+    };
+
+    while (not enough) {
+
+      for (size_t size; not enough and (size = target.read(buffer.data(), buffer.size())); ) {
+        decoded.clear();
+        decoder.feed(buffer.data(), size, decoded);
+        reader->on_data(decoded.data(), decoded.size());
+      }
+
+      drain();
+
+      if (target.rewound()) {
+        // the content the partial line belonged to is gone, and so are its line numbers
+        decoder.reset();
+        reader.emplace(split);
+        continue;
+      }
+
+      if (not enough and not target.wait(token)) {
+        // the target will not grow anymore, its last line is complete
+        reader->flush();
+        drain();
+        break;
+      }
+    }
+
+    if (decoder.errors()) {
+      log_warning << decoder.errors() << " invalid sequences dropped from " << config.target;
+    }
+
+    // the time is up
+    token.check();
+  }
+
+  /**
+   * Narrows down the survivors, each survivor is counted at most once per reference.
+   * \param hashes some hashes of a reference
+   * \param counted the survivors the reference already counted for, updated
+   * \note the caller must hold the mutex
+   */
+  void eliminate(const std::vector<corpus::hash_t>& hashes,
+                 std::unordered_set<corpus::hash_t>& counted) {
+    for (const auto hash : hashes) {
+      const auto it = survivors.find(hash);
+      if (it != survivors.end() and counted.insert(hash).second) {
+        if (++it->second.hits >= config.min_occurrences) {
+          survivors.erase(it);
+        }
+      }
+    }
+    if (target_ready) {
+      settle();
+    }
+  }
+
+  /// the cache of the remote references, if the configuration asks for one
+  static std::unique_ptr<artifact::cache> open_cache(const configuration<CharT>& art) {
+    if (art.cache.empty()) {
+      return nullptr;
+    }
+    return std::make_unique<artifact::cache>(art.cache, art.cache_size);
+  }
+
+  /// tells if the corpus has to be stored across runs
+  bool persistent() const {
+    return not config.corpus.empty();
+  }
+
+  /// tells if the hashes of the references go to the bucket
+  bool bucketed() const {
+    return shared or persistent();
+  }
+
+  /// tells if a line with the given hash is meaningful
+  bool novel(size_t hash) const {
+    if (shared) {
+      return (ingested ? *ingested : bucket).count(hash) < config.min_occurrences;
+    }
+    return 0 != survivors.count(hash);
+  }
+
+  // the number of lines processed by a single job
+  static constexpr size_t batch_size = 1000;
+
+  /**
+   * Groups the meaningful lines of the file by hash while they are emitted, and hands each
+   * group to the lambda once all lines have been probed. The limit applies to the groups, so
+   * the whole file is probed whatever it is.
+   * \param file the file to analyze
+   * \param lambda the lambda that will be invoked for each group
+   */
+  template <typename Lambda>
+  void collapse(const artifact::basic_file<CharT>& file, const Lambda& lambda) {
+
+    std::unordered_map<size_t, size_t> index;
+    std::vector<std::pair<const artifact::basic_line<CharT>*, size_t>> groups;
+
+    emit(file, [&index, &groups](const artifact::basic_line<CharT>& line){
+      const auto pair = index.emplace(line.hash(), groups.size());
+      if (pair.second) {
+        groups.emplace_back(&line, 1);
+      } else {
+        ++groups[pair.first->second].second;
+      }
+    }, std::numeric_limits<size_t>::max());
+
+    for (size_t g = 0; g < std::min(limit, groups.size()); ++g) {
+      lambda(*groups[g].first, groups[g].second);
     }
   }
 
 #if USE_THREAD_POOL
 
+  /**
+   * \brief The references to ingest, they are handed out biggest first to a bounded number of
+   * runners on the pool, once their sizes are known
+   */
+  struct schedule_t {
+    explicit schedule_t(std::vector<size_t>&& refs)
+      : order(std::move(refs)),
+        sizes(order.size()),
+        cursor(0),
+        probed(order.size()),
+        ingested() {
+    }
+    std::vector<size_t> order;
+    std::vector<size_t> sizes;
+    std::atomic<size_t> cursor;
+    std::once_flag sorted;
+    thread_pool::latch probed;
+    std::unique_ptr<thread_pool::latch> ingested;
+  };
+
+  void start(schedule_t& schedule) {
+
+    const auto count = schedule.order.size();
+
+    for (size_t i = 0; i < count; ++i) {
+      pool.submit(schedule.probed, [this, &schedule, i](){
+        const auto& url = config.reference[schedule.order[i]];
+        schedule.sizes[i] = artifact::size_of(url, token, store.get());
+      });
+    }
+
+    // no more runners than workers, so references never exceed the requested job count
+    const auto runners = std::min(count, pool.size());
+
+    schedule.ingested = std::make_unique<thread_pool::latch>(runners);
+
+    // a runner ingests reference after reference, the threads waiting for something else must
+    // not get stuck with one
+    for (size_t i = 0; i < runners; ++i) {
+      pool.spawn(*schedule.ingested, [this, &schedule](){
+        pool.wait(schedule.probed);
+        std::call_once(schedule.sorted, [&schedule](){
+          std::vector<size_t> index(schedule.order.size());
+          for (size_t i = 0; i < index.size(); ++i) {
+            index[i] = i;
+          }
+          std::stable_sort(index.begin(), index.end(), [&schedule](size_t a, size_t b){
+            return schedule.sizes[a] > schedule.sizes[b];
+          });
+          std::vector<size_t> order;
+          order.reserve(index.size());
+          for (const auto i : index) {
+            order.push_back(schedule.order[i]);
+          }
+          schedule.order.swap(order);
+        });
+        for (auto i = schedule.cursor++; i < schedule.order.size(); i = schedule.cursor++) {
+          try_fill_bucket(schedule.order[i]);
+        }
+      });
+    }
+  }
+
+  void join(schedule_t& schedule) {
+    pool.wait(*schedule.ingested);
+  }
+
+  /**
+   * Invokes the lambda with each index in [0, count), from no more runners than workers, which
+   * only idle workers run
+   */
+  template <typename Lambda>
+  void spread(size_t count, const Lambda& lambda) {
+    const auto runners = std::min(count, pool.size());
+    std::atomic<size_t> cursor = 0;
+    thread_pool::latch done(runners);
+    for (size_t i = 0; i < runners; ++i) {
+      pool.spawn(done, [&cursor, &lambda, count](){
+        for (auto i = cursor++; i < count; i = cursor++) {
+          lambda(i);
+        }
+      });
+    }
+    pool.wait(done);
+  }
+
   template <typename Container, typename Lambda>
   void loop(Container& container, const Lambda& lambda) {
-    pool.for_each(container, 1000, lambda);
+    pool.for_each(container, thread_pool::adaptive, lambda, token);
+  }
+
+  /// a pipeline on the pool, holding a couple of batches per worker at most
+  template <typename Item>
+  pipeline<Item> make_pipeline() {
+    return pipeline<Item>(pool, 2 * pool.size(), &token);
+  }
+
+  /**
+   * Spreads the content of the file over the NUMA nodes of the workers, normalize() and emit()
+   * split the lines among the nodes the same way.
+   * \param file the freshly fetched file
+   */
+  void place(artifact::basic_file<CharT>& file) {
+    if (pool.nodes() > 1) {
+      profile("placing " + file.name(), [&](){
+        file.place([this](auto& lines, const auto& lambda){
+          loop(lines, lambda);
+        });
+      });
+    }
+  }
+
+  /**
+   * Probes each line of the file against the bucket and emits the meaningful ones in order.
+   * The probe runs on the pool in batches, each one on the NUMA node holding its lines and
+   * collecting its own survivors, which are handed to the lambda as soon as all the preceding
+   * batches have been emitted.
+   * \param file the file to analyze
+   * \param lambda the lambda that will be invoked for each line emitted
+   * \param most the number of lines after which the rest of the file is left alone
+   */
+  template <typename Lambda>
+  void emit(const artifact::basic_file<CharT>& file, const Lambda& lambda, size_t most) {
+
+    if (0 == most) {
+      return;
+    }
+
+    const auto runs = (file.size() + batch_size - 1) / batch_size;
+
+    std::vector<std::vector<const artifact::basic_line<CharT>*>> survivors(runs);
+    // a group of one for each batch, as they are emitted in order
+    std::deque<thread_pool::latch> probed;
+
+    // set once the limit is reached, the jobs still queued have nothing left to do
+    std::atomic<bool> enough = false;
+    size_t emitted = 0;
+
+    const auto finish = [this, &probed](){
+      for (auto& group : probed) {
+        pool.wait(group);
+      }
+    };
+
+    for (size_t r = 0; r < runs; ++r) {
+      const auto node = pool.node_of(r * batch_size, file.size());
+      pool.submit(node, probed.emplace_back(1), [this, &file, &survivors, &enough, r](){
+        if (token.cancelled() or enough) {
+          return;
+        }
+        auto it = std::next(file.begin(), r * batch_size);
+        const auto last = (r == survivors.size() - 1) ? file.end() : std::next(it, batch_size);
+        for (; it != last; ++it) {
+          if (novel(it->hash())) {
+            survivors[r].push_back(&*it);
+          }
+        }
+      });
+    }
+
+    for (size_t r = 0; r < runs; ++r) {
+      pool.wait(probed[r]);
+      if (token.cancelled()) {
+        finish();
+        token.check();
+      }
+      for (const auto line : survivors[r]) {
+        lambda(*line);
+        // the answer is known, the batches still queued are not probed
+        if (++emitted == most) {
+          enough = true;
+          finish();
+          return;
+        }
+      }
+      survivors[r] = {};
+    }
   }
 
 #else
 
+  struct schedule_t {
+    explicit schedule_t(std::vector<size_t>&& refs) : order(std::move(refs)) {}
+    std::vector<size_t> order;
+    std::vector<std::future<void>> future;
+  };
+
+  void start(schedule_t& schedule) {
+    for (const auto r : schedule.order) {
+      schedule.future.emplace_back(std::async(std::launch::async, [this, r](){
+        try_fill_bucket(r);
+      }));
+    }
+  }
+
+  void join(schedule_t& schedule) {
+    for (auto& f : schedule.future) {
+      f.wait();
+    }
+  }
+
+  template <typename Lambda>
+  void spread(size_t count, const Lambda& lambda) {
+    for (size_t i = 0; i < count; ++i) {
+      lambda(i);
+    }
+  }
+
   template <typename Container, typename Lambda>
   void loop(Container& container, const Lambda& lambda) {
     for (auto& entry : container) {
@@ -129,35 +1069,84 @@ private:
     }
   }
 
-#endif
-
-  void filter(artifact::basic_file<CharT>& file, const patterns<CharT>& rules) {
-    loop(file, [&rules](auto& line){
-      for (const auto& pattern : rules.filters) {
-        line.suppress(pattern);
-      }
-    });
+  void place(artifact::basic_file<CharT>&) {
   }
 
-  void normalize(artifact::basic_file<CharT>& file, const patterns<CharT>& rules) {
-    loop(file, [&rules](auto& line){
-      for (const auto& pattern : rules.normalizers) {
-        line.remove(pattern);
+  /// runs the stages inline, one item at a time
+  template <typename Item>
+  class inline_pipeline {
+  public:
+    enum mode_t { serial, parallel };
+    template <typename Func>
+    inline_pipeline& stage(mode_t, Func&& func) {
+      stages.emplace_back(std::forward<Func>(func));
+      return *this;
+    }
+    template <typename Fill>
+    void push(const Fill& fill) {
+      token.check();
+      fill(item);
+      for (const auto& stage : stages) {
+        stage(item);
       }
-    });
+    }
+    void finish() {
+    }
+    explicit inline_pipeline(const cancellation& token) : token(token) {}
+  private:
+    const cancellation& token;
+    Item item;
+    std::vector<std::function<void(Item&)>> stages;
+  };
+
+  template <typename Item>
+  inline_pipeline<Item> make_pipeline() {
+    return inline_pipeline<Item>(token);
   }
 
-  void compute_hashes(artifact::basic_file<CharT>& file) {
+  template <typename Lambda>
+  void emit(const artifact::basic_file<CharT>& file, const Lambda& lambda, size_t most) {
+    size_t emitted = 0;
     for (const auto& line : file) {
-      line.hash(); // here I'm spoiling the hash caching of artifact::basic_line
+      if (emitted == most) {
+        return;
+      }
+      if (novel(line.hash())) {
+        lambda(line);
+        ++emitted;
+      }
     }
   }
 
+#endif
+
   const configuration<CharT>& config;
-  std::unordered_set<size_t> bucket;
+  corpus bucket;
+  // the cache of the remote references, if configured
+  std::unique_ptr<artifact::cache> store;
+  struct survivor {
+    size_t hits; // the number of references the line occurred in so far
+  };
+  // the distinct hashes of the target that are still candidates for the output
+  std::unordered_map<size_t, survivor> survivors;
+  // the distinct hashes of the references completed before the target was ready, by reference
+  std::vector<std::vector<corpus::hash_t>> deferred;
+  std::atomic<bool> target_ready = false;
+  // the references are ingested into the bucket once, for all the targets of a batch
+  bool shared = false;
+  // the bucket of the references ingested by another run, if any
+  const corpus* ingested = nullptr;
+  // the distinct hashes of the references ingested in this run, by reference
+  std::vector<std::pair<size_t, std::vector<corpus::hash_t>>> fresh;
   std::mutex mutex;
+  // cancelled by the first failure, or once the timeout expires
+  cancellation token;
+  std::chrono::milliseconds timeout{0};
+  // the maximum number of lines emitted by a run
+  size_t limit = std::numeric_limits<size_t>::max();
   curlpp::Cleanup curlpp_;
 #if USE_THREAD_POOL
-  thread_pool pool;
+  std::unique_ptr<thread_pool> own_pool = std::make_unique<thread_pool>();
+  thread_pool& pool = *own_pool;
 #endif
 };
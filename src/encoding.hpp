@@ -2,6 +2,7 @@
 
 #include <istream>
 #include <queue>
+#include <vector>
 
 #include "bit.hpp"
 #include "logging.hpp"
@@ -157,6 +158,67 @@ using basic_encoder = result_t (*)(feeder& ifs, T& out);
 using encoder = basic_encoder<char>;
 using wencoder = basic_encoder<wchar_t>;
 
+/**
+ * \brief Decodes bytes that come in chunks of any size: the bytes of a character split between
+ * two chunks are kept until the next chunk completes it. Invalid sequences are dropped.
+*/
+template <typename CharT>
+class chunk_decoder final {
+public:
+
+  explicit chunk_decoder(basic_encoder<CharT> decode) : decode(decode), invalid(0) {}
+
+  /**
+   * decodes a chunk
+   * \param data the bytes of the chunk
+   * \param size the number of bytes
+   * \param out where the characters decoded are appended
+  */
+  void feed(const char* data, size_t size, std::vector<CharT>& out) {
+    for (size_t i = 0; i < size; ++i) {
+      const auto byte = static_cast<unsigned char>(data[i]);
+      if (byte < 0x80 and 0 == pending.size()) {
+        out.push_back(CharT(byte));
+        continue;
+      }
+      pending.push(byte);
+      CharT c;
+      switch (decode(pending, c)) {
+        case ok:
+          out.push_back(c);
+          break;
+        case error:
+          // the sequence is cut short by this byte, which may be a character on its own
+          ++invalid;
+          pending = buffered_feeder();
+          if (byte < 0x80) {
+            out.push_back(CharT(byte));
+          }
+          break;
+        default:
+          break; // incomplete, the next chunk will tell
+      }
+    }
+  }
+
+  /// the number of invalid sequences dropped so far
+  size_t errors() const {
+    return invalid;
+  }
+
+  /**
+   * drops the bytes of an incomplete character, if any
+  */
+  void reset() {
+    pending = buffered_feeder();
+  }
+
+private:
+  basic_encoder<CharT> decode;
+  buffered_feeder pending;
+  size_t invalid;
+};
+
 static constexpr bool icase_comp(int a, int b){
   return (a == b) or (std::isalpha(a) and std::isalpha(b) and std::tolower(a) == std::tolower(b));
 }
@@ -0,0 +1,137 @@
+#include "follower.hpp"
+#include "artifact-fetcher.hpp"
+#include "logging.hpp"
+
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+static std::string local_path_of(const std::string& url) {
+  if (artifact::local != artifact::source_of(url)) {
+    throw std::runtime_error("only local targets can be followed: " + url);
+  }
+  if (artifact::range_t::of(url).partial()) {
+    throw std::runtime_error("a part of a target cannot be followed: " + url);
+  }
+  return artifact::remove_protocol(url);
+}
+
+follower::follower(const std::string& url)
+  : path(local_path_of(url)), fd(-1), watch(-1), wakeup{-1, -1}, offset(0), truncated(false),
+    stopped(false) {
+
+  fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error("cannot open " + path + ": " + strerror(errno));
+  }
+
+  watch = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watch < 0 or
+      inotify_add_watch(watch, path.c_str(), IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF) < 0 or
+      0 != pipe2(wakeup, O_NONBLOCK | O_CLOEXEC)) {
+    const auto reason = std::string("cannot watch ") + path + ": " + strerror(errno);
+    for (const int f : {fd, watch, wakeup[0], wakeup[1]}) {
+      if (f >= 0) {
+        close(f);
+      }
+    }
+    throw std::runtime_error(reason);
+  }
+}
+
+follower::~follower() {
+  for (const int f : {fd, watch, wakeup[0], wakeup[1]}) {
+    if (f >= 0) {
+      close(f);
+    }
+  }
+}
+
+size_t follower::read(char* buffer, size_t size) {
+
+  for (;;) {
+
+    const ssize_t done = pread(fd, buffer, size, offset);
+
+    if (done > 0) {
+      offset += done;
+      return size_t(done);
+    }
+
+    if (done < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      throw std::runtime_error("cannot read " + path + ": " + strerror(errno));
+    }
+
+    // nothing new, unless the file shrank
+    struct stat info;
+    if (0 == fstat(fd, &info) and info.st_size < offset) {
+      log_warning << path << " was truncated, reading it again from the beginning";
+      offset = 0;
+      truncated = true;
+    }
+    return 0;
+  }
+}
+
+bool follower::rewound() {
+  const bool result = truncated;
+  truncated = false;
+  return result;
+}
+
+bool follower::wait(const cancellation& token) {
+
+  while (not stopped and not token.cancelled()) {
+
+    pollfd fds[] = {{watch, POLLIN, 0}, {wakeup[0], POLLIN, 0}};
+    const int ready = poll(fds, 2, poll_interval);
+
+    if (ready < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      throw std::runtime_error(std::string("cannot wait for ") + path + ": " + strerror(errno));
+    }
+
+    if (fds[1].revents or stopped) {
+      return false;
+    }
+
+    // the events themselves do not matter, only that the file has to be looked at again
+    if (fds[0].revents) {
+      alignas(inotify_event) char events[4096];
+      while (::read(watch, events, sizeof(events)) > 0) {
+      }
+    }
+
+    struct stat info;
+    if (0 != fstat(fd, &info)) {
+      throw std::runtime_error(std::string("cannot stat ") + path + ": " + strerror(errno));
+    }
+
+    if (info.st_size != offset) {
+      return true;
+    }
+
+    if (0 == info.st_nlink) {
+      log_info << path << " was removed, not following it anymore";
+      return false;
+    }
+  }
+
+  return false;
+}
+
+void follower::stop() {
+  stopped = true;
+  const char c = 0;
+  [[maybe_unused]] const auto ignored = write(wakeup[1], &c, 1);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "cancellation.hpp"
+
+#include <string>
+#include <atomic>
+#include <cstddef>
+#include <sys/types.h>
+
+/**
+ * \brief Tails a local file that is still being written, as `tail -f` does: the file is read
+ * from the beginning, then each time it grows only the bytes appended to it are read. The
+ * changes are notified by inotify, the file is checked periodically anyway in case a notification
+ * is missed (on network file systems, for instance). A file truncated in place is read again
+ * from the beginning.
+*/
+class follower final {
+public:
+
+  /**
+   * c'tor, opens the file and starts watching it
+   * \param url the url of the file, only local files can be followed
+   * \throw std::runtime_error if the file cannot be opened or watched
+  */
+  explicit follower(const std::string& url);
+
+  /**
+   * d'tor
+  */
+  ~follower();
+
+  /**
+   * reads what was appended since the last read, without waiting
+   * \param buffer where to store the bytes read
+   * \param size the size of the buffer
+   * \return the number of bytes read, 0 if there is nothing new
+   * \throw std::runtime_error if the file cannot be read
+  */
+  size_t read(char* buffer, size_t size);
+
+  /**
+   * tells, once, that the file was truncated: the reads start over from its beginning
+  */
+  bool rewound();
+
+  /**
+   * waits for the file to change
+   * \param token gives up waiting once cancelled
+   * \return false once stopped or cancelled, or once the file was removed and read to its end
+  */
+  bool wait(const cancellation& token);
+
+  /**
+   * makes wait() return false, can be invoked from a signal handler
+  */
+  void stop();
+
+private:
+
+  follower(const follower&) = delete;
+  follower& operator = (const follower&) = delete;
+
+  // how long to wait for a notification before looking at the file anyway, in milliseconds
+  static constexpr int poll_interval = 250;
+
+  const std::string path;
+  int fd;
+  int watch;
+  int wakeup[2]; // the pipe written by stop()
+  off_t offset;
+  bool truncated;
+  std::atomic<bool> stopped;
+};
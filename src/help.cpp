@@ -10,9 +10,24 @@ nl "OPTIONS:"
 nl "  -c, --config    read the configuration from the given filename instead from stdin"
 nl "  -d, --directory change the working directory to the given path"
 nl "  -n, --no-lines  do not output line numbers in the output"
+nl "  -u, --collapse  output each distinct line once, with the number of its occurrences"
+nl "  -M, --max-lines output no more than the given number of lines"
+nl "  -f, --first-match output the first meaningful line only"
+nl "  -q, --quiet     output nothing, exit with 0 if there are meaningful lines, 1 if not, 2 on errors"
+nl "  -F, --follow    keep reading the target as it grows, as tail -f does, until interrupted"
+nl "  -T, --timeout   give up after the given number of seconds"
+nl "  -S, --serve     serve requests on the given Unix socket, keeping the references warm"
+nl "  -C, --connect   send the configuration to the server listening on the given Unix socket"
+nl "  -i, --input     with --connect, send the given file as the target"
 nl "  -j, --jobs      use the given number of threads, defaults to the number of hw threads"
+nl "  -b, --batch     process the lines in batches of the given size, sized adaptively by default"
+nl "  -a, --pin       pin each thread to a cpu"
+nl "  -m, --numa      pin the threads and split the work and the memory by NUMA node"
+nl "  -s, --stats     write the statistics of the thread pool to the given file, as JSON"
 nl "  -v, --verbose   print information regarding the process to stderr"
 nl "  -p, --profile   print profiling information to stderr"
+nl "  -P, --trace     write the profiled sections to the given file, as a Chrome trace"
+nl "  -k, --counters  like --profile, with the hardware counters of each stage and thread"
 nl "  -g, --debug     print even more information to stderr"
 #if WITH_TESTS
 nl "  -t, --test      executes the unit tests"
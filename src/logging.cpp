@@ -1,74 +1,334 @@
 #include "logging.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <cstring>
 #include <ctime>
 #include <unistd.h>
 #include <sys/syscall.h>
-#include <sys/time.h>
 
 namespace log {
 
-static level_t log_level = error;
+namespace {
 
-void enable(level_t lvl) {
-  log_level |= lvl;
-}
+// a line as queued, followed by its message
+struct record_t {
+  int64_t time;
+  const char* file;
+  const char* func;
+  level_t level;
+  tid_t tid;
+  int number;
+  uint32_t size;
+};
 
-void disable(level_t lvl) {
-  log_level &= ~lvl;
+constexpr size_t aligned(size_t size) {
+  return (size + 7) & ~size_t(7);
 }
 
-bool has(level_t lvl) {
-  return log_level & lvl;
+/**
+ * The lines queued by a thread: it is the only one adding to them, and the one writing the
+ * lines (holding the mutex) the only one taking them, so neither needs a lock.
+*/
+class ring_t {
+public:
+  static constexpr size_t capacity = 64 << 10;
+
+  /// \return false if there is no room left for the line
+  bool push(const record_t& record, const char* text) {
+    const size_t need = sizeof(record) + aligned(record.size);
+    const size_t tail = back.load(std::memory_order_relaxed);
+    if (capacity - (tail - front.load(std::memory_order_acquire)) < need) {
+      return false;
+    }
+    copy_in(tail, &record, sizeof(record));
+    copy_in(tail + sizeof(record), text, record.size);
+    back.store(tail + need, std::memory_order_release);
+    return true;
+  }
+
+  template <typename Lambda>
+  void drain(std::string& text, const Lambda& lambda) {
+    size_t head = front.load(std::memory_order_relaxed);
+    const size_t tail = back.load(std::memory_order_acquire);
+    while (head != tail) {
+      record_t record;
+      copy_out(head, &record, sizeof(record));
+      text.resize(record.size);
+      copy_out(head + sizeof(record), text.data(), record.size);
+      lambda(record, text);
+      head += sizeof(record) + aligned(record.size);
+    }
+    front.store(head, std::memory_order_release);
+  }
+
+  bool empty() const {
+    return front.load(std::memory_order_acquire) == back.load(std::memory_order_acquire);
+  }
+
+  // set once the thread is gone, after writing its last lines
+  std::atomic<bool> dead = false;
+
+private:
+  void copy_in(size_t at, const void* src, size_t count) {
+    const size_t offset = at % capacity;
+    const size_t first = std::min(count, capacity - offset);
+    memcpy(data + offset, src, first);
+    memcpy(data, static_cast<const char*>(src) + first, count - first);
+  }
+
+  void copy_out(size_t at, void* dst, size_t count) const {
+    const size_t offset = at % capacity;
+    const size_t first = std::min(count, capacity - offset);
+    memcpy(dst, data + offset, first);
+    memcpy(static_cast<char*>(dst) + first, data, count - first);
+  }
+
+  // the bytes ever taken and ever added
+  std::atomic<size_t> front = 0;
+  std::atomic<size_t> back = 0;
+  char data[capacity];
+};
+
+struct state_t {
+  // held while writing the lines
+  std::mutex mutex;
+  std::vector<std::shared_ptr<ring_t>> rings;
+  std::condition_variable wake;
+  bool stopping = false;
+  std::thread flusher;
+  std::once_flag started;
+  // once the flusher is gone, the lines are written at once
+  std::atomic<bool> stopped = false;
+  // the formatted lines, and where each one is
+  std::string formatted;
+  std::vector<std::pair<int64_t, std::pair<size_t, size_t>>> lines;
+  std::string out;
+  std::string text;
+  // the local time of the last second formatted
+  time_t second = -1;
+  char clock[16] = "";
+};
+
+// never destroyed, as lines can be logged up to the very end
+state_t& state() {
+  static state_t* const s = new state_t;
+  return *s;
 }
 
-const char* log_gettime() {
-  static thread_local char temp[128] = "";
-  struct timeval tv;
-  struct tm tm;
-  gettimeofday(&tv, nullptr);
-  localtime_r(&tv.tv_sec, &tm);
-  snprintf(
-    temp,
-    sizeof(temp),
-    "%02d:%02d:%02d.%03ld",
-    tm.tm_hour,
-    tm.tm_min,
-    tm.tm_sec,
-    tv.tv_usec / 1000
-  );
-  return temp;
+tid_t current_tid() {
+  static thread_local const tid_t tid = tid_t(syscall(SYS_gettid));
+  return tid;
 }
 
-tid_t log_gettid() {
-  return tid_t(syscall(SYS_gettid));
+void write_all(const std::string& str) {
+  for (size_t done = 0; done < str.size(); ) {
+    const ssize_t written = ::write(STDERR_FILENO, str.data() + done, str.size() - done);
+    if (written < 0 and EINTR == errno) {
+      continue;
+    }
+    if (written <= 0) {
+      return; // nowhere else to tell
+    }
+    done += written;
+  }
 }
 
-line::line(const char* file,
-                  int line,
-                  const char* func,
-                  std::ostream& os,
-                  level_t lvl)
-    : os(os) {
+// the caller must hold the mutex
+void format(state_t& s, std::string& out, const record_t& record, const std::string& text) {
+
   const char* prefix =
-      lvl == log::error    ? "[ERROR]" :
-      lvl == log::warning  ? "[WARN.]" :
-      lvl == log::info     ? "[INFO.]" :
-      lvl == log::profile  ? "[PROF.]" :
-      lvl == log::debug    ? "[DEBUG]" : "[?????]";
+      record.level == log::error    ? "[ERROR]" :
+      record.level == log::warning  ? "[WARN.]" :
+      record.level == log::info     ? "[INFO.]" :
+      record.level == log::profile  ? "[PROF.]" :
+      record.level == log::debug    ? "[DEBUG]" : "[?????]";
+
+  const time_t second = time_t(record.time / 1000000000);
+  if (second != s.second) {
+    struct tm tm;
+    localtime_r(&second, &tm);
+    snprintf(s.clock, sizeof(s.clock), "%02d:%02d:%02d", tm.tm_hour, tm.tm_min, tm.tm_sec);
+    s.second = second;
+  }
+  char millis[8];
+  snprintf(millis, sizeof(millis), ".%03d", int(record.time / 1000000 % 1000));
+
+  out += prefix;
+  out += " T";
+  out += std::to_string(record.tid);
+  if (record.level == log::debug) {
+    out += " @";
+    out += record.file;
+    out += ':';
+    out += std::to_string(record.number);
+    out += ' ';
+    out += record.func;
+  }
+  out += ' ';
+  out += s.clock;
+  out += millis;
+  out += " | ";
+  out += text;
+  out += '\n';
+}
+
+// writes the lines of all the threads in order of time, the caller must hold the mutex
+void drain(state_t& s) {
+
+  s.formatted.clear();
+  s.lines.clear();
+  for (const auto& ring : s.rings) {
+    ring->drain(s.text, [&s](const record_t& record, const std::string& text){
+      const size_t begin = s.formatted.size();
+      format(s, s.formatted, record, text);
+      s.lines.push_back({record.time, {begin, s.formatted.size()}});
+    });
+  }
+
+  s.rings.erase(std::remove_if(s.rings.begin(), s.rings.end(), [](const auto& ring){
+    return ring->dead and ring->empty();
+  }), s.rings.end());
+
+  if (s.lines.empty()) {
+    return;
+  }
+
+  std::stable_sort(s.lines.begin(), s.lines.end(), [](const auto& a, const auto& b){
+    return a.first < b.first;
+  });
+  s.out.clear();
+  for (const auto& line : s.lines) {
+    s.out.append(s.formatted, line.second.first, line.second.second - line.second.first);
+  }
+  write_all(s.out);
+}
+
+void run(state_t& s) {
+  std::unique_lock<std::mutex> lock(s.mutex);
+  while (not s.stopping) {
+    s.wake.wait_for(lock, std::chrono::milliseconds(20));
+    drain(s);
+  }
+}
+
+// the lines of the thread, its last ones are written as it exits
+struct holder_t {
+  std::shared_ptr<ring_t> ring;
+  ~holder_t() {
+    if (ring) {
+      flush();
+      ring->dead = true;
+    }
+  }
+};
+
+ring_t& local_ring() {
+  static thread_local holder_t holder;
+  if (not holder.ring) {
+    auto& s = state();
+    holder.ring = std::make_shared<ring_t>();
+    {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      s.rings.push_back(holder.ring);
+    }
+    std::call_once(s.started, [&s](){
+      s.flusher = std::thread(run, std::ref(s));
+    });
+  }
+  return *holder.ring;
+}
+
+void submit(const record_t& record, const char* text) {
+
+  auto& s = state();
+
+  if (not s.stopped) {
+    auto& ring = local_ring();
+    if (ring.push(record, text) or (flush(), ring.push(record, text))) {
+      if (error == record.level) {
+        flush();
+      }
+      return;
+    }
+  }
+
+  // too long for the buffer, or too late for the flusher
+  std::lock_guard<std::mutex> lock(s.mutex);
+  drain(s);
+  s.out.clear();
+  format(s, s.out, record, std::string(text, record.size));
+  write_all(s.out);
+}
 
-  if (lvl == log::debug) {
-    ss << prefix << " T" << log_gettid()
-       << " @" << file << ":" << line
-       << " " << func
-       << " " << log_gettime() << " | ";
-  } else {
-    ss << prefix << " T" << log_gettid() << " " << log_gettime() << " | ";
+// stops the flusher at exit, writing what is left
+struct stopper_t {
+  ~stopper_t() {
+    auto& s = state();
+    {
+      std::lock_guard<std::mutex> lock(s.mutex);
+      s.stopping = true;
+    }
+    s.wake.notify_all();
+    if (s.flusher.joinable()) {
+      s.flusher.join();
+    }
+    s.stopped = true;
+    flush();
   }
+} stopper;
+
+}
+
+void enable(level_t lvl) {
+  levels |= lvl;
+}
+
+void disable(level_t lvl) {
+  levels &= ~lvl;
+}
+
+void flush() {
+  auto& s = state();
+  std::lock_guard<std::mutex> lock(s.mutex);
+  drain(s);
+}
+
+line::line(const char* file,
+           int line,
+           const char* func,
+           level_t lvl)
+    : file(file), number(line), func(func), level(lvl), size(0) {
+  timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  time = int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
 }
 
 line::~line() {
-  ss << std::endl;
-  os << ss.str();
+  const bool spilled = not spill.empty();
+  const record_t record = {
+    time, file, func, level, current_tid(), number,
+    uint32_t(spilled ? spill.size() : size)
+  };
+  submit(record, spilled ? spill.data() : text);
+}
+
+void line::put(const char* str, size_t count) {
+  if (spill.empty() and size + count <= sizeof(text)) {
+    memcpy(text + size, str, count);
+    size += count;
+    return;
+  }
+  if (spill.empty()) {
+    spill.assign(text, size);
+  }
+  spill.append(str, count);
 }
 
 } // log
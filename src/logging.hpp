@@ -2,6 +2,15 @@
 
 #include <iostream>
 #include <sstream>
+#include <atomic>
+#include <charconv>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <sys/types.h>
 
 namespace log {
 
@@ -14,6 +23,9 @@ namespace log {
   static constexpr level_t profile  = 0x8;
   static constexpr level_t debug    = 0x10;
 
+  // the levels enabled, errors only by default
+  inline std::atomic<level_t> levels = error;
+
   void enable(level_t lvl);
   void disable(level_t lvl);
 
@@ -29,15 +41,50 @@ namespace log {
     disable(tail...);
   }
 
-  bool has(level_t lvl);
+  static inline bool has(level_t lvl) {
+    return levels.load(std::memory_order_relaxed) & lvl;
+  }
+
+  /**
+   * Writes the lines logged so far by every thread, before returning. The lines are otherwise
+   * written by a background thread, every few milliseconds, but errors are written at once.
+  */
+  void flush();
 
+  /**
+   * A line being logged to the standard error: the message is formatted by the calling thread
+   * into a buffer of the line, which is queued as it is into a buffer of the thread once
+   * complete. The rest (the time, the thread, the location) is formatted by the thread writing
+   * the lines.
+  */
   class line final {
   public:
-    line(const char* file, int line, const char* func, std::ostream& os, level_t lvl);
+    line(const char* file, int line, const char* func, level_t lvl);
     ~line();
     template <typename T>
     inline line& operator << (const T& t) {
-      return ss << t, *this;
+      if constexpr (std::is_same<T, bool>::value) {
+        put(t ? "1" : "0", 1);
+      } else if constexpr (std::is_same<T, char>::value or std::is_same<T, signed char>::value or
+                           std::is_same<T, unsigned char>::value) {
+        const char c = char(t);
+        put(&c, 1);
+      } else if constexpr (std::is_integral<T>::value) {
+        char str[24];
+        put(str, std::to_chars(str, str + sizeof(str), t).ptr - str);
+      } else if constexpr (std::is_floating_point<T>::value) {
+        char str[32];
+        put(str, size_t(snprintf(str, sizeof(str), "%g", double(t))));
+      } else if constexpr (std::is_convertible<const T&, std::string_view>::value) {
+        const std::string_view sw(t);
+        put(sw.data(), sw.size());
+      } else {
+        std::ostringstream ss;
+        ss << t;
+        const auto str = ss.str();
+        put(str.data(), str.size());
+      }
+      return *this;
     }
     template <typename T>
     inline line& operator () (const T& t) {
@@ -52,12 +99,21 @@ namespace log {
     line(line&&) = delete;
     line& operator = (const line&) = delete;
     line& operator = (line&&) = delete;
-    std::stringstream ss;
-    std::ostream& os;
+    void put(const char* str, size_t count);
+    const char* file;
+    const int number;
+    const char* func;
+    const level_t level;
+    // CLOCK_REALTIME, in ns
+    int64_t time;
+    // most messages fit, the longer ones spill over
+    char text[240];
+    size_t size;
+    std::string spill;
   };
 } // log
 
-#define log_cond(x) if (!log::has(x)); else log::line(__FILE__, __LINE__, __FUNCTION__, std::cerr, x)
+#define log_cond(x) if (!log::has(x)); else log::line(__FILE__, __LINE__, __FUNCTION__, x)
 #define log_error    log_cond(log::error)
 #define log_warning  log_cond(log::warning)
 #define log_info     log_cond(log::info)
@@ -67,6 +123,7 @@ namespace log {
 #define enforce(x, ...) do { \
   if (not (x)) { \
     log_error << "assertion error: " #x ", " << __VA_ARGS__; \
+    log::flush(); \
     abort(); \
   } \
 } while(false)
@@ -1,17 +1,52 @@
 #include <iostream>
 #include <iomanip>
+#include <fstream>
+#include <memory>
 #include <unistd.h>
 #include <cstdlib>
+#include <chrono>
+#include <csignal>
+#include <atomic>
 #include "artifact.hpp"
 #include "profile.hpp"
 #include "arguments.hpp"
 #include "denoiser.hpp"
 #include "config.hpp"
 #include "help.hpp"
+#include "output.hpp"
+#include "server.hpp"
+#include "follower.hpp"
 #ifdef WITH_TESTS
 #  include "test/test.hpp"
 #endif
 
+// the server running, or the target followed, if any, stopped by SIGINT and SIGTERM
+static server* serving = nullptr;
+static follower* following = nullptr;
+
+static void on_signal(int) {
+  if (serving) {
+    serving->stop();
+  }
+  if (following) {
+    following->stop();
+  }
+}
+
+// logs the summary of the profiled sections, and writes them to the trace file if any
+static void report_profile(const std::string& trace_file) {
+  profiling::summary();
+  if (trace_file.empty()) {
+    return;
+  }
+  std::ofstream os(trace_file);
+  profiling::trace(os);
+  os << std::endl;
+  if (not os) {
+    throw std::runtime_error("cannot write " + trace_file);
+  }
+}
+
 int main(int argc, char** argv) {
   const arguments args(argc, argv);
 
@@ -32,7 +67,44 @@ int main(int argc, char** argv) {
     log::enable(log::profile);
   }
 
+  // reported next to the timings
+  if (args.have_flag("--counters", "-k")) {
+    log::enable(log::profile);
+    profiling::enable_counters();
+  }
+
+  // the profiled sections are recorded only to be summarized or traced
+  const std::string trace_file(args.value("--trace", "-P"));
+  profiling::enable(log::has(log::profile) or not trace_file.empty());
+
   const bool show_lines = not args.have_flag("--no-lines", "-n");
+  const bool collapse = args.have_flag("--collapse", "-u");
+
+  // only tells, via the exit code, if there are meaningful lines
+  const bool quiet = args.have_flag("--quiet", "-q");
+
+  size_t limit = 0;
+  if (args.have_flag("--max-lines", "-M")) {
+    limit = args.value<size_t>("--max-lines", "-M");
+    if (0 == limit) {
+      std::cerr << "invalid value for the --max-lines option" << std::endl;
+      print_help(argv[0], std::cerr);
+      return 1;
+    }
+  }
+  if (quiet or args.have_flag("--first-match", "-f")) {
+    limit = 1;
+  }
+
+  double timeout = 0;
+  if (args.have_flag("--timeout", "-T")) {
+    timeout = args.value<double>("--timeout", "-T");
+    if (timeout <= 0) {
+      std::cerr << "invalid value for the --timeout option" << std::endl;
+      print_help(argv[0], std::cerr);
+      return 1;
+    }
+  }
 
 #ifdef WITH_THREAD_POOL
   if (args.have_flag("--jobs", "-j")) {
@@ -44,6 +116,25 @@ int main(int argc, char** argv) {
     }
     thread_pool::set_max_threads(count);
   }
+
+  if (args.have_flag("--batch", "-b")) {
+    const auto size = args.value<size_t>("--batch", "-b");
+    if (0 == size) {
+      std::cerr << "invalid value for the --batch option" << std::endl;
+      print_help(argv[0], std::cerr);
+      return 1;
+    }
+    thread_pool::set_batch_size(size);
+  }
+
+  const std::string stats_file(args.value("--stats", "-s"));
+  thread_pool::set_instrumented(log::has(log::profile) or not stats_file.empty());
+
+  if (args.have_flag("--numa", "-m")) {
+    thread_pool::set_placement(thread_pool::numa);
+  } else if (args.have_flag("--pin", "-a")) {
+    thread_pool::set_placement(thread_pool::pinned);
+  }
 #endif
 
   if (args.have_flag("--directory", "-d")) {
@@ -67,22 +158,185 @@ int main(int argc, char** argv) {
 
     const auto config_file = args.value("--config", "-c");
 
+    struct sigaction action = {};
+    action.sa_handler = on_signal; // no SA_RESTART, accept() must be interrupted
+
+    if (args.have_flag("--serve", "-S")) {
+      {
+        server daemon{std::string(args.value("--serve", "-S"))};
+        if (timeout > 0) {
+          daemon.set_timeout(std::chrono::milliseconds(static_cast<long long>(timeout * 1000)));
+        }
+        serving = &daemon;
+        sigaction(SIGINT, &action, nullptr);
+        sigaction(SIGTERM, &action, nullptr);
+        daemon.run();
+        serving = nullptr;
+      }
+      // once the requests in progress are done, their threads and the workers are gone
+      report_profile(trace_file);
+      return 0;
+    }
+
+    if (args.have_flag("--connect", "-C")) {
+      const auto read = [](std::istream& is){
+        return std::string(std::istreambuf_iterator<char>(is), std::istreambuf_iterator<char>());
+      };
+      std::ifstream config_stream;
+      if (not config_file.empty()) {
+        config_stream.open(std::string(config_file));
+        if (not config_stream) {
+          throw std::runtime_error("cannot read " + std::string(config_file));
+        }
+      }
+      const auto yaml = read(config_file.empty() ? std::cin : config_stream);
+      std::string body;
+      if (args.have_flag("--input", "-i")) {
+        const std::string input(args.value("--input", "-i"));
+        std::ifstream input_stream(input, std::ios::binary);
+        if (not input_stream) {
+          throw std::runtime_error("cannot read " + input);
+        }
+        body = read(input_stream);
+      }
+      std::string options = show_lines ? "" : "no-lines";
+      if (collapse) {
+        options += options.empty() ? "collapse" : " collapse";
+      }
+      if (limit) {
+        options += (options.empty() ? "max-lines=" : " max-lines=") + std::to_string(limit);
+      }
+      const auto lines = server::request(std::string(args.value("--connect", "-C")), yaml, body,
+                                         options, quiet ? -1 : STDOUT_FILENO);
+      if (quiet) {
+        return lines ? 0 : 1;
+      }
+      return 0;
+    }
+
     const auto config = config_file.empty()
       ? configuration<char_t>::read(std::cin)
       : configuration<char_t>::load(std::string(config_file));
 
     denoiser<char_t> denoiser(config);
 
-    denoiser.run([show_lines](const artifact::wline& line){
-      if (show_lines) {
-        std::wcout << line.number() << " " << line.str() << std::endl;
+    if (timeout > 0) {
+      denoiser.set_timeout(std::chrono::milliseconds(static_cast<long long>(timeout * 1000)));
+    }
+
+    if (limit) {
+      denoiser.set_limit(limit);
+    }
+
+    std::atomic<size_t> emitted = 0;
+
+    const auto print = [show_lines, quiet, &emitted](output_writer& out,
+                                                     const artifact::wline& line){
+      ++emitted;
+      if (not quiet) {
+        out.line(show_lines ? line.number() : 0, line.str());
+      }
+    };
+
+    const auto print_collapsed = [show_lines, quiet, &emitted](output_writer& out,
+                                                               const artifact::wline& line,
+                                                               size_t count){
+      ++emitted;
+      if (not quiet) {
+        out.line(show_lines ? line.number() : 0, line.str(), count);
+      }
+    };
+
+    if (args.have_flag("--follow", "-F")) {
+
+      if (collapse or not config.targets.empty()) {
+        throw std::runtime_error("--follow works with a single target, and cannot collapse it");
+      }
+
+      follower target(config.target);
+      following = &target;
+      sigaction(SIGINT, &action, nullptr);
+      sigaction(SIGTERM, &action, nullptr);
+
+      // each line is written as soon as it is found
+      output_writer out(STDOUT_FILENO);
+
+      denoiser.follow(target, [&](const artifact::wline& line){
+        print(out, line);
+      }, [&out](){
+        out.flush();
+      });
+
+      following = nullptr;
+
+    } else if (not config.targets.empty()) {
+
+      // the targets run in parallel already, no need for writer threads
+      std::vector<std::unique_ptr<output_writer>> outputs;
+      for (const auto& target : config.targets) {
+        outputs.push_back(quiet
+          ? std::make_unique<output_writer>(-1) // never written to
+          : std::make_unique<output_writer>(target.output));
+      }
+
+      if (collapse) {
+        denoiser.run_batch_collapsed([&](size_t t, const artifact::wline& line, size_t count){
+          print_collapsed(*outputs[t], line, count);
+        });
+      } else {
+        denoiser.run_batch([&](size_t t, const artifact::wline& line){
+          print(*outputs[t], line);
+        });
+      }
+
+      for (auto& out : outputs) {
+        out->flush();
+      }
+
+    } else {
+
+#ifdef WITH_THREAD_POOL
+      output_writer out(STDOUT_FILENO, true);
+#else
+      output_writer out(STDOUT_FILENO);
+#endif
+
+      if (collapse) {
+        denoiser.run_collapsed([&](const artifact::wline& line, size_t count){
+          print_collapsed(out, line, count);
+        });
       } else {
-        std::wcout << line.str() << std::endl;
+        denoiser.run([&](const artifact::wline& line){
+          print(out, line);
+        });
       }
-    });
+
+      out.flush();
+    }
+
+#ifdef WITH_THREAD_POOL
+    const auto stats = denoiser.stats();
+    stats.log();
+    if (not stats_file.empty()) {
+      std::ofstream os(stats_file);
+      stats.json(os);
+      os << std::endl;
+      if (not os) {
+        throw std::runtime_error("cannot write " + stats_file);
+      }
+    }
+#endif
+
+    report_profile(trace_file);
+
+    if (quiet) {
+      return emitted ? 0 : 1;
+    }
 
   } catch (const std::exception& ex) {
+    log::flush();
     std::cerr << "exception got: " << ex.what() << std::endl;
+    return quiet ? 2 : 1;
   }
   return 0;
 }
@@ -0,0 +1,243 @@
+#include "output.hpp"
+#include "logging.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <climits>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+output_writer::output_writer(int fd, bool threaded)
+  : fd(fd), owned(false), used(0), writing(false), stop(false) {
+  current.data = std::make_unique<char[]>(size);
+  if (threaded) {
+    writer = std::thread([this](){ run(); });
+  }
+}
+
+static int create(const std::string& filename) {
+  const int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("cannot create " + filename + ": " + strerror(errno));
+  }
+  return fd;
+}
+
+output_writer::output_writer(const std::string& filename, bool threaded)
+  : fd(create(filename)), owned(true), used(0), writing(false), stop(false) {
+  current.data = std::make_unique<char[]>(size);
+  if (threaded) {
+    writer = std::thread([this](){ run(); });
+  }
+}
+
+output_writer::~output_writer() {
+
+  bool failed;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    failed = not error.empty();
+  }
+
+  // a failure already thrown is not reported twice
+  if (not failed) {
+    try {
+      flush();
+    } catch (const std::exception& ex) {
+      log_error << ex.what();
+    }
+  }
+
+  if (writer.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+      cond.notify_all();
+    }
+    writer.join();
+  }
+
+  if (owned) {
+    close(fd);
+  }
+}
+
+void output_writer::encode(const char* str, size_t length) {
+  while (length) {
+    if (used == size) {
+      ship();
+    }
+    const size_t chunk = std::min(length, size - used);
+    memcpy(current.data.get() + used, str, chunk);
+    used += chunk;
+    str += chunk;
+    length -= chunk;
+  }
+}
+
+void output_writer::encode(const wchar_t* str, size_t length) {
+
+  // a code point takes 4 bytes at most
+  while (length) {
+    if (size - used < 4) {
+      ship();
+    }
+    const size_t chunk = std::min(length, (size - used) / 4);
+    char* out = current.data.get() + used;
+    for (const wchar_t* end = str + chunk; str != end; ++str) {
+      uint32_t c = static_cast<uint32_t>(*str);
+      if (c < 0x80) {
+        *out++ = char(c);
+        continue;
+      }
+      if (c > 0x10FFFF or (c >= 0xD800 and c <= 0xDFFF)) {
+        c = 0xFFFD; // not a valid code point, see the replacement character
+      }
+      if (c < 0x800) {
+        *out++ = char(0xC0 | (c >> 6));
+      } else if (c < 0x10000) {
+        *out++ = char(0xE0 | (c >> 12));
+        *out++ = char(0x80 | ((c >> 6) & 0x3F));
+      } else {
+        *out++ = char(0xF0 | (c >> 18));
+        *out++ = char(0x80 | ((c >> 12) & 0x3F));
+        *out++ = char(0x80 | ((c >> 6) & 0x3F));
+      }
+      *out++ = char(0x80 | (c & 0x3F));
+    }
+    used = out - current.data.get();
+    length -= chunk;
+  }
+}
+
+/**
+ * hands the current buffer over, to the writer thread if any, and gets an empty one
+*/
+void output_writer::ship() {
+
+  if (0 == used) {
+    return;
+  }
+
+  current.used = used;
+
+  if (not writer.joinable()) {
+    write(&current, 1);
+    used = 0;
+    check();
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex);
+  cond.wait(lock, [this](){ return queued.size() < max_queued or not error.empty(); });
+  check();
+  queued.push_back(std::move(current));
+  if (spares.empty()) {
+    current.data = std::make_unique<char[]>(size);
+  } else {
+    current = std::move(spares.back());
+    spares.pop_back();
+  }
+  used = 0;
+  cond.notify_all();
+}
+
+void output_writer::flush() {
+
+  ship();
+
+  if (writer.joinable()) {
+    std::unique_lock<std::mutex> lock(mutex);
+    cond.wait(lock, [this](){ return (queued.empty() and not writing) or not error.empty(); });
+    check();
+  }
+}
+
+/**
+ * writes the given buffers in order, with as few system calls as possible, and records the
+ * first failure
+*/
+void output_writer::write(buffer_t* buffers, size_t count) {
+
+  std::vector<iovec> iov(count);
+  for (size_t i = 0; i < count; ++i) {
+    iov[i].iov_base = buffers[i].data.get();
+    iov[i].iov_len = buffers[i].used;
+  }
+
+  for (size_t first = 0; first < count; ) {
+
+    const ssize_t done = writev(fd, iov.data() + first, std::min<size_t>(count - first, IOV_MAX));
+
+    if (done < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      const auto reason = std::string("cannot write the output: ") + strerror(errno);
+      std::lock_guard<std::mutex> lock(mutex);
+      error = reason;
+      return;
+    }
+
+    // skips what was written, even partially
+    size_t left = done;
+    while (first < count and left >= iov[first].iov_len) {
+      left -= iov[first].iov_len;
+      ++first;
+    }
+    if (first < count) {
+      iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + left;
+      iov[first].iov_len -= left;
+    }
+  }
+}
+
+/**
+ * the writer thread loop
+*/
+void output_writer::run() {
+
+  std::vector<buffer_t> batch;
+
+  std::unique_lock<std::mutex> lock(mutex);
+
+  for (;;) {
+
+    cond.wait(lock, [this](){ return stop or not queued.empty(); });
+
+    if (queued.empty()) {
+      return;
+    }
+
+    batch.swap(queued);
+    writing = true;
+    const bool failed = not error.empty();
+
+    lock.unlock();
+    if (not failed) {
+      write(batch.data(), batch.size());
+    }
+    lock.lock();
+
+    writing = false;
+    for (auto& buffer : batch) {
+      buffer.used = 0;
+      spares.push_back(std::move(buffer));
+    }
+    batch.clear();
+    cond.notify_all();
+  }
+}
+
+/**
+ * throws the first failure, if any
+*/
+void output_writer::check() {
+  if (not error.empty()) {
+    throw std::runtime_error(error);
+  }
+}
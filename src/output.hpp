@@ -0,0 +1,133 @@
+#pragma once
+
+#include <string_view>
+#include <string>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <charconv>
+#include <cstddef>
+
+/**
+ * \brief A buffered writer for the output of the process: the text is formatted and encoded to
+ * UTF-8 straight into large buffers, which are written to a file descriptor only once full,
+ * optionally by a dedicated thread so that the producer never blocks on the I/O.
+ * Wide strings are encoded as UTF-8, narrow strings are written as they are.
+*/
+class output_writer final {
+public:
+
+  /**
+   * c'tor
+   * \param fd the file descriptor to write to, which is not closed
+   * \param threaded if true the buffers are written by a dedicated thread
+  */
+  explicit output_writer(int fd, bool threaded = false);
+
+  /**
+   * c'tor, creates or truncates the given file, which is closed by the d'tor
+   * \param filename the file to write to
+   * \param threaded if true the buffers are written by a dedicated thread
+   * \throw std::runtime_error if the file cannot be created
+  */
+  explicit output_writer(const std::string& filename, bool threaded = false);
+
+  /**
+   * d'tor, flushes what is left, failures are only logged
+  */
+  ~output_writer();
+
+  /**
+   * appends a character
+  */
+  void put(char c) {
+    if (used == size) {
+      ship();
+    }
+    current.data[used++] = c;
+  }
+
+  /**
+   * appends a number in decimal notation
+  */
+  void number(size_t n) {
+    if (size - used < max_digits) {
+      ship();
+    }
+    used = std::to_chars(current.data.get() + used, current.data.get() + size, n).ptr
+      - current.data.get();
+  }
+
+  /**
+   * appends a string, wide strings are encoded as UTF-8
+  */
+  template <typename CharT>
+  void text(const std::basic_string_view<CharT>& str) {
+    encode(str.data(), str.size());
+  }
+
+  /**
+   * appends a line of output, as "[<number> ][[x<count>] ]<text>\n"
+   * \param number the line number, omitted if zero
+   * \param str the text of the line
+   * \param count the occurrences of a collapsed line, omitted if zero
+  */
+  template <typename CharT>
+  void line(size_t number, const std::basic_string_view<CharT>& str, size_t count = 0) {
+    if (number) {
+      this->number(number);
+      put(' ');
+    }
+    if (count) {
+      encode("[x", 2);
+      this->number(count);
+      encode("] ", 2);
+    }
+    encode(str.data(), str.size());
+    put('\n');
+  }
+
+  /**
+   * writes everything appended so far
+   * \throw std::runtime_error if the output cannot be written
+  */
+  void flush();
+
+private:
+
+  output_writer(const output_writer&) = delete;
+  output_writer& operator = (const output_writer&) = delete;
+
+  static constexpr size_t size = 1 << 16;
+  static constexpr size_t max_digits = 20;
+  static constexpr size_t max_queued = 4;
+
+  struct buffer_t {
+    std::unique_ptr<char[]> data;
+    size_t used = 0;
+  };
+
+  void encode(const char* str, size_t length);
+  void encode(const wchar_t* str, size_t length);
+  void ship();
+  void write(buffer_t* buffers, size_t count);
+  void run();
+  void check();
+
+  const int fd;
+  const bool owned;
+  buffer_t current;
+  size_t used;
+
+  // the writer thread, if any, along with the buffers waiting for it and the spare ones
+  std::thread writer;
+  std::vector<buffer_t> queued;
+  std::vector<buffer_t> spares;
+  bool writing;
+  bool stop;
+  std::string error;
+  std::mutex mutex;
+  std::condition_variable cond;
+};
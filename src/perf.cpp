@@ -0,0 +1,98 @@
+#include "perf.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static constexpr uint64_t configs[perf_counters::events] = {
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES,
+  PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+const char* perf_counters::name(event_t event) {
+  static const char* const names[events] = {
+    "cycles", "instructions", "cache_misses", "branch_misses"
+  };
+  return names[event];
+}
+
+perf_counters::perf_counters() : failure(0) {
+
+  fds.fill(-1);
+
+  for (size_t e = 0; e < events; ++e) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = configs[e];
+    // allowed up to perf_event_paranoid 2
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // the first one leads the group, the others are scheduled along with it
+    fds[e] = int(syscall(SYS_perf_event_open, &attr, 0, -1, e ? fds[0] : -1,
+                         PERF_FLAG_FD_CLOEXEC));
+    if (fds[e] < 0) {
+      failure = errno ? errno : ENOSYS;
+      break;
+    }
+  }
+
+  if (failure) {
+    for (auto& fd : fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      fd = -1;
+    }
+  }
+}
+
+perf_counters::~perf_counters() {
+  for (const auto fd : fds) {
+    if (fd >= 0) {
+      close(fd);
+    }
+  }
+}
+
+bool perf_counters::available() const {
+  return 0 == failure;
+}
+
+int perf_counters::error() const {
+  return failure;
+}
+
+perf_counters::values_t perf_counters::read() const {
+
+  values_t values{};
+  if (failure) {
+    return values;
+  }
+
+  struct {
+    uint64_t count;
+    uint64_t enabled;
+    uint64_t running;
+    uint64_t values[events];
+  } group;
+
+  if (sizeof(group) != size_t(::read(fds[0], &group, sizeof(group))) or events != group.count) {
+    return values;
+  }
+
+  for (size_t e = 0; e < events; ++e) {
+    values[e] = (group.running and group.running < group.enabled)
+      ? uint64_t(double(group.values[e]) * group.enabled / group.running)
+      : group.values[e];
+  }
+
+  return values;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/**
+ * The hardware performance counters of the thread that opened them, as a group read at once
+ * via perf_event_open(2). They may be unavailable: no PMU (as in most VMs), a restrictive
+ * perf_event_paranoid, or a seccomp policy (as in most containers).
+*/
+class perf_counters final {
+public:
+  enum event_t {
+    cycles,
+    instructions,
+    cache_misses,
+    branch_misses,
+    events
+  };
+
+  using values_t = std::array<uint64_t, events>;
+
+  /// the name of the event, as reported
+  static const char* name(event_t event);
+
+  /**
+   * c'tor, starts counting the events of the calling thread, in user space only
+  */
+  perf_counters();
+
+  ~perf_counters();
+
+  /// false if the counters could not be opened, error() tells why
+  bool available() const;
+
+  /// the errno of the failure to open the counters, 0 if available
+  int error() const;
+
+  /**
+   * the counts since the c'tor, scaled up if the counters were not always running because the
+   * PMU was shared; callable from any thread
+   * \return the counts, zeros if unavailable
+  */
+  values_t read() const;
+
+private:
+  perf_counters(const perf_counters&) = delete;
+  perf_counters(perf_counters&&) = delete;
+  perf_counters& operator = (const perf_counters&) = delete;
+  perf_counters& operator = (perf_counters&&) = delete;
+  std::array<int, events> fds;
+  int failure;
+};
@@ -0,0 +1,284 @@
+#pragma once
+
+#include "thread-pool.hpp"
+#include "cancellation.hpp"
+
+#include <vector>
+#include <functional>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+/**
+ * \brief A linear chain of stages processing a stream of items on a thread pool.
+ * At most capacity items are in flight at any time, each one stored in a slot that is recycled
+ * once the item went through all the stages: a producer faster than the slowest stage is held
+ * back (while waiting it helps the pool with its short jobs, never with the lengthy ones), so
+ * the memory in use stays bounded.
+ * Serial stages process one item at a time, in the order the items were pushed; parallel stages
+ * process as many items at once as the pool allows. Different stages overlap on different items.
+ * A failing stage, or the cancellation of the token, makes all the items still in flight skip
+ * their remaining stages.
+ * \note the items are default constructed once, then reused: filling an item can recycle the
+ * buffers of the previous one
+*/
+template <typename Item>
+class pipeline final {
+public:
+
+  enum mode_t {
+    serial,
+    parallel
+  };
+
+  /**
+   * c'tor
+   * \param pool the pool running the stages
+   * \param capacity the maximum number of items in flight
+   * \param token the token to poll before each stage, cancelled when a stage fails
+  */
+  pipeline(thread_pool& pool, size_t capacity, cancellation* token = nullptr)
+    : pool(pool), capacity(std::max<size_t>(1, capacity)), slots(this->capacity),
+      in_flight(0), sequence(0), posted(0), waiters(0), token(token) {
+    for (size_t i = 0; i < this->capacity; ++i) {
+      spare.push_back(this->capacity - 1 - i);
+    }
+  }
+
+  /**
+   * d'tor, waits for the items still in flight, discarding any error
+  */
+  ~pipeline() {
+    wait_until([this](){ return 0 == in_flight; });
+  }
+
+  /**
+   * appends a stage, stages must be added before the first item is pushed
+   * \param mode how the stage processes the items
+   * \param func the operation to perform, void(Item&)
+   * \return the pipeline itself
+  */
+  template <typename Func>
+  pipeline& stage(mode_t mode, Func&& func) {
+    stages.emplace_back(mode, std::forward<Func>(func), capacity);
+    return *this;
+  }
+
+  /**
+   * feeds an item to the first stage, blocks while the pipeline is full
+   * \param fill void(Item&), fills in a recycled item
+   * \throw the reason of the cancellation, if the token was cancelled
+   * \note push must not be called by multiple threads at once
+  */
+  template <typename Fill>
+  void push(const Fill& fill) {
+
+    size_t slot;
+    wait_until([this](){ return not spare.empty(); });
+    if (token) {
+      token->check();
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      slot = spare.back();
+      spare.pop_back();
+      ++in_flight;
+    }
+
+    try {
+      fill(slots[slot].item);
+    } catch (...) {
+      release(slot);
+      throw;
+    }
+
+    slots[slot].seq = sequence++;
+    enter(0, slot);
+  }
+
+  /**
+   * waits for all the items pushed so far to go through all the stages
+   * \throw the first exception thrown by a stage, if any: the stages following a failure are
+   * skipped for all the items still in flight; or the reason of the cancellation of the token
+  */
+  void finish() {
+    wait_until([this](){ return 0 == in_flight; });
+    if (error) {
+      std::rethrow_exception(error);
+    }
+    if (token) {
+      token->check();
+    }
+  }
+
+  /// tells if a stage threw
+  bool failed() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return bool(error);
+  }
+
+private:
+
+  pipeline(const pipeline&) = delete;
+  pipeline& operator = (const pipeline&) = delete;
+
+  static constexpr size_t none = std::numeric_limits<size_t>::max();
+
+  struct slot_t {
+    Item item;
+    size_t seq = 0;
+  };
+
+  struct stage_t {
+    stage_t(mode_t mode, std::function<void(Item&)>&& func, size_t capacity)
+      : mode(mode), func(std::move(func)), waiting(mode == serial ? capacity : 0, none),
+        next(0), busy(false) {}
+    mode_t mode;
+    std::function<void(Item&)> func;
+    // serial stages only: the slots waiting for their turn, indexed by seq % capacity, the
+    // seq of the next item to process, and whether a job is draining the stage
+    std::vector<size_t> waiting;
+    size_t next;
+    bool busy;
+  };
+
+  /**
+   * hands an item to a stage, or recycles its slot past the last stage
+  */
+  void enter(size_t s, size_t slot) {
+
+    if (s == stages.size()) {
+      release(slot);
+      return;
+    }
+
+    auto& stage = stages[s];
+
+    if (parallel == stage.mode) {
+      post([this, s, slot](){
+        execute(s, slot);
+        enter(s + 1, slot);
+      });
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (stage.busy or slots[slot].seq != stage.next) {
+        // the job draining the stage, or the item before this one, will get to it
+        stage.waiting[slots[slot].seq % capacity] = slot;
+        return;
+      }
+      stage.busy = true;
+    }
+
+    post([this, s, slot](){ drain(s, slot); });
+  }
+
+  /**
+   * hands a job to the pool, waking up the threads waiting for the pipeline to help with it
+   * \note the job is posted under the mutex: until it runs the item is in flight, which keeps
+   * the pipeline alive while it is notified
+  */
+  template <typename Func>
+  void post(Func&& func) {
+    std::lock_guard<std::mutex> lock(mutex);
+    pool.post(std::forward<Func>(func));
+    ++posted;
+    if (waiters) {
+      cond.notify_all();
+    }
+  }
+
+  /**
+   * processes an item on a serial stage, then the items waiting for it, as long as they come
+   * in order
+   * \note once the last item leaves the pipeline the pipeline may be gone, so the next item is
+   * picked before handing the current one over
+  */
+  void drain(size_t s, size_t slot) {
+    auto& stage = stages[s];
+    for (;;) {
+      execute(s, slot);
+      size_t next;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& waiting = stage.waiting[++stage.next % capacity];
+        next = waiting;
+        waiting = none;
+        if (none == next) {
+          stage.busy = false;
+        }
+      }
+      enter(s + 1, slot);
+      if (none == next) {
+        return;
+      }
+      slot = next;
+    }
+  }
+
+  void execute(size_t s, size_t slot) noexcept {
+    if (failed() or (token and token->cancelled())) {
+      return;
+    }
+    try {
+      stages[s].func(slots[slot].item);
+    } catch (...) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (not error) {
+          error = std::current_exception();
+        }
+      }
+      if (token) {
+        token->cancel(std::current_exception());
+      }
+    }
+  }
+
+  void release(size_t slot) {
+    std::lock_guard<std::mutex> lock(mutex);
+    spare.push_back(slot);
+    --in_flight;
+    cond.notify_all();
+  }
+
+  /**
+   * helps the pool until the predicate, evaluated under the mutex, holds
+  */
+  template <typename Predicate>
+  void wait_until(const Predicate& pred) {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (not pred()) {
+      const auto seen = posted;
+      lock.unlock();
+      const bool helped = pool.help();
+      lock.lock();
+      if (not helped) {
+        // the items in flight run elsewhere: each one either releases its slot or posts its
+        // next stage, which this thread may have to help with if every worker is waiting
+        ++waiters;
+        cond.wait(lock, [&](){ return pred() or posted != seen; });
+        --waiters;
+      }
+    }
+  }
+
+  thread_pool& pool;
+  const size_t capacity;
+  std::vector<slot_t> slots;
+  std::vector<stage_t> stages;
+  std::vector<size_t> spare;
+  size_t in_flight;
+  size_t sequence;
+  // the jobs posted so far, and the threads waiting for one or for a slot
+  size_t posted;
+  size_t waiters;
+  std::exception_ptr error;
+  cancellation* token;
+  mutable std::mutex mutex;
+  std::condition_variable cond;
+};
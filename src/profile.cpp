@@ -0,0 +1,511 @@
+#include "profile.hpp"
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+namespace {
+
+using clock_type = profiler<std::string>::clock_type;
+using profiling::span_t;
+
+const clock_type::time_point epoch = clock_type::now();
+
+// past this many spans a thread drops the new ones, or a resident process would grow forever
+constexpr size_t max_spans = 1 << 20;
+
+struct buffer_t {
+  pid_t thread;
+  // the rank of the thread, in the ids of its spans
+  uint64_t number;
+  // as given to attach(), if ever
+  std::string name;
+  // opened once the counters are enabled, kept only if available
+  std::unique_ptr<perf_counters> perf;
+  bool probed = false;
+  std::vector<span_t> spans;
+  // the spans still open, the innermost last
+  std::vector<size_t> open;
+  size_t dropped = 0;
+};
+
+// the buffers of the live threads that recorded a span
+std::mutex registry_mutex;
+std::vector<std::shared_ptr<buffer_t>> registry;
+
+// what is left of the threads gone: their spans, and their names as traced
+std::vector<span_t> retired;
+std::vector<std::pair<pid_t, std::string>> retired_threads;
+size_t retired_dropped = 0;
+
+std::atomic<uint64_t> threads = 0;
+
+std::atomic<bool> counting = false;
+
+// the name of the thread, as traced and summarized
+std::string name_of(const buffer_t& buffer) {
+  if (not buffer.name.empty()) {
+    return buffer.name;
+  }
+  return getpid() == buffer.thread ? "main" : "thread " + std::to_string(buffer.number);
+}
+
+// the span handed over to the calling thread, and the number of its own spans open then
+thread_local uint64_t adopted = 0;
+thread_local size_t adopted_depth = 0;
+
+/**
+ * moves the spans of a thread that exits to the shared ones and forgets its buffer, so that
+ * the threads of a resident process (one per request) do not pile up
+*/
+void retire(const std::shared_ptr<buffer_t>& buffer) {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  registry.erase(std::remove(registry.begin(), registry.end(), buffer), registry.end());
+  for (auto& span : buffer->spans) {
+    if (span.end < span.begin) {
+      continue; // never closed
+    }
+    if (retired.size() >= max_spans) {
+      ++retired_dropped;
+      continue;
+    }
+    retired.push_back(std::move(span));
+  }
+  retired_dropped += buffer->dropped;
+  if (not buffer->spans.empty()) {
+    retired_threads.emplace_back(buffer->thread, name_of(*buffer));
+  }
+}
+
+// the buffer of the thread, retired as the thread exits
+struct holder_t {
+  std::shared_ptr<buffer_t> buffer;
+  ~holder_t() {
+    if (buffer) {
+      retire(buffer);
+    }
+  }
+};
+
+buffer_t& local() {
+  thread_local holder_t holder;
+  if (not holder.buffer) {
+    auto buffer = std::make_shared<buffer_t>();
+    buffer->thread = pid_t(syscall(SYS_gettid));
+    buffer->number = ++threads;
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    registry.push_back(buffer);
+    holder.buffer = std::move(buffer);
+  }
+  return *holder.buffer;
+}
+
+// opens the counters of the calling thread, once and if enabled
+void probe(buffer_t& buffer) {
+  if (buffer.probed or not counting) {
+    return;
+  }
+  buffer.probed = true;
+  auto perf = std::make_unique<perf_counters>();
+  if (perf->available()) {
+    buffer.perf = std::move(perf);
+    return;
+  }
+  static std::atomic<bool> told = false;
+  if (not told.exchange(true)) {
+    log_profile << "hardware counters unavailable (" << strerror(perf->error())
+                << "), timings only";
+  }
+}
+
+/**
+ * formats the millions of cycles, the instructions per cycle and the cache and branch misses
+ * per thousand instructions
+ * \param events the events of a span, a stage or a thread
+*/
+std::string rates(const perf_counters::values_t& events) {
+  const double cycles = events[perf_counters::cycles];
+  const double instructions = events[perf_counters::instructions];
+  const auto per_ki = [instructions](double count){
+    return instructions ? 1000 * count / instructions : 0.0;
+  };
+  char str[128];
+  snprintf(str, sizeof(str), "%10.1f %6.2f %9.2f %9.2f", cycles / 1e6,
+           cycles ? instructions / cycles : 0.0, per_ki(events[perf_counters::cache_misses]),
+           per_ki(events[perf_counters::branch_misses]));
+  return str;
+}
+
+int64_t now() {
+  return duration_cast<nanoseconds>(clock_type::now() - epoch).count();
+}
+
+double ms(int64_t ns) {
+  return ns / 1e6;
+}
+
+std::string_view stage_of(const std::string& name) {
+  return std::string_view(name).substr(0, name.find(' '));
+}
+
+/**
+ * walks the critical path of each root span: from its end back to its beginning, the child
+ * that ended last, then the one that ended last before that one began, and so on, down to
+ * the children of each of them
+ * \return the spans on the paths, along with their depth, in order
+*/
+std::vector<std::pair<const span_t*, size_t>> critical_path(const std::vector<span_t>& spans) {
+
+  std::unordered_map<uint64_t, std::vector<const span_t*>> children;
+  std::vector<const span_t*> roots;
+  for (const auto& span : spans) {
+    (span.parent ? children[span.parent] : roots).push_back(&span);
+  }
+
+  std::vector<std::pair<const span_t*, size_t>> path;
+
+  std::function<void(const span_t*, size_t)> walk = [&](const span_t* span, size_t depth){
+    path.emplace_back(span, depth);
+    const auto it = children.find(span->id);
+    if (it == children.end()) {
+      return;
+    }
+    auto candidates = it->second;
+    std::sort(candidates.begin(), candidates.end(), [](const span_t* a, const span_t* b){
+      return a->end > b->end;
+    });
+    std::vector<const span_t*> chosen;
+    auto cursor = span->end;
+    for (const auto child : candidates) {
+      if (child->end <= cursor) {
+        chosen.push_back(child);
+        cursor = child->begin;
+      }
+    }
+    for (auto child = chosen.rbegin(); child != chosen.rend(); ++child) {
+      walk(*child, depth + 1);
+    }
+  };
+
+  for (const auto span : roots) {
+    walk(span, 0);
+  }
+
+  return path;
+}
+
+void escape(std::ostream& os, const std::string_view& str) {
+  for (const char c : str) {
+    if ('"' == c or '\\' == c) {
+      os << '\\' << c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char code[8];
+      snprintf(code, sizeof(code), "\\u%04x", unsigned(c));
+      os << code;
+    } else {
+      os << c;
+    }
+  }
+}
+
+}
+
+namespace profiling {
+
+void enable(bool on) {
+  recording = on;
+}
+
+void enable_counters(bool on) {
+  counting = on;
+}
+
+void attach(const std::string& name) {
+  if (not enabled()) {
+    return;
+  }
+  auto& buffer = local();
+  buffer.name = name;
+  probe(buffer);
+}
+
+size_t open(const std::string_view& name) {
+
+  auto& buffer = local();
+  if (buffer.spans.size() >= max_spans) {
+    ++buffer.dropped;
+    return npos;
+  }
+
+  span_t span;
+  span.id = (buffer.number << 32) | (buffer.spans.size() + 1);
+  span.parent = buffer.open.size() > adopted_depth ? buffer.spans[buffer.open.back()].id
+                                                   : adopted;
+  span.thread = buffer.thread;
+  span.name = name;
+  span.end = -1; // still open
+  span.counted = 0;
+  span.begin = now();
+
+  probe(buffer);
+  span.measured = bool(buffer.perf);
+  span.events = span.measured ? buffer.perf->read() : perf_counters::values_t{};
+
+  buffer.open.push_back(buffer.spans.size());
+  buffer.spans.push_back(std::move(span));
+  return buffer.open.back();
+}
+
+void close(size_t handle) {
+  auto& buffer = local();
+  auto& span = buffer.spans[handle];
+  if (span.measured) {
+    const auto events = buffer.perf->read();
+    for (size_t e = 0; e < events.size(); ++e) {
+      span.events[e] = events[e] - span.events[e];
+    }
+  }
+  span.end = now();
+  if (not buffer.open.empty() and buffer.open.back() == handle) {
+    buffer.open.pop_back();
+  }
+}
+
+void add(const char* name, uint64_t value) {
+  auto& buffer = local();
+  if (buffer.open.empty()) {
+    return;
+  }
+  auto& span = buffer.spans[buffer.open.back()];
+  for (size_t i = 0; i < span.counted; ++i) {
+    if (0 == strcmp(span.counters[i].name, name)) {
+      span.counters[i].value += value;
+      return;
+    }
+  }
+  if (span.counted < span.counters.size()) {
+    span.counters[span.counted++] = {name, value};
+  }
+}
+
+uint64_t current() {
+  const auto& buffer = local();
+  return buffer.open.size() > adopted_depth ? buffer.spans[buffer.open.back()].id : adopted;
+}
+
+adopt::adopt(uint64_t span) : saved(adopted), saved_depth(adopted_depth) {
+  adopted = span;
+  adopted_depth = enabled() ? local().open.size() : 0;
+}
+
+adopt::~adopt() {
+  adopted = saved;
+  adopted_depth = saved_depth;
+}
+
+std::vector<span_t> spans() {
+  std::vector<span_t> all;
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    all = retired;
+    for (const auto& buffer : registry) {
+      std::copy_if(buffer->spans.begin(), buffer->spans.end(), std::back_inserter(all),
+                   [](const span_t& span){ return span.end >= span.begin; });
+    }
+  }
+  std::sort(all.begin(), all.end(), [](const span_t& a, const span_t& b){
+    return a.begin < b.begin;
+  });
+  return all;
+}
+
+void clear() {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for (const auto& buffer : registry) {
+    buffer->spans.clear();
+    buffer->open.clear();
+    buffer->dropped = 0;
+  }
+  retired.clear();
+  retired_threads.clear();
+  retired_dropped = 0;
+}
+
+void trace(std::ostream& os) {
+
+  const auto all = spans();
+
+  std::unordered_set<uint64_t> critical;
+  for (const auto& step : critical_path(all)) {
+    critical.insert(step.first->id);
+  }
+
+  const auto pid = getpid();
+
+  os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+
+  bool first = true;
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (const auto& buffer : registry) {
+      os << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+         << ",\"tid\":" << buffer->thread << ",\"args\":{\"name\":\""
+         << name_of(*buffer)
+         << "\"}}";
+      first = false;
+    }
+    for (const auto& thread : retired_threads) {
+      os << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid
+         << ",\"tid\":" << thread.first << ",\"args\":{\"name\":\"" << thread.second << "\"}}";
+      first = false;
+    }
+  }
+
+  for (const auto& span : all) {
+    char times[64];
+    snprintf(times, sizeof(times), "\"ts\":%.3f,\"dur\":%.3f", span.begin / 1e3,
+             (span.end - span.begin) / 1e3);
+    os << (first ? "" : ",") << "\n{\"name\":\"";
+    escape(os, span.name);
+    os << "\",\"cat\":\"";
+    escape(os, stage_of(span.name));
+    os << "\",\"ph\":\"X\"," << times << ",\"pid\":" << pid << ",\"tid\":" << span.thread
+       << ",\"args\":{\"id\":" << span.id << ",\"parent\":" << span.parent;
+    for (size_t i = 0; i < span.counted; ++i) {
+      os << ",\"";
+      escape(os, span.counters[i].name);
+      os << "\":" << span.counters[i].value;
+    }
+    for (size_t e = 0; span.measured and e < perf_counters::events; ++e) {
+      os << ",\"" << perf_counters::name(perf_counters::event_t(e)) << "\":" << span.events[e];
+    }
+    if (critical.count(span.id)) {
+      os << ",\"critical\":true";
+    }
+    os << "}}";
+    first = false;
+  }
+
+  os << "\n]}";
+}
+
+void summary() {
+
+  if (not log::has(log::profile)) {
+    return;
+  }
+
+  const auto all = spans();
+
+  struct stage_t {
+    std::string_view name;
+    size_t count = 0;
+    int64_t total = 0;
+    int64_t max = 0;
+    std::vector<counter_t> counters;
+    perf_counters::values_t events{};
+  };
+
+  // in order of first occurrence, there are only a few of them
+  std::vector<stage_t> stages;
+  bool measured = false;
+  for (const auto& span : all) {
+    const auto name = stage_of(span.name);
+    auto stage = std::find_if(stages.begin(), stages.end(), [&name](const stage_t& stage){
+      return stage.name == name;
+    });
+    if (stage == stages.end()) {
+      stage = stages.insert(stages.end(), stage_t{name, 0, 0, 0, {}, {}});
+    }
+    const auto duration = span.end - span.begin;
+    ++stage->count;
+    stage->total += duration;
+    stage->max = std::max(stage->max, duration);
+    for (size_t e = 0; span.measured and e < perf_counters::events; ++e) {
+      stage->events[e] += span.events[e];
+    }
+    measured |= span.measured;
+    for (size_t i = 0; i < span.counted; ++i) {
+      const auto& counter = span.counters[i];
+      auto it = std::find_if(stage->counters.begin(), stage->counters.end(),
+                             [&counter](const counter_t& c){
+        return 0 == strcmp(c.name, counter.name);
+      });
+      if (it == stage->counters.end()) {
+        stage->counters.push_back({counter.name, 0});
+        it = std::prev(stage->counters.end());
+      }
+      it->value += counter.value;
+    }
+  }
+
+  char row[256];
+
+  // the events are those of the thread of each span, the work handed to others is not included
+  const char* const events_head = "    Mcycles    IPC  cmiss/ki  bmiss/ki";
+
+  snprintf(row, sizeof(row), "%-24s %7s %12s %12s %12s", "stage", "count", "total ms", "mean ms",
+           "max ms");
+  log_profile << row << (measured ? events_head : "");
+  for (const auto& stage : stages) {
+    snprintf(row, sizeof(row), "%-24.*s %7zu %12.3f %12.3f %12.3f", int(stage.name.size()),
+             stage.name.data(), stage.count, ms(stage.total),
+             ms(stage.total / int64_t(stage.count)), ms(stage.max));
+    std::string line = row;
+    if (measured) {
+      line += " " + rates(stage.events);
+    }
+    for (const auto& counter : stage.counters) {
+      line += std::string(" ") + counter.name + "=" + std::to_string(counter.value);
+    }
+    log_profile << line;
+  }
+
+  int64_t whole = 0;
+  for (const auto& step : critical_path(all)) {
+    const auto span = step.first;
+    const auto duration = span->end - span->begin;
+    if (0 == step.second) {
+      whole = duration;
+      log_profile << "critical path of " << span->name << ", " << ms(duration) << " ms:";
+      continue;
+    }
+    snprintf(row, sizeof(row), "%*s%12.3f ms %5.1f%%  ", int(2 * step.second), "", ms(duration),
+             whole ? 100.0 * duration / whole : 0.0);
+    log_profile << row << span->name;
+  }
+
+  size_t dropped = 0;
+  {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    dropped = retired_dropped;
+    bool head = false;
+    for (const auto& buffer : registry) {
+      dropped += buffer->dropped;
+      if (not buffer->perf) {
+        continue;
+      }
+      if (not head) {
+        snprintf(row, sizeof(row), "%-24s%s", "thread", events_head);
+        log_profile << row;
+        head = true;
+      }
+      const auto label = name_of(*buffer) + " (" + std::to_string(buffer->thread) + ")";
+      snprintf(row, sizeof(row), "%-24s", label.c_str());
+      log_profile << row << " " << rates(buffer->perf->read());
+    }
+  }
+  if (dropped) {
+    log_warning << dropped << " spans were not recorded, past " << max_spans << " per thread";
+  }
+}
+
+}
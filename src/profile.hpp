@@ -1,12 +1,135 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <iosfwd>
+#include <string>
 #include <string_view>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
 
 #include "logging.hpp"
+#include "perf.hpp"
 
 using namespace std::chrono;
 
+/**
+ * Records the profiled sections as spans, into a buffer of each thread, to be summarized or
+ * exported once the work is done.
+*/
+namespace profiling {
+
+  // a value measured within a span, its name is a literal
+  struct counter_t {
+    const char* name;
+    uint64_t value;
+  };
+
+  struct span_t {
+    // unique in the process, never 0
+    uint64_t id;
+    // the innermost span open on the same thread when this one began, else the one the work
+    // was handed over from (see adopt), 0 if none: the span of a run
+    uint64_t parent;
+    // the system id of the thread
+    pid_t thread;
+    std::string name;
+    // since the process started, in ns
+    int64_t begin;
+    int64_t end;
+    std::array<counter_t, 4> counters;
+    size_t counted;
+    // the hardware events of the thread within the span, if measured
+    perf_counters::values_t events;
+    bool measured;
+  };
+
+  static constexpr size_t npos = size_t(-1);
+
+  // set while the spans are recorded
+  inline std::atomic<bool> recording = false;
+
+  /// starts or stops recording the spans, the ones recorded so far are kept
+  void enable(bool on = true);
+
+  static inline bool enabled() {
+    return recording.load(std::memory_order_relaxed);
+  }
+
+  /// starts or stops measuring the hardware counters of the threads that record spans
+  void enable_counters(bool on = true);
+
+  /**
+   * registers the calling thread, if recording: its counters are measured from now on, even if
+   * it records no span
+   * \param name the name of the thread, as traced
+  */
+  void attach(const std::string& name);
+
+  /**
+   * begins a span on the calling thread, nested in the innermost one open on it
+   * \param name the name of the span
+   * \return the handle to end the span with, npos if the span is not recorded
+  */
+  size_t open(const std::string_view& name);
+
+  /// ends the span begun on the calling thread with the given handle
+  void close(size_t handle);
+
+  /// adds to a counter of the innermost span open on the calling thread
+  void add(const char* name, uint64_t value);
+
+  /// the span the ones begun on the calling thread would be children of, 0 if none
+  uint64_t current();
+
+  /**
+   * \brief While alive, makes the spans begun on the calling thread outside of its own open
+   * ones children of the given span: a job is part of the run that handed it over, not of the
+   * one its worker happens to be waiting for.
+  */
+  class adopt final {
+  public:
+    explicit adopt(uint64_t parent);
+    ~adopt();
+  private:
+    adopt(const adopt&) = delete;
+    adopt& operator = (const adopt&) = delete;
+    // what was adopted before
+    uint64_t saved;
+    size_t saved_depth;
+  };
+
+  /**
+   * adds to a counter of the innermost span open on the calling thread, if recording
+   * \param name the name of the counter, a literal
+   * \param value the amount to add
+  */
+  static inline void count(const char* name, uint64_t value) {
+    if (enabled()) {
+      add(name, value);
+    }
+  }
+
+  /// the spans recorded so far, by beginning, including the ones of the threads gone since;
+  /// only once the profiled work is done
+  std::vector<span_t> spans();
+
+  /// forgets the spans recorded so far and the threads gone, only once the profiled work is done
+  void clear();
+
+  /// writes the spans in the Chrome trace event format, which Perfetto reads as well
+  void trace(std::ostream& os);
+
+  /**
+   * logs the time spent in each stage and the critical path of each run, at the profile level,
+   * along with the hardware counters of each stage and each thread if measured
+  */
+  void summary();
+
+} // profiling
+
 template <typename string_type>
 class profiler final {
 public:
@@ -16,48 +139,21 @@ public:
     steady_clock
   >::type;
 
-  explicit profiler(const string_type& name) : name(name), start(clock_type::now()) {
+  explicit profiler(const string_type& name)
+    : handle(profiling::enabled() ? profiling::open(name) : profiling::npos) {
   }
 
   ~profiler() {
-
-    if (not log::has(log::profile)) {
-      return;
-    }
-
-    const auto dur = clock_type::now() - start;
-
-    if (duration_cast<microseconds>(dur).count() < 1000) {
-      log_profile << name << " done in " << duration_cast<microseconds>(dur).count() << " us";
-      return;
-    }
-
-    if (duration_cast<milliseconds>(dur).count() < 1000) {
-      const auto ms = duration_cast<microseconds>(dur).count() / 1000;
-      const auto us = duration_cast<microseconds>(dur).count() % 1000;
-      log_profile << name << " done in " << ms << "ms " << us << " us";
-      return;
+    if (profiling::npos != handle) {
+      profiling::close(handle);
     }
-
-    if (duration_cast<seconds>(dur).count() < 60) {
-      const auto sec = duration_cast<milliseconds>(dur).count() / 1000;
-      const auto ms = duration_cast<milliseconds>(dur).count() % 1000;
-      log_profile << name << " done in " << sec << "sec " << ms << " ms";
-      return;
-    }
-
-    const auto min = duration_cast<seconds>(dur).count() / 60;
-    const auto sec = duration_cast<seconds>(dur).count() % 60;
-
-    log_profile << name << " done in " << min << " min " << sec << " sec";
   }
 private:
   profiler(const profiler&) = delete;
   profiler(profiler&&) = delete;
   profiler& operator = (const profiler&) = delete;
   profiler& operator = (profiler&&) = delete;
-  const string_type& name;
-  clock_type::time_point start;
+  const size_t handle;
 };
 
 template <typename R, typename T>
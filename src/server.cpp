@@ -0,0 +1,390 @@
+#include "server.hpp"
+#include "output.hpp"
+#include "logging.hpp"
+#include "profile.hpp"
+
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <thread>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static sockaddr_un address_of(const std::string& path) {
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(address.sun_path)) {
+    throw std::runtime_error("socket path too long: " + path);
+  }
+  memcpy(address.sun_path, path.data(), path.size());
+  return address;
+}
+
+static void write_all(int fd, const char* data, size_t size) {
+  while (size) {
+    const ssize_t done = write(fd, data, size);
+    if (done < 0) {
+      if (EINTR == errno) {
+        continue;
+      }
+      throw std::runtime_error(std::string("cannot write: ") + strerror(errno));
+    }
+    data += done;
+    size -= done;
+  }
+}
+
+/**
+ * reads up to size bytes, less only if the peer is done
+*/
+static size_t read_some(int fd, char* data, size_t size) {
+  for (;;) {
+    const ssize_t done = read(fd, data, size);
+    if (done >= 0) {
+      return size_t(done);
+    }
+    if (EINTR != errno) {
+      throw std::runtime_error(std::string("cannot read: ") + strerror(errno));
+    }
+  }
+}
+
+static void read_all(int fd, char* data, size_t size) {
+  while (size) {
+    const size_t done = read_some(fd, data, size);
+    if (0 == done) {
+      throw std::runtime_error("truncated request");
+    }
+    data += done;
+    size -= done;
+  }
+}
+
+static std::string read_line(int fd) {
+  std::string line;
+  for (char c; line.size() < 1024; line.push_back(c)) {
+    read_all(fd, &c, 1);
+    if ('\n' == c) {
+      return line;
+    }
+  }
+  throw std::runtime_error("bad request");
+}
+
+namespace {
+
+/**
+ * \brief A file in /tmp, removed once out of scope
+*/
+class temporary final {
+public:
+  temporary() : fd(-1) {
+    char name[] = "/tmp/denoiser-body-XXXXXX";
+    fd = mkstemp(name);
+    if (fd < 0) {
+      throw std::runtime_error(std::string("cannot create a temporary file: ") + strerror(errno));
+    }
+    path = name;
+  }
+  ~temporary() {
+    if (fd >= 0) {
+      close(fd);
+      unlink(path.c_str());
+    }
+  }
+  int fd;
+  std::string path;
+};
+
+}
+
+server::server(const std::string& path)
+  : path(path), fd(-1), stopped(false), clock(0), active(0) {
+
+  const auto address = address_of(path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw std::runtime_error(std::string("cannot create the socket: ") + strerror(errno));
+  }
+
+  if (0 != bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) or
+      0 != listen(fd, 64)) {
+    const auto reason = std::string("cannot listen to ") + path + ": " + strerror(errno);
+    close(fd);
+    throw std::runtime_error(reason);
+  }
+
+  log_info << "listening to " << path;
+}
+
+server::~server() {
+  stop();
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    idle.wait(lock, [this](){ return 0 == active; });
+  }
+  close(fd);
+  unlink(path.c_str());
+}
+
+void server::run() {
+
+  // a client that goes away must not take the server with it
+  signal(SIGPIPE, SIG_IGN);
+
+  while (not stopped) {
+
+    const int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+
+    if (client < 0) {
+      if (stopped) {
+        break;
+      }
+      if (EINTR == errno or ECONNABORTED == errno) {
+        continue;
+      }
+      throw std::runtime_error(std::string("cannot accept: ") + strerror(errno));
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      ++active;
+    }
+
+    std::thread([this, client](){
+      serve(client);
+      close(client);
+      std::lock_guard<std::mutex> lock(mutex);
+      --active;
+      idle.notify_all();
+    }).detach();
+  }
+}
+
+void server::stop() {
+  stopped = true;
+  shutdown(fd, SHUT_RDWR); // wakes accept() up
+}
+
+/**
+ * finds the entry of the given configuration, or creates it, and makes sure its references
+ * are ingested
+*/
+std::shared_ptr<server::entry_t> server::warm(const std::string& yaml) {
+
+  auto node = YAML::Load(yaml);
+  if (node["targets"]) {
+    throw std::runtime_error("batch requests are not supported");
+  }
+  node.remove("target");
+
+  const auto key = YAML::Dump(node);
+  node["target"] = ""; // set by each request
+
+  std::shared_ptr<entry_t> entry;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = entries.find(key);
+    if (entries.end() == found) {
+      found = entries.emplace(key, std::make_shared<entry_t>(configuration<char_t>::parse(node))).first;
+      if (entries.size() > max_entries) {
+        // the least recently used one, never the one just added
+        auto oldest = entries.end();
+        for (auto it = entries.begin(); it != entries.end(); ++it) {
+          if (it != found and (entries.end() == oldest or it->second->used < oldest->second->used)) {
+            oldest = it;
+          }
+        }
+        log_info << "dropping a configuration of " << oldest->second->config.reference.size()
+                 << " references";
+        entries.erase(oldest); // the requests using it keep it alive
+      }
+    }
+    entry = found->second;
+    entry->used = ++clock;
+  }
+
+  // the first request ingests the references, the others wait for it
+  std::lock_guard<std::mutex> lock(entry->mutex);
+  if (not entry->ready) {
+    profile("warming up", [&](){
+      denoiser<char_t> denoiser(entry->config, pool);
+      denoiser.set_timeout(timeout);
+      entry->bucket = denoiser.ingest();
+    });
+    entry->ready = true;
+  }
+  return entry;
+}
+
+void server::serve(int client) {
+
+  const auto start = std::chrono::steady_clock::now();
+
+  output_writer out(client);
+  std::string trailer = "ok";
+
+  try {
+
+    std::istringstream header(read_line(client));
+    std::string verb;
+    size_t config_size = 0, body_size = 0;
+    if (not (header >> verb >> config_size >> body_size) or "denoise" != verb) {
+      throw std::runtime_error("bad request");
+    }
+
+    bool lines = true, collapse = false;
+    size_t limit = 0;
+    for (std::string option; header >> option; ) {
+      if ("no-lines" == option) {
+        lines = false;
+      } else if ("collapse" == option) {
+        collapse = true;
+      } else if (0 == option.compare(0, 10, "max-lines=")) {
+        limit = std::stoul(option.substr(10));
+      } else {
+        throw std::runtime_error("unknown option " + option);
+      }
+    }
+
+    std::string yaml(config_size, '\0');
+    read_all(client, yaml.data(), yaml.size());
+
+    // the body is streamed to a file, which is then loaded as any other target
+    std::unique_ptr<temporary> body;
+    if (body_size) {
+      body = std::make_unique<temporary>();
+      char buffer[64 * 1024];
+      for (size_t left = body_size; left; ) {
+        const size_t chunk = std::min(left, sizeof(buffer));
+        read_all(client, buffer, chunk);
+        write_all(body->fd, buffer, chunk);
+        left -= chunk;
+      }
+    }
+
+    const auto entry = warm(yaml);
+
+    auto config = entry->config;
+    if (body) {
+      config.target = "file://" + body->path;
+    } else {
+      const auto node = YAML::Load(yaml);
+      if (not node["target"]) {
+        throw std::runtime_error("no target");
+      }
+      config.target = node["target"].as<std::string>();
+    }
+
+    denoiser<char_t> denoiser(config, pool);
+    denoiser.set_timeout(timeout);
+    if (limit) {
+      denoiser.set_limit(limit);
+    }
+
+    if (collapse) {
+      denoiser.run_against_collapsed(entry->bucket, [&](const artifact::wline& line, size_t count){
+        out.line(lines ? line.number() : 0, line.str(), count);
+      });
+    } else {
+      denoiser.run_against(entry->bucket, [&](const artifact::wline& line){
+        out.line(lines ? line.number() : 0, line.str());
+      });
+    }
+
+  } catch (const std::exception& ex) {
+    log_error << "request failed: " << ex.what();
+    trailer = std::string("error ") + ex.what();
+    std::replace(trailer.begin(), trailer.end(), '\n', ' ');
+  }
+
+  try {
+    out.put('\0');
+    out.text(std::string_view(trailer));
+    out.put('\n');
+    out.flush();
+  } catch (const std::exception& ex) {
+    log_warning << "cannot answer: " << ex.what();
+  }
+
+  log_info << "request served in " << std::chrono::duration_cast<std::chrono::milliseconds>(
+    std::chrono::steady_clock::now() - start).count() << "ms";
+}
+
+size_t server::request(const std::string& path,
+                       const std::string& config,
+                       const std::string& body,
+                       const std::string& options,
+                       int out) {
+
+  const auto address = address_of(path);
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    throw std::runtime_error(std::string("cannot create the socket: ") + strerror(errno));
+  }
+
+  std::string trailer;
+  size_t lines = 0;
+
+  try {
+
+    if (0 != connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address))) {
+      throw std::runtime_error("cannot connect to " + path + ": " + strerror(errno));
+    }
+
+    const auto header = "denoise " + std::to_string(config.size()) + " " +
+      std::to_string(body.size()) + (options.empty() ? "" : " " + options) + "\n";
+    write_all(fd, header.data(), header.size());
+    write_all(fd, config.data(), config.size());
+    write_all(fd, body.data(), body.size());
+    shutdown(fd, SHUT_WR);
+
+    // copies everything up to the trailer, a NUL at the beginning of a line
+    char buffer[64 * 1024];
+    bool start = true, done = false;
+    for (size_t size; (size = read_some(fd, buffer, sizeof(buffer))); ) {
+      if (done) {
+        trailer.append(buffer, size);
+        continue;
+      }
+      size_t end = size;
+      for (size_t i = 0; i < size; ++i) {
+        if (start and '\0' == buffer[i]) {
+          trailer.assign(buffer + i + 1, size - i - 1);
+          end = i;
+          done = true;
+          break;
+        }
+        start = ('\n' == buffer[i]);
+        lines += start;
+      }
+      if (out >= 0) {
+        write_all(out, buffer, end);
+      }
+    }
+
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+
+  close(fd);
+
+  if (not trailer.empty() and '\n' == trailer.back()) {
+    trailer.pop_back();
+  }
+
+  if ("ok" == trailer) {
+    return lines;
+  }
+  if (0 == trailer.compare(0, 6, "error ")) {
+    throw std::runtime_error(trailer.substr(6));
+  }
+  throw std::runtime_error("the server closed the connection");
+}
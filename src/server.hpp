@@ -0,0 +1,115 @@
+#pragma once
+
+#include "denoiser.hpp"
+#include "config.hpp"
+#include "corpus.hpp"
+#include "thread-pool.hpp"
+
+#include <string>
+#include <memory>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+/**
+ * \brief The resident mode: serves denoise requests over a Unix socket, keeping the compiled
+ * rules and the ingested references of the most recent configurations in memory, so that a
+ * request only pays for its own target.
+ *
+ * A request is a header line, the configuration and optionally the target itself:
+ *   denoise <configuration size> <body size>[ no-lines][ collapse][ max-lines=<n>]\n
+ *   <configuration, as YAML>
+ *   <body>
+ * If the body is not empty it replaces the target of the configuration. The response is the
+ * output, exactly as printed by the command line, followed by a trailer line starting with a
+ * NUL character: either "\0ok\n" or "\0error <reason>\n".
+*/
+class server final {
+public:
+
+  /**
+   * c'tor, binds and listens to the given socket, which must not exist already
+   * \param path the path of the socket
+   * \throw std::runtime_error if the socket cannot be created
+  */
+  explicit server(const std::string& path);
+
+  /**
+   * d'tor, waits for the requests in progress and removes the socket
+  */
+  ~server();
+
+  /**
+   * bounds the duration of each request
+  */
+  void set_timeout(std::chrono::milliseconds t) {
+    timeout = t;
+  }
+
+  /**
+   * accepts and serves requests, each one on its own thread, until stop() is called
+  */
+  void run();
+
+  /**
+   * makes run() return, can be invoked from a signal handler
+  */
+  void stop();
+
+  /**
+   * sends a request to a server and copies its output to the given file descriptor
+   * \param path the path of the socket of the server
+   * \param config the configuration, as YAML
+   * \param body the target, if not empty
+   * \param options the options of the request, see above
+   * \param out where to copy the output to, or -1 to only count its lines
+   * \return the number of lines of the output
+   * \throw std::runtime_error if the request cannot be sent, or if it failed
+  */
+  static size_t request(const std::string& path,
+                      const std::string& config,
+                      const std::string& body,
+                      const std::string& options,
+                      int out);
+
+private:
+
+  server(const server&) = delete;
+  server& operator = (const server&) = delete;
+
+  using char_t = wchar_t;
+
+  // a configuration along with the references it was ingested into
+  struct entry_t {
+    explicit entry_t(configuration<char_t>&& config) : config(std::move(config)) {}
+    configuration<char_t> config;
+    corpus bucket;
+    bool ready = false;
+    std::mutex mutex;
+    uint64_t used = 0;
+  };
+
+  void serve(int fd);
+  std::shared_ptr<entry_t> warm(const std::string& yaml);
+
+  // the number of configurations kept in memory
+  static constexpr size_t max_entries = 8;
+
+  const std::string path;
+  int fd;
+  std::atomic<bool> stopped;
+  std::chrono::milliseconds timeout{0};
+  curlpp::Cleanup curlpp_;
+  thread_pool pool;
+
+  // the entries by configuration, without the target, and the last use of each one
+  std::map<std::string, std::shared_ptr<entry_t>> entries;
+  uint64_t clock;
+  std::mutex mutex;
+
+  // the requests in progress
+  size_t active;
+  std::condition_variable idle;
+};
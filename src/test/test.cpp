@@ -5,11 +5,30 @@
 #include "logging.hpp"
 #include "thread-pool.hpp"
 #include "denoiser.hpp"
+#include "corpus.hpp"
+#include "pipeline.hpp"
+#include "output.hpp"
+#include "server.hpp"
+#include "profile.hpp"
 #include <chrono>
 #include <atomic>
+#include <array>
+#include <sstream>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <future>
+#include <regex>
+#include <thread>
+#include <fcntl.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <ftw.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 using namespace std::chrono_literals;
 
@@ -127,6 +146,101 @@ private:
   std::string path;
 };
 
+/**
+ * a minimal HTTP server on the loopback interface, serving the same content whatever the path,
+ * honoring the Range header unless told not to, and the If-None-Match one
+*/
+class http_stand_in final {
+public:
+  http_stand_in(const std::string& content, bool ranges)
+    : content(content), ranges(ranges), fd(socket(AF_INET, SOCK_STREAM, 0)) {
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (0 != bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) or
+        0 != listen(fd, 4) or
+        0 != getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length)) {
+      throw std::runtime_error(strerror(errno));
+    }
+    port = ntohs(address.sin_port);
+    thread = std::thread([this](){ serve(); });
+  }
+  ~http_stand_in() {
+    shutdown(fd, SHUT_RDWR);
+    thread.join();
+    close(fd);
+  }
+  std::string url(const std::string& fragment) const {
+    return "http://127.0.0.1:" + std::to_string(port) + "/console.log" + fragment;
+  }
+  void update(const std::string& fresh) {
+    std::lock_guard<std::mutex> lock(mutex);
+    content = fresh;
+    ++version;
+  }
+  /// the number of requests served so far, and the bytes of content sent
+  std::pair<size_t, size_t> served() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return {requests, sent};
+  }
+private:
+  void serve() {
+    static const std::regex range_rx(R"(Range: bytes=(\d*)-(\d*))");
+    static const std::regex match_rx(R"(If-None-Match: ([^\r]+))");
+    for (int client; (client = accept(fd, nullptr, nullptr)) >= 0; close(client)) {
+      std::string request;
+      char buffer[4096];
+      while (std::string::npos == request.find("\r\n\r\n")) {
+        const ssize_t size = read(client, buffer, sizeof(buffer));
+        if (size <= 0) {
+          break;
+        }
+        request.append(buffer, size);
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      const auto etag = "\"v" + std::to_string(version) + "\"";
+      ++requests;
+      std::smatch match;
+      std::string response, body = content;
+      if (std::regex_search(request, match, match_rx) and etag == match[1]) {
+        body.clear();
+        response = "HTTP/1.1 304 Not Modified\r\n";
+      } else if (ranges and std::regex_search(request, match, range_rx)) {
+        size_t first = 0, last = content.size() - 1;
+        if (match[1].length()) {
+          first = std::stoull(match[1]);
+          if (match[2].length()) {
+            last = std::min<size_t>(std::stoull(match[2]), last);
+          }
+        } else {
+          first = content.size() - std::min<size_t>(std::stoull(match[2]), content.size());
+        }
+        body = content.substr(first, last - first + 1);
+        response = "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes " + std::to_string(first) +
+          "-" + std::to_string(last) + "/" + std::to_string(content.size()) + "\r\n";
+      } else {
+        response = "HTTP/1.1 200 OK\r\n";
+      }
+      sent += body.size();
+      response += "ETag: " + etag + "\r\n"
+                  "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                  "Connection: close\r\n\r\n" + body;
+      // the client hangs up as soon as it has enough
+      send(client, response.data(), response.size(), MSG_NOSIGNAL);
+    }
+  }
+  std::string content;
+  const bool ranges;
+  const int fd;
+  int port;
+  std::thread thread;
+  mutable std::mutex mutex;
+  size_t version = 0;
+  size_t requests = 0;
+  size_t sent = 0;
+};
+
 static std::string ascii(const std::wstring_view& v) {
   std::string s;
   s.reserve(v.size());
@@ -134,10 +248,88 @@ static std::string ascii(const std::wstring_view& v) {
   return s;
 }
 
+/**
+ * provides each test with a scratch directory, removed along with its content once the test is
+ * done, whether it passed or not
+*/
 class ArtifactDenoiserTest : public testing::Test {
-public:
+protected:
+  void TearDown() override {
+    if (not dir.empty()) {
+      nftw(dir.c_str(), [](const char* path, const struct stat*, int, struct FTW*){
+        return remove(path);
+      }, 16, FTW_DEPTH | FTW_PHYS);
+    }
+  }
+
+  /// the scratch directory of the test, created on first use
+  const std::string& scratch() {
+    if (dir.empty()) {
+      const auto* test = testing::UnitTest::GetInstance()->current_test_info();
+      dir = "/tmp/denoiser-" + std::string(test->name()) + "-" + std::to_string(getpid());
+      if (0 != mkdir(dir.c_str(), 0700)) {
+        throw std::runtime_error(dir + ": " + strerror(errno));
+      }
+    }
+    return dir;
+  }
+
+  /// the path of a file in the scratch directory
+  std::string path(const std::string& name) {
+    return scratch() + "/" + name;
+  }
+
+  /// the URL of a file in the scratch directory
+  std::string url(const std::string& name) {
+    return "file://" + path(name);
+  }
+
+  /**
+   * writes a file into the scratch directory
+   * \return the URL of the file
+  */
+  std::string write(const std::string& name, const std::string& content) {
+    std::ofstream os(path(name));
+    os << content;
+    return url(name);
+  }
+
+  /**
+   * the configuration of a run in the scratch directory
+   * \param target the name of the target, none if empty
+   * \param references the names of the references
+   * \param extra the other entries of the configuration
+  */
+  std::string yaml(const std::string& target,
+                   const std::vector<std::string>& references,
+                   const std::string& extra = "") {
+    std::string yaml = extra;
+    if (not target.empty()) {
+      yaml += "target: " + url(target) + "\n";
+    }
+    yaml += "reference: [ ";
+    for (size_t i = 0; i < references.size(); ++i) {
+      yaml += (i ? ", " : "") + url(references[i]);
+    }
+    return yaml + " ]\n";
+  }
+
+  /// the same configuration, parsed
+  configuration<wchar_t> config(const std::string& target,
+                                const std::vector<std::string>& references,
+                                const std::string& extra = "") {
+    std::stringstream is(yaml(target, references, extra));
+    return configuration<wchar_t>::read(is);
+  }
+
+private:
+  std::string dir;
 };
 
+// the tests below need a scratch directory as well
+using ServerTest = ArtifactDenoiserTest;
+using FollowTest = ArtifactDenoiserTest;
+
 class DataDrivenTest : public ::testing::Test, public ::testing::WithParamInterface<const char*> {
 public:
   explicit DataDrivenTest(const std::string& path) : path(path) {}
@@ -189,6 +381,88 @@ TEST_F(ArtifactDenoiserTest, large) {
   ASSERT_EQ(x.size(), 133634);
 }
 
+TEST_F(ArtifactDenoiserTest, line_reader) {
+  // a leading endline is a line of its own, the other empty lines are not
+  write("empty.log", "\nl2\n\n\r\nl3\nl4");
+  for (const auto& url : {std::string("file://test/ddt/01/target.log"), this->url("empty.log")}) {
+    const auto file = artifact::wfile::fetch(url);
+    std::vector<std::pair<size_t, std::wstring>> lines;
+    const auto count = artifact::read_lines<wchar_t>(url, [&](auto& line){
+      lines.emplace_back(line.number(), std::wstring(line.str()));
+    });
+    ASSERT_EQ(count, file.size());
+    ASSERT_EQ(lines.size(), file.size());
+    for (size_t i = 0; i < file.size(); ++i) {
+      ASSERT_EQ(lines[i].first, file.at(i).number());
+      ASSERT_EQ(lines[i].second, file.at(i).str());
+    }
+  }
+  ASSERT_EQ(artifact::wfile::fetch(url("empty.log")).size(), 4);
+}
+
+TEST_F(ArtifactDenoiserTest, part) {
+  const auto filename = "/tmp/denoiser-part-" + std::to_string(getpid()) + ".log";
+  const std::string content = "l1\nl2\n\nl3 caf\xc3\xa9\nl4\r\nl5\n";
+  {
+    std::ofstream os(filename);
+    os << content;
+  }
+  using lines_t = std::vector<std::pair<size_t, std::wstring>>;
+  const auto lines = [](const artifact::wfile& file){
+    lines_t result;
+    for (const auto& line : file) {
+      result.emplace_back(line.number(), line.str());
+    }
+    return result;
+  };
+
+  // the lines of a local file keep their numbers
+  const auto local = [&](const std::string& fragment){
+    return lines(artifact::wfile::fetch("file://" + filename + fragment));
+  };
+  ASSERT_EQ(local("#bytes=3-"), (lines_t{{2, L"l2"}, {3, L"l3 café"}, {4, L"l4"}, {5, L"l5"}}));
+  ASSERT_EQ(local("#bytes=4-16"), (lines_t{{3, L"l3 café"}, {4, L"l"}}));
+  ASSERT_EQ(local("#bytes=0-3"), (lines_t{{1, L"l1"}, {2, L"l"}}));
+  ASSERT_EQ(local("#bytes=5-8"), (lines_t{{3, L"l3"}}));
+  ASSERT_EQ(local("#bytes=-3"), (lines_t{{5, L"l5"}}));
+  ASSERT_EQ(local("#bytes=-4"), (lines_t{{5, L"l5"}}));
+  ASSERT_EQ(local("#lines=-2"), (lines_t{{4, L"l4"}, {5, L"l5"}}));
+  ASSERT_EQ(local("#lines=-9"), local(""));
+  ASSERT_THROW(local("#lines=2-"), std::runtime_error);
+  ASSERT_THROW(local("#bytes=5-4"), std::runtime_error);
+
+  // the lines of a remote resource are numbered from the beginning of the part
+  for (const bool ranges : {true, false}) {
+    const http_stand_in server(content, ranges);
+    const auto remote = [&](const std::string& fragment){
+      return lines(artifact::wfile::fetch(server.url(fragment)));
+    };
+    ASSERT_EQ(remote("#bytes=3-"), (lines_t{{1, L"l2"}, {2, L"l3 café"}, {3, L"l4"}, {4, L"l5"}}));
+    ASSERT_EQ(remote("#bytes=4-16"), (lines_t{{1, L"l3 café"}, {2, L"l"}}));
+    ASSERT_EQ(remote("#bytes=0-3"), (lines_t{{1, L"l1"}, {2, L"l"}}));
+    ASSERT_EQ(remote("#bytes=5-8"), (lines_t{{1, L"l3"}}));
+    ASSERT_EQ(remote("#bytes=-4"), (lines_t{{1, L"l5"}}));
+    ASSERT_EQ(remote("#lines=-2"), (lines_t{{1, L"l4"}, {2, L"l5"}}));
+    ASSERT_EQ(remote("#lines=-9"), local(""));
+  }
+
+  unlink(filename.c_str());
+}
+
+TEST_F(ArtifactDenoiserTest, place) {
+  const auto expected = artifact::wfile::load("test/ddt/01/target.log");
+  auto file = artifact::wfile::load("test/ddt/01/target.log");
+  thread_pool pool(3);
+  file.place([&pool](auto& lines, const auto& lambda){
+    pool.for_each(lines, 2, lambda);
+  });
+  ASSERT_EQ(file.size(), expected.size());
+  for (size_t i = 0; i < file.size(); ++i) {
+    ASSERT_EQ(file.at(i).str(), expected.at(i).str());
+    ASSERT_EQ(file.at(i).mut(), expected.at(i).mut());
+  }
+}
+
 TEST_F(ArtifactDenoiserTest, load_config_missing) {
   ASSERT_THROW(configuration<wchar_t>::load("nope.yaml"), std::runtime_error);
 }
@@ -281,6 +555,566 @@ TEST_F(ArtifactDenoiserTest, line_suppress_string) {
   ASSERT_EQ(line.mut().size(), 0);
 }
 
+TEST_F(ArtifactDenoiserTest, ordered_output) {
+  std::ostringstream target, ref;
+  for (int i = 0; i < 25000; ++i) {
+    target << "line " << i << "\n";
+    if (i % 3) ref << "line " << i << "\n";
+  }
+  write("target.log", target.str());
+  write("ref.log", ref.str());
+  const auto config = this->config("target.log", {"ref.log"});
+  denoiser<wchar_t> denoiser(config);
+  std::vector<size_t> result;
+  denoiser.run([&result](const artifact::wline& line){
+    result.push_back(line.number());
+  });
+  ASSERT_EQ(result.size(), 8334);
+  for (size_t i = 0; i < result.size(); ++i) {
+    ASSERT_EQ(result[i], i * 3 + 1);
+  }
+}
+
+TEST_F(ArtifactDenoiserTest, collapsed_output) {
+  write("target.log", "retry 1\nboom\nretry 2\nretry 3\nboom\nok\n");
+  write("ref.log", "ok\n");
+  const auto config = this->config("target.log", {"ref.log"}, "normalizers: [ r: '\\d+' ]\n");
+  denoiser<wchar_t> denoiser(config);
+  std::vector<std::pair<size_t, size_t>> result;
+  denoiser.run_collapsed([&result](const artifact::wline& line, size_t count){
+    result.emplace_back(line.number(), count);
+  });
+  const std::vector<std::pair<size_t, size_t>> expected = {{1, 3}, {2, 2}};
+  ASSERT_EQ(result, expected);
+}
+
+TEST_F(ArtifactDenoiserTest, limit) {
+  std::ostringstream target, ref;
+  for (int i = 0; i < 25000; ++i) {
+    target << "line " << i << "\n";
+    if (i % 3) ref << "line " << i << "\n";
+  }
+  write("target.log", target.str());
+  write("ref.log", ref.str());
+  write("all.log", target.str());
+  for (const char* reference : {"ref.log", "all.log"}) {
+    const auto config = this->config("target.log", {reference});
+    denoiser<wchar_t> denoiser(config);
+    denoiser.set_limit(5);
+    std::vector<size_t> result;
+    denoiser.run([&result](const artifact::wline& line){
+      result.push_back(line.number());
+    });
+    const std::vector<size_t> expected = std::string("ref.log") == reference
+      ? std::vector<size_t>{1, 4, 7, 10, 13}
+      : std::vector<size_t>{};
+    ASSERT_EQ(result, expected);
+  }
+}
+
+TEST_F(ArtifactDenoiserTest, collapsed_limit) {
+  write("target.log", "A\nA\nA\nA\nB\nC\nok\n");
+  write("ref.log", "ok\n");
+  const auto config = this->config("target.log", {"ref.log"});
+  denoiser<wchar_t> denoiser(config);
+  // the limit applies to the groups, every occurrence is still counted
+  denoiser.set_limit(2);
+  std::vector<std::pair<size_t, size_t>> result;
+  denoiser.run_collapsed([&result](const artifact::wline& line, size_t count){
+    result.emplace_back(line.number(), count);
+  });
+  const std::vector<std::pair<size_t, size_t>> expected = {{1, 4}, {5, 1}};
+  ASSERT_EQ(result, expected);
+}
+
+TEST_F(ArtifactDenoiserTest, batch) {
+  write("target1.log", "a\nb\nc\nd\n");
+  write("target2.log", "d\ne\na\n");
+  write("ref1.log", "a\nb\n");
+  write("ref2.log", "a\nd\n");
+  const auto config = this->config("", {"ref1.log", "ref2.log"},
+    "min_occurrences: 2\n"
+    "targets:\n"
+    " - { url: " + url("target1.log") + ", output: out1 }\n"
+    " - { url: " + url("missing.log") + ", output: out2 }\n"
+    " - { url: " + url("target2.log") + ", output: out3 }\n");
+  ASSERT_EQ(config.targets.size(), 3);
+  ASSERT_EQ(config.targets[2].output, "out3");
+  denoiser<wchar_t> denoiser(config);
+  std::vector<std::vector<size_t>> result(3);
+  std::mutex mutex;
+  ASSERT_THROW(denoiser.run_batch([&](size_t target, const artifact::wline& line){
+    std::lock_guard<std::mutex> lock(mutex);
+    result[target].push_back(line.number());
+  }), std::runtime_error);
+  ASSERT_EQ(result[0], std::vector<size_t>({2, 3, 4}));
+  ASSERT_EQ(result[1], std::vector<size_t>());
+  ASSERT_EQ(result[2], std::vector<size_t>({1, 2}));
+}
+
+TEST_F(ArtifactDenoiserTest, occurrences) {
+  // references of many batches each, ingested at the same time, "x" in every one of them
+  std::ostringstream ref1, ref2;
+  for (int i = 0; i < 200000; ++i) {
+    ref1 << (i % 500 ? "a " + std::to_string(i) : "x") << "\n";
+    ref2 << (i % 500 ? "b " + std::to_string(i) : "x") << "\n";
+  }
+  write("target.log", "novel\nx\n");
+  write("ref1.log", ref1.str());
+  write("ref2.log", ref2.str());
+  // enough workers for both references to be ingested at once, whatever the machine
+  thread_pool::set_max_threads(4);
+  for (const auto occurrences : {2, 3}) {
+    const auto config = this->config("target.log", {"ref1.log", "ref2.log"},
+                                      "min_occurrences: " + std::to_string(occurrences) + "\n");
+    denoiser<wchar_t> denoiser(config);
+    std::vector<size_t> result;
+    denoiser.run([&result](const artifact::wline& line){
+      result.push_back(line.number());
+    });
+    // a line counts once per reference it occurs in, however many times it does
+    EXPECT_EQ(result, 2 == occurrences ? std::vector<size_t>({1})
+                                       : std::vector<size_t>({1, 2}));
+  }
+  thread_pool::set_max_threads(0);
+}
+
+TEST_F(ArtifactDenoiserTest, persistent_corpus) {
+  write("target.log", "a\nb\nc\n");
+  write("ref1.log", "a\nb\nb\n");
+  write("ref2.log", "a\n");
+  const auto novel = [this](bool both){
+    const auto references = both
+      ? std::vector<std::string>{"ref1.log", "ref2.log"}
+      : std::vector<std::string>{"ref1.log"};
+    const auto config = this->config("target.log", references,
+                                     "min_occurrences: 2\ncorpus: " + path("corpus") + "\n");
+    denoiser<wchar_t> denoiser(config);
+    std::vector<size_t> result;
+    denoiser.run([&result](const artifact::wline& line){
+      result.push_back(line.number());
+    });
+    return result;
+  };
+  ASSERT_EQ(novel(true), std::vector<size_t>({2, 3}));  // from scratch
+  ASSERT_EQ(novel(true), std::vector<size_t>({2, 3}));  // from the corpus only
+  ASSERT_EQ(novel(false), std::vector<size_t>({1, 2, 3})); // ref2 expired
+}
+
+TEST_F(ArtifactDenoiserTest, failing_reference) {
+  write("target.log", "a\nb\n");
+  const auto config = this->config("target.log", {"missing.log"});
+  denoiser<wchar_t> denoiser(config);
+  size_t lines = 0;
+  ASSERT_THROW(denoiser.run([&lines](const artifact::wline&){ ++lines; }), std::runtime_error);
+  ASSERT_EQ(lines, 0);
+}
+
+TEST_F(ArtifactDenoiserTest, timeout) {
+  // a server that accepts the connection and never answers
+  const int server = socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_GE(server, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(address);
+  ASSERT_EQ(0, bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address)));
+  ASSERT_EQ(0, listen(server, 4));
+  ASSERT_EQ(0, getsockname(server, reinterpret_cast<sockaddr*>(&address), &length));
+
+  std::stringstream yaml;
+  yaml << "target: http://127.0.0.1:" << ntohs(address.sin_port) << "/target.log\n"
+       << "reference: [ http://127.0.0.1:" << ntohs(address.sin_port) << "/ref.log ]\n";
+  const auto config = configuration<wchar_t>::read(yaml);
+  denoiser<wchar_t> denoiser(config);
+  denoiser.set_timeout(std::chrono::milliseconds(300));
+
+  const auto start = std::chrono::steady_clock::now();
+  ASSERT_THROW(denoiser.run([](const artifact::wline&){}), cancelled_error);
+  ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(5));
+  close(server);
+}
+
+TEST_F(ServerTest, warm) {
+  write("target.log", "a 1\nb 2\nc 3\n");
+  write("ref.log", "b 5\n");
+  const auto yaml = this->yaml("target.log", {"ref.log"}, "normalizers: [ r: '\\d' ]\n");
+
+  server daemon(path("socket"));
+  std::thread thread([&daemon](){ daemon.run(); });
+
+  const auto request = [&](const std::string& body, const std::string& options){
+    const auto filename = path("output");
+    const int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    server::request(path("socket"), yaml, body, options, fd);
+    close(fd);
+    std::ifstream is(filename);
+    return std::string((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+  };
+
+  EXPECT_EQ(request("", ""), "1 a 1\n3 c 3\n");
+  // the references are not needed anymore
+  unlink(path("ref.log").c_str());
+  EXPECT_EQ(request("", "no-lines"), "a 1\nc 3\n");
+  EXPECT_EQ(request("b 7\nd 8\nd 9\n", "collapse"), "2 [x2] d 8\n");
+  unlink(path("target.log").c_str());
+  EXPECT_THROW(request("", ""), std::runtime_error);
+
+  daemon.stop();
+  thread.join();
+}
+
+TEST_F(ServerTest, evict) {
+  write("target.log", "a 1\nb 2\n");
+  write("ref.log", "b 5\n");
+
+  server daemon(path("socket"));
+  std::thread thread([&daemon](){ daemon.run(); });
+
+  const auto request = [&](size_t i){
+    // a distinct configuration each time, more than the server keeps
+    const auto yaml = this->yaml("target.log", {"ref.log"},
+                                 "normalizers: [ r: '\\d|z{" + std::to_string(i + 1) + "}' ]\n");
+    const auto filename = path("output");
+    const int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    server::request(path("socket"), yaml, "", "", fd);
+    close(fd);
+    std::ifstream is(filename);
+    return std::string((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+  };
+
+  for (size_t i = 0; i < 12; ++i) {
+    EXPECT_EQ(request(i), "1 a 1\n");
+  }
+  // the most recent ones are still there, the first ones must be ingested again
+  unlink(path("ref.log").c_str());
+  EXPECT_EQ(request(11), "1 a 1\n");
+  EXPECT_EQ(request(5), "1 a 1\n");
+  EXPECT_THROW(request(0), std::runtime_error);
+
+  daemon.stop();
+  thread.join();
+}
+
+TEST_F(ServerTest, quiet) {
+  write("target.log", "a 1\nb 2\nc 3\n");
+  write("ref.log", "b 5\n");
+  const auto yaml = this->yaml("target.log", {"ref.log"}, "normalizers: [ r: '\\d' ]\n");
+
+  server daemon(path("socket"));
+  std::thread thread([&daemon](){ daemon.run(); });
+
+  // only the lines are counted, nothing is written
+  EXPECT_EQ(server::request(path("socket"), yaml, "", "", -1), 2);
+  EXPECT_EQ(server::request(path("socket"), yaml, "", "max-lines=1", -1), 1);
+  EXPECT_EQ(server::request(path("socket"), yaml, "b 7\n", "max-lines=1", -1), 0);
+  EXPECT_EQ(server::request(path("socket"), yaml, "b 7\nd 8\nd 9\n", "collapse", -1), 1);
+
+  daemon.stop();
+  thread.join();
+}
+
+TEST_F(FollowTest, append) {
+  write("target.log", "a 1\nb 2\n");
+  write("ref.log", "b 5\n");
+  const auto config = this->config("target.log", {"ref.log"}, "normalizers: [ r: '\\d' ]\n");
+  denoiser<wchar_t> denoiser(config);
+  denoiser.set_limit(3);
+
+  std::thread writer([filename = path("target.log")](){
+    const int fd = open(filename.c_str(), O_WRONLY | O_APPEND);
+    for (const auto chunk : {"b 3\nc", " 4\nd caf\xc3", "\xa9\n", "e 5\n"}) {
+      std::this_thread::sleep_for(20ms);
+      ASSERT_EQ(ssize_t(strlen(chunk)), ::write(fd, chunk, strlen(chunk)));
+    }
+    close(fd);
+  });
+
+  follower target(config.target);
+  std::vector<std::pair<size_t, std::wstring>> result;
+  size_t idle = 0;
+  denoiser.follow(target, [&result](const artifact::wline& line){
+    result.emplace_back(line.number(), line.str());
+  }, [&idle](){
+    ++idle;
+  });
+  writer.join();
+
+  const std::vector<std::pair<size_t, std::wstring>> expected = {
+    {1, L"a 1"}, {4, L"c 4"}, {5, L"d café"}
+  };
+  ASSERT_EQ(result, expected);
+  ASSERT_GT(idle, 0);
+}
+
+TEST(EncodingTest, chunks) {
+  encoding::chunk_decoder<wchar_t> decoder(encoding::UTF8<wchar_t>);
+  std::vector<wchar_t> out;
+  const std::string text = "caf\xc3\xa9 \xe2\x82\xac!";
+  for (const auto c : text) {
+    decoder.feed(&c, 1, out);
+  }
+  ASSERT_EQ(std::wstring(out.begin(), out.end()), L"café €!");
+  out.clear();
+  decoder.feed("\xc3z", 2, out);
+  ASSERT_EQ(std::wstring(out.begin(), out.end()), L"z");
+  ASSERT_EQ(decoder.errors(), 1);
+}
+
+TEST(CancellationTest, deadline) {
+  cancellation token;
+  ASSERT_FALSE(token.cancelled());
+  ASSERT_NO_THROW(token.check());
+  token.expire_after(std::chrono::milliseconds(1));
+  std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  ASSERT_TRUE(token.cancelled());
+  ASSERT_THROW(token.check(), cancelled_error);
+}
+
+TEST(CancellationTest, reason) {
+  cancellation token;
+  token.cancel(std::make_exception_ptr(std::logic_error("first")));
+  token.cancel(std::make_exception_ptr(std::logic_error("second")));
+  try {
+    token.check();
+    FAIL();
+  } catch (const std::logic_error& ex) {
+    ASSERT_STREQ(ex.what(), "first");
+  }
+}
+
+TEST(OutputTest, bytes) {
+  const auto filename = "/tmp/denoiser-output-" + std::to_string(getpid());
+  for (const bool threaded : {false, true}) {
+    std::string expected;
+    {
+      const int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      ASSERT_GE(fd, 0);
+      output_writer out(fd, threaded);
+      for (size_t i = 0; i < 100000; ++i) {
+        out.number(i);
+        out.put(' ');
+        out.text(std::wstring_view(L"h\u00e9llo \u20ac \U0001F600"));
+        out.text(std::string_view(" x"));
+        out.put('\n');
+        expected += std::to_string(i) + " h\xc3\xa9llo \xe2\x82\xac \xf0\x9f\x98\x80 x\n";
+      }
+      out.number(std::numeric_limits<size_t>::max());
+      expected += std::to_string(std::numeric_limits<size_t>::max());
+      out.flush();
+      close(fd);
+    }
+    std::ifstream is(filename, std::ios::binary);
+    const std::string actual((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+    ASSERT_EQ(actual, expected);
+  }
+  unlink(filename.c_str());
+}
+
+TEST_F(ArtifactDenoiserTest, output) {
+  // accents, symbols, CJK and an emoji, on lines kept and on lines dropped
+  write("target.log", "caf\xc3\xa9 1\n\xe2\x82\xac 2\n\xe6\x97\xa5\xe6\x9c\xac 3\n"
+                      "\xf0\x9f\x98\x80 4\nna\xc3\xafve 5\n\xe2\x82\xac 6\n");
+  write("ref.log", "\xe6\x97\xa5\xe6\x9c\xac 7\nna\xc3\xafve 8\n");
+  const auto config = this->config("target.log", {"ref.log"}, "normalizers: [ r: '\\d' ]\n");
+
+  const auto output = [&](bool threaded, bool collapse){
+    const auto filename = path("output");
+    {
+      const int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      output_writer out(fd, threaded);
+      denoiser<wchar_t> denoiser(config);
+      if (collapse) {
+        denoiser.run_collapsed([&out](const artifact::wline& line, size_t count){
+          out.line(line.number(), line.str(), count);
+        });
+      } else {
+        denoiser.run([&out](const artifact::wline& line){
+          out.line(line.number(), line.str());
+        });
+      }
+      out.flush();
+      close(fd);
+    }
+    std::ifstream is(filename, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+  };
+
+  // every byte of the lines kept, and nothing is lost after the first non ASCII one
+  for (const bool threaded : {false, true}) {
+    EXPECT_EQ(output(threaded, false),
+              "1 caf\xc3\xa9 1\n2 \xe2\x82\xac 2\n4 \xf0\x9f\x98\x80 4\n6 \xe2\x82\xac 6\n");
+    EXPECT_EQ(output(threaded, true),
+              "1 [x1] caf\xc3\xa9 1\n2 [x2] \xe2\x82\xac 2\n4 [x1] \xf0\x9f\x98\x80 4\n");
+  }
+}
+
+TEST(CorpusTest, count) {
+  corpus bucket;
+  bucket.append("a", {1, 2, 3});
+  bucket.append("b", {2, 3});
+  bucket.insert({3});
+  ASSERT_EQ(bucket.count(1), 1);
+  ASSERT_EQ(bucket.count(2), 2);
+  ASSERT_EQ(bucket.count(3), 3);
+  ASSERT_EQ(bucket.count(4), 0);
+  ASSERT_TRUE(bucket.expire("a"));
+  ASSERT_FALSE(bucket.expire("a"));
+  ASSERT_EQ(bucket.count(1), 0);
+  ASSERT_EQ(bucket.count(2), 1);
+  ASSERT_EQ(bucket.size(), 2);
+}
+
+TEST(CorpusTest, distinct) {
+  std::vector<corpus::hash_t> hashes = {3, 1, 3, 2, 1};
+  corpus::distinct(hashes);
+  ASSERT_EQ(hashes, std::vector<corpus::hash_t>({1, 2, 3}));
+}
+
+TEST(CorpusTest, persistence) {
+  const auto filename = "/tmp/denoiser-corpus-" + std::to_string(getpid());
+  {
+    corpus bucket(42);
+    bucket.append("a", {1, 2});
+    bucket.append("b", {2});
+    bucket.save(filename);
+  }
+  {
+    auto bucket = corpus::load(filename, 42);
+    ASSERT_EQ(bucket.references(), std::vector<std::string>({"a", "b"}));
+    ASSERT_EQ(bucket.count(2), 2);
+    bucket.expire("b");
+    ASSERT_EQ(bucket.count(2), 1);
+  }
+  {
+    const auto bucket = corpus::load(filename, 43);
+    ASSERT_EQ(bucket.size(), 0);
+  }
+  unlink(filename.c_str());
+}
+
+// the size of each file in the directory, removing them if asked to
+static std::vector<size_t> sizes_in(const std::string& directory, bool remove = false) {
+  std::vector<size_t> sizes;
+  if (DIR* dir = opendir(directory.c_str())) {
+    for (const dirent* ent; (ent = readdir(dir)); ) {
+      const auto path = directory + "/" + ent->d_name;
+      struct stat info;
+      if (0 == stat(path.c_str(), &info) and S_ISREG(info.st_mode)) {
+        sizes.push_back(info.st_size);
+        if (remove) {
+          unlink(path.c_str());
+        }
+      }
+    }
+    closedir(dir);
+  }
+  if (remove) {
+    rmdir(directory.c_str());
+  }
+  return sizes;
+}
+
+static std::vector<std::wstring> cached_lines(const std::string& url, artifact::cache& store) {
+  std::vector<std::wstring> lines;
+  artifact::read_lines<wchar_t>(url, [&lines](auto& line){
+    lines.emplace_back(line.str());
+  }, cancellation::none(), &store);
+  return lines;
+}
+
+TEST(CacheTest, revalidate) {
+  const auto directory = "/tmp/denoiser-cache-" + std::to_string(getpid());
+  {
+    const std::string content = "l1\nl2 caf\xc3\xa9\n";
+    artifact::cache store(directory, 1 << 20);
+    http_stand_in server(content, true);
+    const auto url = server.url("");
+
+    const std::vector<std::wstring> expected = {L"l1", L"l2 café"};
+    ASSERT_EQ(cached_lines(url, store), expected);
+    ASSERT_EQ(server.served(), std::make_pair(size_t(1), content.size()));
+    ASSERT_EQ(sizes_in(directory).size(), 1);
+
+    // not modified, nothing but the headers is transferred
+    ASSERT_EQ(cached_lines(url, store), expected);
+    ASSERT_EQ(server.served(), std::make_pair(size_t(2), content.size()));
+    ASSERT_EQ(artifact::size_of(url, cancellation::none(), &store), content.size());
+    ASSERT_EQ(server.served().first, 2);
+
+    // parts are never cached
+    ASSERT_EQ(cached_lines(server.url("#bytes=3-"), store), std::vector<std::wstring>({L"l2 café"}));
+    ASSERT_EQ(sizes_in(directory).size(), 1);
+
+    server.update("l3\n");
+    ASSERT_EQ(cached_lines(url, store), std::vector<std::wstring>({L"l3"}));
+    ASSERT_EQ(cached_lines(url, store), std::vector<std::wstring>({L"l3"}));
+    ASSERT_EQ(server.served(), std::make_pair(size_t(5), content.size() + 10 + 3));
+  }
+  sizes_in(directory, true);
+}
+
+TEST(CacheTest, corrupted) {
+  const auto directory = "/tmp/denoiser-cache-" + std::to_string(getpid());
+  {
+    const std::string content = std::string(4096, 'x') + "\nl2\n";
+    artifact::cache store(directory, 1 << 20);
+    http_stand_in server(content, true);
+    const auto url = server.url("");
+
+    const std::vector<std::wstring> expected = {std::wstring(4096, L'x'), L"l2"};
+    ASSERT_EQ(cached_lines(url, store), expected);
+    ASSERT_EQ(sizes_in(directory).size(), 1);
+
+    // cuts the gzip trailer off the only entry
+    DIR* dir = opendir(directory.c_str());
+    for (const dirent* ent; (ent = readdir(dir)); ) {
+      const auto path = directory + "/" + ent->d_name;
+      struct stat info;
+      if (0 == stat(path.c_str(), &info) and S_ISREG(info.st_mode)) {
+        ASSERT_EQ(0, truncate(path.c_str(), info.st_size - 4));
+      }
+    }
+    closedir(dir);
+
+    // the copy is not used, nothing of it reaches the consumer, and it is downloaded again
+    ASSERT_EQ(cached_lines(url, store), expected);
+    ASSERT_EQ(server.served(), std::make_pair(size_t(3), 2 * content.size()));
+    ASSERT_EQ(cached_lines(url, store), expected);
+    ASSERT_EQ(server.served(), std::make_pair(size_t(4), 2 * content.size()));
+  }
+  sizes_in(directory, true);
+}
+
+TEST(CacheTest, evict) {
+  const auto directory = "/tmp/denoiser-cache-" + std::to_string(getpid());
+  {
+    http_stand_in server(std::string(4096, 'x') + "\n", true);
+    const auto pause = [](){
+      std::this_thread::sleep_for(std::chrono::milliseconds(20)); // coarse timestamps
+    };
+
+    artifact::cache measure(directory, 1 << 20);
+    cached_lines(server.url("?1"), measure);
+    const auto size = sizes_in(directory).at(0);
+
+    // room for two entries only
+    artifact::cache store(directory, 2 * size + size / 2);
+    pause();
+    cached_lines(server.url("?2"), store);
+    pause();
+    cached_lines(server.url("?1"), store); // the least recently used is ?2 now
+    pause();
+    cached_lines(server.url("?3"), store);
+
+    ASSERT_TRUE(store.lookup(server.url("?1")));
+    ASSERT_FALSE(store.lookup(server.url("?2")));
+    ASSERT_TRUE(store.lookup(server.url("?3")));
+    ASSERT_EQ(sizes_in(directory).size(), 2);
+  }
+  sizes_in(directory, true);
+}
+
 TEST(ThreadPoolTest, single) {
   thread_pool pool(1);
   std::atomic_int x = 0;
@@ -335,6 +1169,459 @@ TEST(ThreadPoolTest, large) {
   }
 }
 
+TEST(ThreadPoolTest, nested) {
+  thread_pool pool(2);
+  std::atomic_int x = 0;
+  std::vector<thread_pool::id_t> jobs;
+  for (int i = 0; i < 8; ++i) {
+    jobs.emplace_back(pool.submit([&pool, &x](){
+      std::vector<thread_pool::id_t> inner;
+      for (int j = 0; j < 8; ++j) {
+        inner.emplace_back(pool.submit([&x](){
+          x += 1;
+        }));
+      }
+      pool.wait(inner); // waiting from a worker must not starve the pool
+    }));
+  }
+  pool.wait(jobs);
+  ASSERT_EQ(x, 64);
+}
+
+TEST(ThreadPoolTest, task) {
+  auto counter = std::make_shared<int>(0);
+  {
+    thread_pool::task small([counter](){ ++*counter; });
+    std::array<char, thread_pool::task::capacity * 2> padding{};
+    thread_pool::task large([counter, padding](){ *counter += 10 + padding[0]; });
+    ASSERT_EQ(counter.use_count(), 3);
+    thread_pool::task moved(std::move(small));
+    ASSERT_FALSE(small);
+    moved();
+    large = std::move(moved);
+    large();
+    ASSERT_EQ(counter.use_count(), 2);
+  }
+  ASSERT_EQ(*counter, 2);
+  ASSERT_EQ(counter.use_count(), 1);
+}
+
+TEST(ThreadPoolTest, group) {
+  thread_pool pool(3);
+  std::atomic_int x = 0;
+  thread_pool::latch group(1000);
+  for (int i = 0; i < 1000; ++i) {
+    pool.submit(group, [&x](){
+      x += 1;
+    });
+  }
+  pool.wait(group);
+  ASSERT_EQ(x, 1000);
+}
+
+TEST(ThreadPoolTest, lengthy) {
+  thread_pool pool(1);
+  std::atomic<bool> started = false, go = false;
+  thread_pool::latch busy(1), slow(1), quick(1);
+  pool.submit(busy, [&](){
+    started = true;
+    while (not go) {
+      std::this_thread::yield();
+    }
+  });
+  while (not started) {
+    std::this_thread::yield();
+  }
+  std::thread::id slow_thread, quick_thread;
+  pool.spawn(slow, [&slow_thread](){ slow_thread = std::this_thread::get_id(); });
+  pool.submit(quick, [&quick_thread](){ quick_thread = std::this_thread::get_id(); });
+  // the worker is busy, so waiting helps with the quick job but leaves the lengthy one alone
+  pool.wait(quick);
+  ASSERT_EQ(quick_thread, std::this_thread::get_id());
+  ASSERT_FALSE(slow.ready());
+  go = true;
+  pool.wait(slow);
+  pool.wait(busy);
+  ASSERT_NE(slow_thread, std::this_thread::get_id());
+}
+
+TEST(ThreadPoolTest, adaptive) {
+  thread_pool pool(4);
+  for (const size_t size : {0, 1, 5, 100447}) {
+    std::vector<int> v(size, 0);
+    pool.for_each(v, thread_pool::adaptive, [](int& x){
+      x += 1;
+    });
+    ASSERT_EQ(std::count(v.begin(), v.end(), 1), size);
+  }
+}
+
+TEST(ThreadPoolTest, numa) {
+  thread_pool::set_placement(thread_pool::numa);
+  thread_pool pool(4);
+  thread_pool::set_placement(thread_pool::floating);
+  ASSERT_GE(pool.nodes(), 1);
+  ASSERT_LE(pool.nodes(), pool.size());
+  for (const size_t batch_size : {size_t(7), thread_pool::adaptive}) {
+    std::vector<int> v(100447, 0);
+    pool.for_each(v, batch_size, [](int& x){
+      x += 1;
+    });
+    ASSERT_EQ(std::count(v.begin(), v.end(), 1), v.size());
+  }
+  // the first element goes to the first node and the last one to the last node, in order
+  ASSERT_EQ(pool.node_of(0, 1000), 0);
+  ASSERT_EQ(pool.node_of(999, 1000), pool.nodes() - 1);
+  for (size_t i = 1; i < 1000; ++i) {
+    ASSERT_LE(pool.node_of(i - 1, 1000), pool.node_of(i, 1000));
+  }
+}
+
+TEST(ThreadPoolTest, stats) {
+  {
+    thread_pool pool(2);
+    pool.wait(pool.submit([](){}));
+    ASSERT_FALSE(pool.instrumented());
+    ASSERT_EQ(pool.stats().jobs(), 0);
+  }
+  thread_pool::set_instrumented(true);
+  thread_pool pool(2);
+  thread_pool::set_instrumented(false);
+  ASSERT_TRUE(pool.instrumented());
+  thread_pool::latch group(100);
+  for (int i = 0; i < 100; ++i) {
+    pool.submit(group, [](){
+      std::this_thread::sleep_for(std::chrono::microseconds(50));
+    });
+  }
+  pool.wait(group);
+  const auto stats = pool.stats();
+  ASSERT_EQ(stats.jobs(), 100);
+  ASSERT_EQ(stats.workers.size(), 2);
+  ASSERT_GE(stats.run_total, 100 * 50000);
+  ASSERT_GE(stats.run_max, 50000);
+  ASSERT_GE(stats.depth_max, 1);
+  ASSERT_FALSE(stats.depth.empty());
+  std::ostringstream os;
+  stats.json(os);
+  ASSERT_EQ(os.str().front(), '{');
+  ASSERT_NE(os.str().find("\"jobs\":100,"), std::string::npos);
+}
+
+TEST(PipelineTest, order) {
+  thread_pool pool(4);
+  std::vector<int> out;
+  pipeline<int> p(pool, 8);
+  p.stage(p.parallel, [](int& x){ x *= 2; });
+  p.stage(p.serial, [&out](int& x){ out.push_back(x); });
+  for (int i = 0; i < 10000; ++i) {
+    p.push([i](int& x){ x = i; });
+  }
+  p.finish();
+  ASSERT_EQ(out.size(), 10000);
+  for (int i = 0; i < 10000; ++i) {
+    ASSERT_EQ(out[i], 2 * i);
+  }
+}
+
+TEST(PipelineTest, bounded) {
+  thread_pool pool(2);
+  std::atomic_int inside = 0;
+  int peak = 0;
+  pipeline<int> p(pool, 3);
+  p.stage(p.parallel, [&inside](int&){
+    ++inside;
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  });
+  p.stage(p.serial, [&inside](int&){ --inside; });
+  for (int i = 0; i < 200; ++i) {
+    p.push([&](int&){ peak = std::max(peak, inside.load()); });
+  }
+  p.finish();
+  ASSERT_LE(peak, 3);
+}
+
+TEST(PipelineTest, runner) {
+  // the only worker pushes into a full pipeline, it runs the stages itself but not the other
+  // lengthy job queued meanwhile
+  thread_pool pool(1);
+  std::atomic<int> order = 0;
+  int runner = 0, other = 0, sum = 0;
+  thread_pool::latch done(2);
+  pool.spawn(done, [&](){
+    pool.spawn(done, [&](){
+      other = ++order;
+    });
+    pipeline<int> p(pool, 2);
+    p.stage(p.parallel, [](int& i){ i *= 2; });
+    p.stage(p.serial, [&sum](int& i){ sum += i; });
+    for (int i = 0; i < 100; ++i) {
+      p.push([i](int& item){ item = i; });
+    }
+    p.finish();
+    runner = ++order;
+  });
+  done.wait();
+  ASSERT_EQ(sum, 9900);
+  ASSERT_EQ(runner, 1);
+  ASSERT_EQ(other, 2);
+}
+
+TEST(PipelineTest, error) {
+  thread_pool pool(2);
+  std::atomic_int after = 0;
+  pipeline<int> p(pool, 4);
+  p.stage(p.parallel, [](int& x){
+    if (x == 10) {
+      throw std::runtime_error("boom");
+    }
+  });
+  p.stage(p.serial, [&after](int& x){ after = x; });
+  for (int i = 0; i < 100; ++i) {
+    p.push([i](int& x){ x = i; });
+  }
+  ASSERT_THROW(p.finish(), std::runtime_error);
+  ASSERT_LT(after, 10);
+}
+
+TEST(ThreadPoolTest, cancelled) {
+  thread_pool pool(4);
+  for (const size_t batch_size : {size_t(10), thread_pool::adaptive}) {
+    cancellation token;
+    std::atomic<size_t> count = 0;
+    std::vector<int> v(100000, 0);
+    ASSERT_THROW(pool.for_each(v, batch_size, [&](int&){
+      if (++count == 1000) {
+        token.cancel();
+      }
+    }, token), cancelled_error);
+    ASSERT_LT(count, v.size());
+  }
+}
+
+TEST(PipelineTest, cancelled) {
+  thread_pool pool(2);
+  cancellation token;
+  pipeline<int> p(pool, 4, &token);
+  p.stage(p.parallel, [](int&){});
+  for (int i = 0; i < 10; ++i) {
+    p.push([i](int& x){ x = i; });
+  }
+  token.cancel();
+  ASSERT_THROW(p.push([](int& x){ x = 0; }), cancelled_error);
+  ASSERT_THROW(p.finish(), cancelled_error);
+}
+
+TEST(ProfileTest, spans) {
+  profiling::clear();
+  profiling::enable();
+  profile("outer", [](){
+    profiling::count("lines", 3);
+    profile("inner", [](){
+      profiling::count("hits", 1);
+      profiling::count("hits", 2);
+    });
+    // waited for without helping, so that a worker runs it
+    thread_pool pool(1);
+    std::promise<void> done;
+    pool.post([&done](){
+      profile("elsewhere", [](){});
+      done.set_value();
+    });
+    done.get_future().wait();
+  });
+  // a thread of its own is a run of its own, its spans outlive it
+  std::thread([](){
+    profile("apart", [](){});
+  }).join();
+  profiling::enable(false);
+  profile("unseen", [](){});
+  const auto spans = profiling::spans();
+  std::ostringstream os;
+  profiling::trace(os);
+  profiling::clear();
+
+  ASSERT_EQ(spans.size(), 4);
+  const auto& outer = spans[0];
+  const auto& inner = spans[1];
+  const auto& elsewhere = spans[2];
+  const auto& apart = spans[3];
+  ASSERT_EQ(outer.name, "outer");
+  ASSERT_EQ(outer.parent, 0);
+  ASSERT_EQ(outer.counted, 1);
+  ASSERT_STREQ(outer.counters[0].name, "lines");
+  ASSERT_EQ(outer.counters[0].value, 3);
+  ASSERT_EQ(inner.name, "inner");
+  ASSERT_EQ(inner.parent, outer.id);
+  ASSERT_EQ(inner.thread, outer.thread);
+  ASSERT_EQ(inner.counted, 1);
+  ASSERT_EQ(inner.counters[0].value, 3);
+  // no span open on its thread, it belongs to the one the job was submitted from
+  ASSERT_EQ(elsewhere.name, "elsewhere");
+  ASSERT_EQ(elsewhere.parent, outer.id);
+  ASSERT_NE(elsewhere.thread, outer.thread);
+  ASSERT_LE(inner.end, elsewhere.begin);
+  ASSERT_LE(elsewhere.end, outer.end);
+  ASSERT_EQ(apart.name, "apart");
+  ASSERT_EQ(apart.parent, 0);
+
+  const auto trace = os.str();
+  ASSERT_EQ(trace.front(), '{');
+  ASSERT_NE(trace.find("\"name\":\"inner\""), std::string::npos);
+  ASSERT_NE(trace.find("\"hits\":3"), std::string::npos);
+  ASSERT_NE(trace.find("\"critical\":true"), std::string::npos);
+  ASSERT_EQ(trace.find("unseen"), std::string::npos);
+  ASSERT_TRUE(profiling::spans().empty());
+}
+
+TEST(ProfileTest, runs) {
+  profiling::clear();
+  profiling::enable();
+  {
+    // two runs at once on one pool, as the requests of a server
+    thread_pool pool(2);
+    std::vector<std::thread> runs;
+    for (const auto name : {"first", "second"}) {
+      runs.emplace_back([&pool, name](){
+        profile(name, [&pool](){
+          thread_pool::latch group(4);
+          for (int i = 0; i < 4; ++i) {
+            pool.submit(group, [](){
+              profile("job", [](){
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+              });
+            });
+          }
+          pool.wait(group);
+        });
+      });
+    }
+    for (auto& run : runs) {
+      run.join();
+    }
+  }
+  profiling::enable(false);
+  const auto spans = profiling::spans();
+  profiling::clear();
+
+  ASSERT_EQ(spans.size(), 10);
+  std::map<uint64_t, std::string> runs;
+  for (const auto& span : spans) {
+    if (span.name != "job") {
+      ASSERT_EQ(span.parent, 0);
+      runs[span.id] = span.name;
+    }
+  }
+  std::map<std::string, size_t> jobs;
+  for (const auto& span : spans) {
+    if (span.name == "job") {
+      ASSERT_EQ(runs.count(span.parent), 1);
+      ++jobs[runs[span.parent]];
+    }
+  }
+  ASSERT_EQ(jobs, (std::map<std::string, size_t>{{"first", 4}, {"second", 4}}));
+}
+
+TEST(ProfileTest, counters) {
+  const perf_counters perf;
+  volatile uint64_t sum = 0;
+  for (int i = 0; i < 1000000; ++i) {
+    sum = sum + i;
+  }
+  const auto values = perf.read();
+  if (not perf.available()) {
+    // as in most VMs and containers, spans are recorded without events
+    ASSERT_NE(perf.error(), 0);
+    ASSERT_EQ(values, perf_counters::values_t{});
+  } else {
+    ASSERT_GT(values[perf_counters::instructions], 1000000);
+    ASSERT_GT(values[perf_counters::cycles], 0);
+  }
+
+  profiling::clear();
+  profiling::enable();
+  profiling::enable_counters();
+  std::thread([](){
+    profile("measured", [](){});
+  }).join();
+  profiling::enable_counters(false);
+  profiling::enable(false);
+  const auto spans = profiling::spans();
+  profiling::clear();
+  ASSERT_EQ(spans.size(), 1);
+  ASSERT_EQ(spans[0].measured, perf.available());
+}
+
+TEST(LoggingTest, threads) {
+  char path[] = "/tmp/denoiser-log-XXXXXX";
+  const int fd = mkstemp(path);
+  ASSERT_GE(fd, 0);
+  log::flush();
+  const int saved = dup(STDERR_FILENO);
+  dup2(fd, STDERR_FILENO);
+  const bool had = log::has(log::info);
+  log::enable(log::info);
+
+  // enough to fill the buffers of the threads a few times
+  static constexpr int threads = 4;
+  static constexpr int lines = 5000;
+  std::vector<std::thread> workers;
+  for (int t = 0; t < threads; ++t) {
+    workers.emplace_back([t](){
+      for (int i = 0; i < lines; ++i) {
+        log_info << "thread " << t << " line " << i << " of " << lines << ", " << 0.5 << ' ' << true;
+      }
+    });
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  const std::string spilled(1000, 's');
+  const std::string huge(100000, 'h');
+  log_info << "long " << spilled;
+  log_info << "huge " << huge;
+  log::flush();
+
+  if (not had) {
+    log::disable(log::info);
+  }
+  dup2(saved, STDERR_FILENO);
+  close(saved);
+  close(fd);
+
+  std::ifstream file(path);
+  std::map<int, int> next;
+  size_t count = 0;
+  bool long_seen = false;
+  bool huge_seen = false;
+  for (std::string line; std::getline(file, line); ++count) {
+    ASSERT_EQ(line.rfind("[INFO.] T", 0), 0) << line;
+    const auto bar = line.find(" | ");
+    ASSERT_NE(bar, std::string::npos);
+    const auto message = line.substr(bar + 3);
+    if (message.rfind("thread ", 0) == 0) {
+      int t = 0, i = 0;
+      ASSERT_EQ(sscanf(message.c_str(), "thread %d line %d", &t, &i), 2) << message;
+      // each thread's lines in order, none lost
+      ASSERT_EQ(next[t]++, i);
+      ASSERT_EQ(message, "thread " + std::to_string(t) + " line " + std::to_string(i) + " of " +
+                         std::to_string(lines) + ", 0.5 1");
+    } else if (message == "long " + spilled) {
+      long_seen = true;
+    } else if (message == "huge " + huge) {
+      huge_seen = true;
+    }
+  }
+  unlink(path);
+
+  ASSERT_EQ(count, threads * lines + 2);
+  ASSERT_TRUE(long_seen);
+  ASSERT_TRUE(huge_seen);
+  for (int t = 0; t < threads; ++t) {
+    ASSERT_EQ(next[t], lines);
+  }
+}
+
 bool register_data_driven_tests() {
   size_t count = 0;
   for (auto entry : directory("test/ddt")) {
@@ -1,84 +1,474 @@
 #include "thread-pool.hpp"
+#include "topology.hpp"
+#include "logging.hpp"
+#include "profile.hpp"
+
+#include <cstring>
+#include <cerrno>
+#include <ostream>
 
 size_t thread_pool::max_threads = 0;
+size_t thread_pool::fixed_batch_size = thread_pool::adaptive;
+thread_pool::placement_t thread_pool::placement = thread_pool::floating;
+bool thread_pool::instrument = false;
+
+// the pool the current thread works for, if any, and its index in there
+static thread_local const thread_pool* current_pool = nullptr;
+static thread_local size_t current_index = 0;
+
+static uint64_t steady_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static void raise(std::atomic<uint64_t>& max, uint64_t value) {
+  uint64_t current = max.load(std::memory_order_relaxed);
+  while (current < value and not max.compare_exchange_weak(current, value)) {}
+}
 
 thread_pool::thread_pool(size_t threads)
-  : workers(), stop(false), id_counter(0) {
-  unique_lock lock(mutex);
+  : pending(0), sleeping(0), waiting(0), id_counter(0), next(0), stop(false),
+    collect(instrument), started(steady_ns()), wait_total(0), wait_max(0), run_total(0),
+    run_max(0), contention(0), next_sample(0), depth_max(0) {
 
   if (0 == threads) {
     threads = max_threads ? max_threads : std::thread::hardware_concurrency();
   }
 
-  pool.reserve(threads);
-  for (size_t i = 0; i < threads; ++i ) {
-    pool.emplace_back([this](){ this->run(); });
+  const auto cpus = (floating == placement) ? std::vector<topology::cpu_t>() : topology::cpus();
+
+  // all the queues must exist before any worker tries to steal from them
+  workers.reserve(threads);
+  for (size_t i = 0; i < threads; ++i) {
+    workers.emplace_back(std::make_unique<worker_t>());
+    auto& worker = *workers.back();
+    if (not cpus.empty()) {
+      const auto& cpu = cpus[i % cpus.size()];
+      worker.cpu = cpu.id;
+      worker.node = (numa == placement) ? cpu.node : 0;
+    }
+    // the cpus are interleaved by node, so the nodes in use are always the first ones
+    if (node_workers.size() <= worker.node) {
+      node_workers.resize(worker.node + 1);
+    }
+    node_workers[worker.node].push_back(i);
   }
 
-  while (workers != threads) {
-    cond.wait(lock);
+  for (size_t i = 0; i < threads; ++i) {
+    workers[i]->thread = std::thread([this, i](){ this->run(i); });
   }
 }
 
 thread_pool::~thread_pool() {
-  unique_lock lock(mutex);
-  stop = true;
-  cond.notify_all();
-  while (workers != 0) {
-    cond.wait(lock);
+  {
+    const auto lock = guard(sleep_mutex);
+    stop = true;
+    sleep_cond.notify_all();
+  }
+
+  for (auto& worker : workers) {
+    worker->thread.join();
+  }
+}
+
+/**
+ * the queue the current thread pushes its jobs onto: workers use their own, the other threads
+ * spread the jobs around
+*/
+size_t thread_pool::home() {
+  return (current_pool == this) ? current_index : next++ % workers.size();
+}
+
+/**
+ * as above, restricted to the workers of the given node
+*/
+size_t thread_pool::home(size_t node) {
+  if (current_pool == this and workers[current_index]->node == node) {
+    return current_index;
+  }
+  const auto& local = node_workers[node];
+  return local[next++ % local.size()];
+}
+
+size_t thread_pool::node_of(size_t index, size_t size) const {
+  // as for_each_guided slices the range, in proportion to the workers of each node
+  for (size_t n = 0, before = 0; n < nodes(); ++n) {
+    before += node_workers[n].size();
+    if (index < size * before / workers.size()) {
+      return n;
+    }
+  }
+  return nodes() - 1;
+}
+
+void thread_pool::push(job_t&& job) {
+  push(std::move(job), home());
+}
+
+void thread_pool::push(job_t&& job, size_t index) {
+
+  if (collect) {
+    job.queued = now();
+  }
+
+  if (profiling::enabled()) {
+    job.span = profiling::current();
+  }
+
+  const size_t queued = ++pending;
+  {
+    auto& worker = *workers[index];
+    const auto lock = guard(worker.mutex);
+    worker.queue.push_back(std::move(job));
+  }
+
+  if (collect) {
+    sample(queued);
   }
 
-  for (auto& thread : pool) {
-    thread.join();
+  if (sleeping.load()) {
+    const auto lock = guard(sleep_mutex);
+    sleep_cond.notify_one();
   }
 }
 
-thread_pool::id_t thread_pool::submit(function_t&& func) {
-  unique_lock lock(mutex);
-  ++id_counter;
-  ids.insert(id_counter);
-  queue.emplace(id_counter, std::move(func));
-  cond.notify_all();
-  return id_counter;
+void thread_pool::wait(latch& group) {
+
+  job_t job;
+
+  const size_t index = home();
+
+  while (not group.ready() and acquire(index, job, true)) {
+    execute(job);
+  }
+
+  // nothing left to help with, the remaining jobs are running somewhere else
+  group.wait();
 }
 
 void thread_pool::wait(id_t id) {
-  unique_lock lock(mutex);
-  while (ids.count(id)) {
-    cond.wait(lock);
+
+  job_t job;
+
+  const size_t index = home();
+
+  while (not done(id)) {
+
+    if (acquire(index, job, true)) {
+      execute(job);
+      continue;
+    }
+
+    // nothing to help with, the job is running somewhere else
+    ++waiting;
+    {
+      auto lock = guard(done_mutex);
+      if (ids.count(id)) {
+        done_cond.wait(lock);
+      }
+    }
+    --waiting;
+  }
+}
+
+bool thread_pool::help() {
+  job_t job;
+  if (not acquire(home(), job, true)) {
+    return false;
+  }
+  execute(job);
+  return true;
+}
+
+bool thread_pool::done(id_t id) {
+  const auto lock = guard(done_mutex);
+  return 0 == ids.count(id);
+}
+
+/**
+ * takes the most recent job from the given worker queue, a thread helping while it waits
+ * leaves the lengthy ones to the idle workers
+*/
+bool thread_pool::pop(size_t index, job_t& job, bool helping) {
+  auto& worker = *workers[index];
+  const auto lock = guard(worker.mutex);
+  if (not worker.queue.take(job, true, helping)) {
+    return false;
+  }
+  --pending;
+  return true;
+}
+
+/**
+ * takes the oldest job from any queue but the one of the given worker, the queues of the
+ * workers on the same node first
+*/
+bool thread_pool::steal(size_t index, job_t& job, bool helping) {
+  const auto count = workers.size();
+  const auto node = workers[index]->node;
+  const size_t passes = (nodes() > 1) ? 2 : 1;
+  for (size_t pass = 0; pass < passes; ++pass) {
+    for (size_t i = 1; i <= count; ++i) {
+      const auto victim = (index + i) % count;
+      if (current_pool == this and victim == current_index) {
+        continue;
+      }
+      auto& worker = *workers[victim];
+      if ((worker.node == node) != (0 == pass)) {
+        continue;
+      }
+      const auto lock = guard(worker.mutex);
+      if (worker.queue.take(job, false, helping)) {
+        --pending;
+        if (collect) {
+          counters().steals.fetch_add(1, std::memory_order_relaxed);
+        }
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool thread_pool::acquire(size_t index, job_t& job, bool helping) {
+  return (current_pool == this and pop(index, job, helping)) or steal(index, job, helping);
+}
+
+void thread_pool::execute(job_t& job) {
+
+  const uint64_t start = collect ? now() : 0;
+
+  {
+    const profiling::adopt within(job.span);
+    job.func();
+    job.func.reset();
+  }
+
+  if (collect) {
+    account(job, start);
+  }
+
+  if (job.group) {
+    job.group->count_down();
+    return;
+  }
+
+  if (0 == job.id) {
+    return; // posted
+  }
+
+  const auto lock = guard(done_mutex);
+  ids.erase(job.id);
+  if (waiting.load()) {
+    done_cond.notify_all();
   }
 }
 
 /**
  * the workers loop
 */
-void thread_pool::run() {
-  unique_lock lock(mutex);
+void thread_pool::run(size_t index) {
 
-  ++workers;
-  cond.notify_all();
+  current_pool = this;
+  current_index = index;
 
-  while (not stop) {
+  const int cpu = workers[index]->cpu;
+  if (cpu >= 0 and not topology::pin(cpu)) {
+    log_warning << "cannot pin worker " << index << " to cpu " << cpu << ": " << strerror(errno);
+  }
+
+  profiling::attach("worker " + std::to_string(index));
+
+  job_t job;
 
-    while (not stop and queue.empty()) {
-      cond.wait(lock);
+  for (;;) {
+
+    if (acquire(index, job, false)) {
+      execute(job);
+      continue;
     }
 
-    while (not queue.empty()) {
-      const auto job = std::move(queue.front());
-      queue.pop();
-      lock.unlock();
-      job.func();
-      lock.lock();
-      ids.erase(job.id);
-      cond.notify_all();
+    auto lock = guard(sleep_mutex);
+
+    if (stop and 0 == pending.load()) {
+      break;
+    }
+
+    const uint64_t start = collect ? now() : 0;
+
+    ++sleeping;
+    while (not stop and 0 == pending.load()) {
+      sleep_cond.wait(lock);
+    }
+    --sleeping;
+
+    if (collect) {
+      counters().idle.fetch_add(now() - start, std::memory_order_relaxed);
     }
   }
+}
 
-  --workers;
-  cond.notify_all();
+/**
+ * locks the given mutex, counting the times it is found locked already
+*/
+thread_pool::unique_lock thread_pool::guard(std::mutex& mutex) {
+  if (not collect) {
+    return unique_lock(mutex);
+  }
+  unique_lock lock(mutex, std::try_to_lock);
+  if (not lock.owns_lock()) {
+    contention.fetch_add(1, std::memory_order_relaxed);
+    lock.lock();
+  }
+  return lock;
+}
+
+/**
+ * the statistics of the current thread: workers have their own, the other threads share theirs
+*/
+thread_pool::counters_t& thread_pool::counters() {
+  return (current_pool == this) ? workers[current_index]->counters : others;
+}
+
+/**
+ * records the number of queued jobs, unless another sample was taken recently
+*/
+void thread_pool::sample(size_t queued) {
+  raise(depth_max, queued);
+  const uint64_t t = now();
+  uint64_t next = next_sample.load(std::memory_order_relaxed);
+  if (t < next or not next_sample.compare_exchange_strong(next, t + sample_interval)) {
+    return;
+  }
+  lock_guard lock(depth_mutex);
+  if (depth.size() < max_samples) {
+    depth.emplace_back(t, queued);
+  }
+}
+
+void thread_pool::account(const job_t& job, uint64_t start) {
+  const uint64_t end = now();
+  const uint64_t wait = start - job.queued;
+  const uint64_t busy = end - start;
+  auto& c = counters();
+  c.jobs.fetch_add(1, std::memory_order_relaxed);
+  c.busy.fetch_add(busy, std::memory_order_relaxed);
+  wait_total.fetch_add(wait, std::memory_order_relaxed);
+  run_total.fetch_add(busy, std::memory_order_relaxed);
+  raise(wait_max, wait);
+  raise(run_max, busy);
+}
+
+/**
+ * the nanoseconds elapsed since the pool started
+*/
+uint64_t thread_pool::now() const {
+  return steady_ns() - started;
+}
+
+thread_pool::stats_t thread_pool::stats() const {
+
+  const auto load = [](const counters_t& c){
+    stats_t::thread_t t;
+    t.jobs = c.jobs.load();
+    t.steals = c.steals.load();
+    t.busy = c.busy.load();
+    t.idle = c.idle.load();
+    return t;
+  };
+
+  stats_t s;
+  s.elapsed = now();
+  for (const auto& worker : workers) {
+    s.workers.push_back(load(worker->counters));
+  }
+  s.others = load(others);
+  s.wait_total = wait_total.load();
+  s.wait_max = wait_max.load();
+  s.run_total = run_total.load();
+  s.run_max = run_max.load();
+  s.contention = contention.load();
+  s.depth_max = depth_max.load();
+  {
+    lock_guard lock(depth_mutex);
+    s.depth = depth;
+  }
+  return s;
+}
+
+uint64_t thread_pool::stats_t::jobs() const {
+  uint64_t total = others.jobs;
+  for (const auto& w : workers) {
+    total += w.jobs;
+  }
+  return total;
+}
+
+void thread_pool::stats_t::log() const {
+
+  const auto ms = [](uint64_t ns){ return ns / 1e6; };
+  const auto us = [](uint64_t ns){ return ns / 1e3; };
+  const auto count = jobs();
+
+  log_profile << "pool: " << count << " jobs in " << ms(elapsed) << "ms, "
+              << contention << " contended locks, at most " << depth_max << " jobs queued";
+  if (count) {
+    log_profile << "pool: wait " << us(wait_total / count) << "us avg " << us(wait_max) << "us max, "
+                << "run " << us(run_total / count) << "us avg " << us(run_max) << "us max";
+  }
+  for (size_t i = 0; i < workers.size(); ++i) {
+    const auto& w = workers[i];
+    log_profile << "pool: worker " << i << ": " << w.jobs << " jobs, " << w.steals << " stolen, "
+                << (elapsed ? 100.0 * w.busy / elapsed : 0) << "% busy, "
+                << (elapsed ? 100.0 * w.idle / elapsed : 0) << "% idle";
+  }
+  log_profile << "pool: other threads: " << others.jobs << " jobs, " << others.steals << " stolen, "
+              << ms(others.busy) << "ms busy";
+}
+
+void thread_pool::stats_t::json(std::ostream& os) const {
+
+  const auto thread = [&os](const thread_t& t){
+    os << "{\"jobs\":" << t.jobs << ",\"steals\":" << t.steals
+       << ",\"busy_ns\":" << t.busy << ",\"idle_ns\":" << t.idle << "}";
+  };
+
+  os << "{\"elapsed_ns\":" << elapsed
+     << ",\"jobs\":" << jobs()
+     << ",\"wait_ns\":{\"total\":" << wait_total << ",\"max\":" << wait_max << "}"
+     << ",\"run_ns\":{\"total\":" << run_total << ",\"max\":" << run_max << "}"
+     << ",\"contention\":" << contention
+     << ",\"workers\":[";
+  for (size_t i = 0; i < workers.size(); ++i) {
+    if (i) {
+      os << ",";
+    }
+    thread(workers[i]);
+  }
+  os << "],\"others\":";
+  thread(others);
+  os << ",\"depth\":{\"max\":" << depth_max << ",\"samples\":[";
+  for (size_t i = 0; i < depth.size(); ++i) {
+    if (i) {
+      os << ",";
+    }
+    os << "[" << depth[i].first << "," << depth[i].second << "]";
+  }
+  os << "]}}";
+}
+
+void thread_pool::set_instrumented(bool enabled) {
+  instrument = enabled;
 }
 
 void thread_pool::set_max_threads(size_t t) {
   max_threads = t;
 }
+
+void thread_pool::set_batch_size(size_t size) {
+  fixed_batch_size = size;
+}
+
+void thread_pool::set_placement(placement_t p) {
+  placement = p;
+}
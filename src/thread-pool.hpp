@@ -1,15 +1,30 @@
 #pragma once
 
 #include <thread>
+#include <chrono>
+#include <algorithm>
 #include <mutex>
 #include <condition_variable>
 #include <functional>
+#include <atomic>
+#include <memory>
 #include <vector>
-#include <queue>
 #include <unordered_set>
+#include <type_traits>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+
+#include "cancellation.hpp"
 
 /**
- * \brief A simple thread pool
+ * \brief A work stealing thread pool
+ * Each worker owns a queue of jobs: it pops the most recent ones from its own queue and, when
+ * that is empty, steals the oldest ones from the queues of the other workers. Idle workers
+ * sleep and are woken up one at a time as jobs are submitted.
+ * Optionally the workers are pinned to CPUs and grouped by NUMA node: they steal from the
+ * workers of their own node first, and for_each hands each node a contiguous slice of the range.
 */
 class thread_pool final {
 public:
@@ -19,6 +34,170 @@ public:
   // jobs can be referenced using their ID
   using id_t = uint64_t;
 
+  // how the workers are placed on the CPUs
+  enum placement_t {
+    floating, // the scheduler moves them around freely
+    pinned,   // each one bound to a CPU
+    numa      // as above, and the work split by NUMA node
+  };
+
+  /**
+   * \brief A move-only type erased callable, stored inline when small enough (as the jobs
+   * created by for_each are) and on the heap otherwise
+  */
+  class task final {
+  public:
+
+    static constexpr size_t capacity = 64;
+
+    task() noexcept : invoke(nullptr), manage(nullptr) {}
+
+    template <typename Func, typename = typename std::enable_if<
+      not std::is_same<typename std::decay<Func>::type, task>::value>::type>
+    task(Func&& func) : task() {
+      using T = typename std::decay<Func>::type;
+      if constexpr (sizeof(T) <= capacity and
+                    alignof(T) <= alignof(storage_t) and
+                    std::is_nothrow_move_constructible<T>::value) {
+        new (&storage) T(std::forward<Func>(func));
+        invoke = [](void* ptr){ (*static_cast<T*>(ptr))(); };
+        manage = [](void* dst, void* src){
+          if (dst) {
+            new (dst) T(std::move(*static_cast<T*>(src)));
+          }
+          static_cast<T*>(src)->~T();
+        };
+      } else {
+        new (&storage) T*(new T(std::forward<Func>(func)));
+        invoke = [](void* ptr){ (**static_cast<T**>(ptr))(); };
+        manage = [](void* dst, void* src){
+          if (dst) {
+            new (dst) T*(*static_cast<T**>(src));
+          } else {
+            delete *static_cast<T**>(src);
+          }
+        };
+      }
+    }
+
+    task(task&& other) noexcept : task() {
+      (*this) = std::move(other);
+    }
+
+    task& operator = (task&& other) noexcept {
+      if (this != &other) {
+        reset();
+        if (other.manage) {
+          other.manage(&storage, &other.storage);
+        }
+        invoke = other.invoke;
+        manage = other.manage;
+        other.invoke = nullptr;
+        other.manage = nullptr;
+      }
+      return *this;
+    }
+
+    ~task() {
+      reset();
+    }
+
+    inline void operator () () {
+      invoke(&storage);
+    }
+
+    inline explicit operator bool() const noexcept {
+      return nullptr != invoke;
+    }
+
+    void reset() noexcept {
+      if (manage) {
+        manage(nullptr, &storage);
+      }
+      invoke = nullptr;
+      manage = nullptr;
+    }
+
+  private:
+    task(const task&) = delete;
+    task& operator = (const task&) = delete;
+    using storage_t = typename std::aligned_storage<capacity, alignof(std::max_align_t)>::type;
+    storage_t storage;
+    void (*invoke)(void*);
+    void (*manage)(void* dst, void* src); // moves src into dst, or destroys src if dst is null
+  };
+
+  /**
+   * \brief Tracks the completion of a group of jobs with a single atomic counter
+  */
+  class latch final {
+  public:
+    /// \param count the number of jobs in the group
+    explicit latch(size_t count) : count(count), done(0 == count) {}
+
+    /// marks one of the jobs as completed
+    inline void count_down() {
+      if (1 == count.fetch_sub(1)) {
+        lock_guard lock(mutex);
+        done = true;
+        cond.notify_all();
+      }
+    }
+
+    /// tells if all jobs completed, without synchronizing with the last one
+    inline bool ready() const {
+      return 0 == count.load();
+    }
+
+    /// blocks until all jobs completed
+    inline void wait() {
+      unique_lock lock(mutex);
+      while (not done) {
+        cond.wait(lock);
+      }
+    }
+
+  private:
+    latch(const latch&) = delete;
+    latch& operator = (const latch&) = delete;
+    std::atomic<size_t> count;
+    bool done;
+    std::mutex mutex;
+    std::condition_variable cond;
+  };
+
+  /**
+   * \brief A snapshot of the runtime statistics of a pool, collected only if the pool was
+   * created while instrumentation was enabled, see set_instrumented()
+  */
+  struct stats_t {
+    struct thread_t {
+      uint64_t jobs = 0;   // executed
+      uint64_t steals = 0; // jobs taken from the queue of another worker
+      uint64_t busy = 0;   // ns spent executing jobs
+      uint64_t idle = 0;   // ns spent sleeping, waiting for a job
+    };
+    uint64_t elapsed = 0;           // ns since the pool started
+    std::vector<thread_t> workers;
+    thread_t others;                // the threads helping while waiting
+    uint64_t wait_total = 0;        // ns spent by the jobs in the queues
+    uint64_t wait_max = 0;
+    uint64_t run_total = 0;         // ns spent running the jobs
+    uint64_t run_max = 0;
+    uint64_t contention = 0;        // the times a thread found a mutex of the pool locked
+    size_t depth_max = 0;           // the number of queued jobs...
+    std::vector<std::pair<uint64_t, size_t>> depth; // ...sampled at most once per ms
+
+    /// the total number of jobs executed
+    uint64_t jobs() const;
+
+    /// prints a summary via log_profile
+    void log() const;
+
+    /// writes the whole snapshot as a JSON object
+    void json(std::ostream& os) const;
+  };
+
   /**
    * c'tor, prepares and starts the thread pool
   */
@@ -30,14 +209,80 @@ public:
   ~thread_pool();
 
   /**
-   * schedule a job
+   * schedule a job, tracked by id: this takes a lock and a set insertion on both ends, the
+   * groups below are the way to go for anything on a hot path
    * \param func the opeation to execute
    * \return the id of the scheduled operation
   */
-  id_t submit(function_t&& func);
+  template <typename Func>
+  id_t submit(Func&& func) {
+    const id_t id = ++id_counter;
+    {
+      const auto lock = guard(done_mutex);
+      ids.insert(id);
+    }
+    push(job_t(id, nullptr, std::forward<Func>(func)));
+    return id;
+  }
 
   /**
-   * wait for job to complete
+   * schedule a job belonging to a group, no id is assigned to the job
+   * \param group the latch counting the jobs of the group, counted down once the job completes
+   * \param func the opeation to execute
+  */
+  template <typename Func>
+  void submit(latch& group, Func&& func) {
+    push(job_t(0, &group, std::forward<Func>(func)));
+  }
+
+  /**
+   * schedule a job of a group on the workers of the given node
+   * \param node the NUMA node, below nodes()
+   * \param group the latch counting the jobs of the group, counted down once the job completes
+   * \param func the opeation to execute
+  */
+  template <typename Func>
+  void submit(size_t node, latch& group, Func&& func) {
+    push(job_t(0, &group, std::forward<Func>(func)), home(node));
+  }
+
+  /**
+   * schedule a long running job of a group, as one blocking on I/O: only the idle workers pick
+   * it up, the threads waiting for other jobs never help with it, so they are not held up
+   * \param group the latch counting the jobs of the group, counted down once the job completes
+   * \param func the opeation to execute
+  */
+  template <typename Func>
+  void spawn(latch& group, Func&& func) {
+    job_t job(0, &group, std::forward<Func>(func));
+    job.lengthy = true;
+    push(std::move(job));
+  }
+
+  /**
+   * schedule a job nobody is going to wait for, no id is assigned to the job
+   * \param func the opeation to execute
+  */
+  template <typename Func>
+  void post(Func&& func) {
+    push(job_t(0, nullptr, std::forward<Func>(func)));
+  }
+
+  /**
+   * executes one of the pending jobs on the calling thread, if any, except the lengthy ones
+   * \return false if there was no job to execute
+  */
+  bool help();
+
+  /**
+   * wait for a group of jobs to complete, while waiting the calling thread helps executing
+   * the pending jobs
+   * \param group the latch counting the jobs of the group
+  */
+  void wait(latch& group);
+
+  /**
+   * wait for job to complete, while waiting the calling thread helps executing the pending jobs
    * \param id the job id
   */
   void wait(id_t id);
@@ -47,7 +292,8 @@ public:
    * \param cont a container holding a set of id_t
   */
   template <typename Container>
-  typename std::enable_if<not std::is_same<std::remove_cv<id_t>::type, Container>::value>::type
+  typename std::enable_if<not std::is_same<std::remove_cv<id_t>::type, Container>::value and
+                          not std::is_same<latch, Container>::value>::type
   wait(const Container& cont) {
     for (const id_t id : cont) {
       wait(id);
@@ -65,14 +311,20 @@ public:
     is_random_iterator<typename Cn::iterator>::value>
   {};
 
+  // asks for_each to size the batches by itself
+  static constexpr size_t adaptive = 0;
+
   /**
    * executes a given lamba function on each element of a range splitting the work across mulitple
    * worker threads.
    * \param begin the iterator to the first element
    * \param end the past-last iterator
-   * \param batch_size the number of elements to process per job
+   * \param batch_size the number of elements to process per job, or adaptive
    * \param lambda the operation to perform on the data
-   * \note each element is guaranteed to be processed only once but data access is not synchronized
+   * \param token once cancelled the elements not processed yet are skipped
+   * \throw the reason of the cancellation, if the token was cancelled
+   * \note each element is guaranteed to be processed at most once, and exactly once unless
+   * cancelled, but data access is not synchronized
    * \note the signature for lambda is void(element&)
   */
   template <typename Iterator, typename Lambda>
@@ -80,37 +332,97 @@ public:
   for_each(const Iterator& begin,
            const Iterator& end,
            size_t batch_size,
-           const Lambda& lambda) {
+           const Lambda& lambda,
+           const cancellation& token = cancellation::none()) {
+
+    if (adaptive == batch_size) {
+      batch_size = fixed_batch_size;
+    }
+
+    if (adaptive == batch_size) {
+      for_each_guided(begin, end, lambda, token);
+      token.check();
+      return;
+    }
 
     const auto size = std::distance(begin, end);
     const auto rest = size % batch_size;
     const auto runs = size / batch_size + (rest ? 1 : 0);
 
-    std::vector<thread_pool::id_t> jobs;
-    jobs.reserve(runs);
+    latch group(runs);
 
     for (size_t r = 0; r < runs; ++r) {
-      jobs.push_back(submit([&lambda, r, runs, batch_size, &begin, &end](){
+      submit(node_of(r * batch_size, size), group, [&lambda, r, runs, batch_size, &begin, &end, &token](){
+        if (token.cancelled()) {
+          return;
+        }
         auto it = std::next(begin, r * batch_size);
         const auto last = (r == runs - 1) ? end : std::next(it, batch_size);
         for(; it != last; ++it) {
           lambda(*it);
         }
-      }));
+      });
     }
 
-    wait(jobs);
+    wait(group);
+    token.check();
   }
 
   /// see for_each(begin, end...)
   template <typename Container, typename Lambda>
   typename std::enable_if<is_random_container<Container>::value, void>::type
-  for_each(Container& container, size_t batch_size, const Lambda& lambda) {
-    for_each(std::begin(container), std::end(container), batch_size, lambda);
+  for_each(Container& container,
+           size_t batch_size,
+           const Lambda& lambda,
+           const cancellation& token = cancellation::none()) {
+    for_each(std::begin(container), std::end(container), batch_size, lambda, token);
+  }
+
+  /// the number of worker threads
+  size_t size() const {
+    return workers.size();
+  }
+
+  /// the number of NUMA nodes the workers are spread on, 1 unless the placement is numa
+  size_t nodes() const {
+    return node_workers.size();
   }
 
+  /**
+   * the node whose workers for_each hands an element to, about the same whatever the batches
+   * \param index the position of the element in the range
+   * \param size the size of the range
+  */
+  size_t node_of(size_t index, size_t size) const;
+
+  /// tells if the pool collects runtime statistics
+  bool instrumented() const {
+    return collect;
+  }
+
+  /// the statistics collected so far, empty unless instrumented
+  stats_t stats() const;
+
+  /**
+   * enables the collection of runtime statistics in the pools created from now on, which
+   * otherwise costs a branch here and there
+  */
+  static void set_instrumented(bool enabled);
+
   static void set_max_threads(size_t);
 
+  /**
+   * sets the placement of the workers of the pools created from now on
+   * \param p the placement, pinning failures are logged and otherwise ignored
+  */
+  static void set_placement(placement_t p);
+
+  /**
+   * forces a fixed batch size on the for_each calls asking for an adaptive one
+   * \param size the batch size, or adaptive to restore the default behavior
+  */
+  static void set_batch_size(size_t size);
+
 private:
 
   using lock_guard = std::lock_guard<std::mutex>;
@@ -121,22 +433,248 @@ private:
   thread_pool& operator = (const thread_pool&) = delete;
   thread_pool& operator = (thread_pool&&) = delete;
 
-  void run();
+  void run(size_t index);
+
+  /**
+   * a slice of the range processed by for_each_guided, its elements are grabbed in chunks of
+   * about (last - first) / parts elements, but never less than grain
+  */
+  struct slice_t {
+    std::atomic<size_t> first;
+    size_t last;
+    size_t grain;
+    size_t parts;
+  };
+
+  template <typename Iterator, typename Lambda>
+  static void drain(slice_t& slice,
+                    const Iterator& begin,
+                    const Lambda& lambda,
+                    const cancellation& token) {
+    size_t first = slice.first.load();
+    for (;;) {
+      size_t count;
+      do {
+        if (first >= slice.last or token.cancelled()) {
+          return;
+        }
+        count = std::max(slice.grain, (slice.last - first) / slice.parts);
+      } while (not slice.first.compare_exchange_weak(first, first + count));
+      const auto last = std::min(slice.last, first + count);
+      for (auto it = std::next(begin, first); first < last; ++first, ++it) {
+        lambda(*it);
+      }
+      first = slice.first.load();
+    }
+  }
+
+  /**
+   * for_each with guided scheduling: the cost of an element is measured on the first few ones,
+   * then each job repeatedly grabs a share of the remaining elements, proportional to their
+   * number over the number of workers, but never less than what takes about grain_time to
+   * process. Small ranges are processed by the calling thread alone.
+   * Each node gets a contiguous slice proportional to its number of workers, whose jobs help
+   * the other nodes once done with their own slice.
+  */
+  template <typename Iterator, typename Lambda>
+  void for_each_guided(const Iterator& begin,
+                       const Iterator& end,
+                       const Lambda& lambda,
+                       const cancellation& token) {
+
+    const size_t size = std::distance(begin, end);
+    const size_t probe = std::min<size_t>(size, 16);
+
+    const auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < probe; ++i) {
+      lambda(*std::next(begin, i));
+    }
+    const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start);
+
+    const size_t cost = std::max<size_t>(1, elapsed.count() / std::max<size_t>(1, probe));
+    const size_t grain = std::max<size_t>(1, std::chrono::nanoseconds(grain_time).count() / cost);
+
+    if (size - probe <= grain) {
+      for (size_t i = probe; i < size; ++i) {
+        lambda(*std::next(begin, i));
+      }
+      return;
+    }
+
+    std::vector<slice_t> slices(nodes());
+    std::vector<size_t> jobs(nodes());
+
+    size_t total = 0;
+    for (size_t n = 0, first = probe, before = 0; n < nodes(); ++n) {
+      const size_t count = node_workers[n].size();
+      before += count;
+      auto& slice = slices[n];
+      slice.first = first;
+      slice.last = probe + (size - probe) * before / workers.size();
+      slice.grain = grain;
+      slice.parts = 2 * count;
+      jobs[n] = std::min(count, (slice.last - first + grain - 1) / grain);
+      total += jobs[n];
+      first = slice.last;
+    }
+
+    latch group(total);
+
+    for (size_t n = 0; n < nodes(); ++n) {
+      for (size_t j = 0; j < jobs[n]; ++j) {
+        submit(n, group, [&slices, &lambda, &begin, &token, n](){
+          for (size_t i = 0; i < slices.size(); ++i) {
+            drain(slices[(n + i) % slices.size()], begin, lambda, token);
+          }
+        });
+      }
+    }
+
+    wait(group);
+  }
+
+  // the minimum time a guided job should run for, to amortize its scheduling
+  static constexpr std::chrono::microseconds grain_time{50};
 
   struct job_t {
-    inline job_t(id_t id, function_t&& func)
-      : id(id), func(std::move(func)) {}
+    inline job_t() : id(0), group(nullptr), queued(0), span(0), lengthy(false) {}
+    inline job_t(id_t id, latch* group, task&& func)
+      : id(id), group(group), func(std::move(func)), queued(0), span(0), lengthy(false) {}
     id_t id;
-    function_t func;
+    latch* group;
+    task func;
+    uint64_t queued; // when it was pushed, if instrumented
+    uint64_t span;   // the profiled span it was pushed from, if profiling
+    bool lengthy;    // left to the idle workers, see spawn()
+  };
+
+  // statistics of a thread, only written by that thread unless it is one of the others
+  struct alignas(64) counters_t {
+    std::atomic<uint64_t> jobs{0};
+    std::atomic<uint64_t> steals{0};
+    std::atomic<uint64_t> busy{0};
+    std::atomic<uint64_t> idle{0};
+  };
+
+  /**
+   * \brief A double ended queue of jobs backed by a ring buffer, which only allocates when it
+   * needs to grow
+  */
+  class job_queue final {
+  public:
+    inline job_queue() : head(0), count(0) {}
+    inline bool empty() const {
+      return 0 == count;
+    }
+    inline void push_back(job_t&& job) {
+      if (count == buffer.size()) {
+        grow();
+      }
+      buffer[(head + count++) % buffer.size()] = std::move(job);
+    }
+    /**
+     * takes the most recent job, or the oldest one, skipping the lengthy ones if asked to
+     * \return false if there was none
+    */
+    inline bool take(job_t& job, bool newest, bool skip_lengthy) {
+      const size_t size = buffer.size();
+      for (size_t i = 0; i < count; ++i) {
+        size_t k = newest ? count - 1 - i : i;
+        if (skip_lengthy and buffer[(head + k) % size].lengthy) {
+          continue;
+        }
+        job = std::move(buffer[(head + k) % size]);
+        // closes the gap, the lengthy jobs skipped are few
+        if (newest) {
+          for (; k + 1 < count; ++k) {
+            buffer[(head + k) % size] = std::move(buffer[(head + k + 1) % size]);
+          }
+        } else {
+          for (; k > 0; --k) {
+            buffer[(head + k) % size] = std::move(buffer[(head + k - 1) % size]);
+          }
+          head = (head + 1) % size;
+        }
+        --count;
+        return true;
+      }
+      return false;
+    }
+  private:
+    void grow() {
+      std::vector<job_t> bigger(std::max<size_t>(64, buffer.size() * 2));
+      for (size_t i = 0; i < count; ++i) {
+        bigger[i] = std::move(buffer[(head + i) % buffer.size()]);
+      }
+      buffer.swap(bigger);
+      head = 0;
+    }
+    std::vector<job_t> buffer;
+    size_t head;
+    size_t count;
+  };
+
+  struct worker_t {
+    std::mutex mutex;
+    job_queue queue;
+    std::thread thread;
+    int cpu = -1;    // the CPU it is pinned to, if any
+    size_t node = 0; // the NUMA node it belongs to
+    counters_t counters;
   };
 
-  std::vector<std::thread> pool;
+  void push(job_t&& job);
+  void push(job_t&& job, size_t index);
+  bool pop(size_t index, job_t& job, bool helping);
+  bool steal(size_t index, job_t& job, bool helping);
+  bool acquire(size_t index, job_t& job, bool helping);
+  void execute(job_t& job);
+  bool done(id_t id);
+  size_t home();
+  size_t home(size_t node);
+  unique_lock guard(std::mutex& mutex);
+  counters_t& counters();
+  void sample(size_t queued);
+  void account(const job_t& job, uint64_t start);
+  uint64_t now() const;
+
+  std::vector<std::unique_ptr<worker_t>> workers;
+
+  // the indexes of the workers of each node
+  std::vector<std::vector<size_t>> node_workers;
+
+  // queued jobs, and workers waiting for one
+  std::atomic<size_t> pending;
+  std::atomic<size_t> sleeping;
+  std::mutex sleep_mutex;
+  std::condition_variable sleep_cond;
+
+  // jobs not yet completed, and threads waiting for one
   std::unordered_set<id_t> ids;
-  std::queue<job_t> queue;
-  std::mutex mutex;
-  std::condition_variable cond;
-  size_t workers;
-  bool stop;
-  id_t id_counter;
+  std::atomic<size_t> waiting;
+  std::mutex done_mutex;
+  std::condition_variable done_cond;
+
+  std::atomic<id_t> id_counter;
+  std::atomic<size_t> next;
+  std::atomic<bool> stop;
+
+  // statistics
+  const bool collect;
+  const uint64_t started;
+  counters_t others;
+  std::atomic<uint64_t> wait_total, wait_max, run_total, run_max, contention;
+  std::atomic<uint64_t> next_sample, depth_max;
+  std::vector<std::pair<uint64_t, size_t>> depth;
+  mutable std::mutex depth_mutex;
+
+  // the depth is sampled at most once per interval, and no more than max_samples times
+  static constexpr uint64_t sample_interval = 1000000;
+  static constexpr size_t max_samples = 1 << 16;
+
+  static bool instrument;
   static size_t max_threads;
+  static size_t fixed_batch_size;
+  static placement_t placement;
 };
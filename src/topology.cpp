@@ -0,0 +1,108 @@
+#include "topology.hpp"
+
+#include <fstream>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <cctype>
+#include <sched.h>
+#include <dirent.h>
+
+namespace topology {
+
+/**
+ * parses a kernel cpu list, such as "0-3,8,10-11"
+*/
+static std::vector<int> parse_list(const std::string& list) {
+  std::vector<int> ids;
+  size_t pos = 0;
+  while (pos < list.size()) {
+    const auto comma = std::min(list.find(',', pos), list.size());
+    const auto range = list.substr(pos, comma - pos);
+    const auto dash = range.find('-');
+    if (not range.empty()) {
+      const int first = std::stoi(range.substr(0, dash));
+      const int last = (dash == std::string::npos) ? first : std::stoi(range.substr(dash + 1));
+      for (int id = first; id <= last; ++id) {
+        ids.push_back(id);
+      }
+    }
+    pos = comma + 1;
+  }
+  return ids;
+}
+
+/**
+ * the NUMA node of each CPU, as listed in /sys/devices/system/node
+*/
+static std::map<int, int> nodes_of_cpus() {
+  std::map<int, int> nodes;
+
+  const auto root = "/sys/devices/system/node";
+  DIR* dir = opendir(root);
+  if (not dir) {
+    return nodes;
+  }
+
+  while (const auto entry = readdir(dir)) {
+    const std::string name(entry->d_name);
+    if (0 != name.compare(0, 4, "node") or name.size() == 4 or not isdigit(name[4])) {
+      continue;
+    }
+    std::ifstream is(std::string(root) + "/" + name + "/cpulist");
+    std::string list;
+    if (std::getline(is, list)) {
+      const int node = std::stoi(name.substr(4));
+      for (const int id : parse_list(list)) {
+        nodes[id] = node;
+      }
+    }
+  }
+
+  closedir(dir);
+  return nodes;
+}
+
+std::vector<cpu_t> cpus() {
+
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  if (0 != sched_getaffinity(0, sizeof(allowed), &allowed)) {
+    return {};
+  }
+
+  const auto nodes = nodes_of_cpus();
+
+  // the allowed CPUs grouped by node, nodes renumbered densely
+  std::map<int, std::vector<int>> groups;
+  for (int id = 0; id < CPU_SETSIZE; ++id) {
+    if (CPU_ISSET(id, &allowed)) {
+      const auto it = nodes.find(id);
+      groups[it == nodes.end() ? 0 : it->second].push_back(id);
+    }
+  }
+
+  std::vector<cpu_t> result;
+  for (size_t i = 0, added = 1; added; ++i) {
+    added = 0;
+    size_t node = 0;
+    for (const auto& group : groups) {
+      if (i < group.second.size()) {
+        result.push_back({group.second[i], node});
+        ++added;
+      }
+      ++node;
+    }
+  }
+
+  return result;
+}
+
+bool pin(int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return 0 == sched_setaffinity(0, sizeof(set), &set);
+}
+
+}
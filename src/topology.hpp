@@ -0,0 +1,30 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+/**
+ * \brief Discovery of the CPUs and NUMA nodes available to the process, read from sysfs without
+ * any additional dependency. Where the information is missing all the CPUs belong to node 0.
+*/
+namespace topology {
+
+struct cpu_t {
+  int id;      // as known by the kernel
+  size_t node; // dense index of the NUMA node, starting from 0
+};
+
+/**
+ * the CPUs the process is allowed to run on, interleaved by node so that any prefix of the
+ * list is spread across all the nodes as evenly as possible
+*/
+std::vector<cpu_t> cpus();
+
+/**
+ * binds the calling thread to the given CPU
+ * \param cpu the id of the CPU
+ * \return false if the kernel refused
+*/
+bool pin(int cpu);
+
+}